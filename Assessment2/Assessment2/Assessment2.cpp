@@ -9,16 +9,31 @@
 #include <array>
 
 #include "animation.h"
+#include "bvh.h"
 #include "camera.h"
+#include "capture.h"
+#include "cascades.h"
 #include "collision.h"
+#include "draw_list.h"
 #include "error.h"
 #include "file.h"
+#include "frame_stats.h"
+#include "frame_uniforms.h"
+#include "gbuffer.h"
+#include "gpu_timer.h"
 #include "shader.h"
+#include "shader_permutations.h"
 #include "shadow.h"
+#include "shadow_atlas.h"
+#include "shadow_filter.h"
+#include "shadow_scheduler.h"
 #include "texture.h"
 #include "light.h"
+#include "light_clusters.h"
 #include "model.h"
 #include "object_parser.h"
+#include "overdraw.h"
+#include "render_state.h"
 #include "torus.h"
 
 SCamera Camera;
@@ -79,13 +94,43 @@ std::vector<float> cube_vertices =
      -0.5f,  0.5f, -0.5f,  1.f, 1.f, 1.f, 1.f, 0.f, 1.f, 0.f,     0.0f, 0.0f
 };
 
-#define NUM_BUFFERS 20
-#define NUM_VAOS 20
-GLuint Buffers[NUM_BUFFERS];
-GLuint VAOs[NUM_VAOS];
+// Per-instance model and normal matrices live in one buffer, read through attribute locations 4-7 and 8-10
+#define INSTANCE_ATTRIB 4
+#define INSTANCE_NORMAL_ATTRIB 8
+#define INSTANCE_BINDING 4
+
+// One slot of the instance buffer, the normal matrix columns are padded to vec4
+struct InstanceData
+{
+    glm::mat4 model;
+    glm::vec4 normal[3];
+};
+GLuint instanceBuffer = 0;
+size_t instanceCapacity = 0;
+
+// The layered point light shadow draws read the instance buffer as storage, by draw item, and take one instance per
+// face a caster is seen in from the cube face buffer, draw item << 3 | face, through attribute location 12
+#define INSTANCE_STORAGE_BINDING 4
+#define CUBE_FACE_ATTRIB 12
+#define CUBE_FACE_BINDING 5
+
+GLuint cubeFaceBuffer = 0;
+std::vector<GLuint> cubeFaceInstances;
+std::vector<unsigned char> cubeFaceMasks; // Faces each opaque draw item is seen in
+
+// Instances of one mesh in the cube face buffer, drawn in one call
+struct CubeFaceBatch
+{
+    int item; // First draw item of the batch, for its vertex array and index count
+    GLuint firstInstance;
+    GLsizei instanceCount;
+};
+std::vector<CubeFaceBatch> cubeFaceBatches;
 
 #define WIDTH 1920
 #define HEIGHT 1080
+#define CAMERA_NEAR_PLANE 0.01f
+#define CAMERA_FAR_PLANE 100.f
 
 struct State
 {
@@ -98,178 +143,277 @@ struct State
     bool crouchEnabled = false;
 };
 
-void updateLightUniforms(GLuint program)
+// Uniform locations the render passes set every frame, resolved from the shader reflection once after linking
+struct PassUniforms
 {
-    glUniform1i(glGetUniformLocation(program, "numLights"), lights.size());
-
-    for (int i = 0; i < lights.size(); i++) 
-    {
-        std::string prefix = "lights[" + std::to_string(i) + "].";
-
-        glUniform1i(glGetUniformLocation(program, (prefix + "type").c_str()), lights[i].type);
-        glUniform3fv(glGetUniformLocation(program, (prefix + "position").c_str()), 1, glm::value_ptr(lights[i].position));
-        glUniform3fv(glGetUniformLocation(program, (prefix + "direction").c_str()), 1, glm::value_ptr(lights[i].direction));
-        glUniform3fv(glGetUniformLocation(program, (prefix + "colour").c_str()), 1, glm::value_ptr(lights[i].colour));
-        glUniform1f(glGetUniformLocation(program, (prefix + "intensity").c_str()), lights[i].intensity);
-        glUniform1i(glGetUniformLocation(program, (prefix + "isOn").c_str()), lights[i].isOn);
-
-    }
-}
+    GLint textureScale = -1;
+    GLint lightSpaceMatrix = -1;
+    GLint shadowMatrices = -1;
+    GLint lightPos = -1;
+    GLint farPlane = -1;
+    GLint face = -1;
+    GLint faceMask = -1;
+};
 
-void drawModels(unsigned int program)
+std::unordered_map<GLuint, PassUniforms> passUniforms;
+
+/**
+ * Ways of rendering the six face tiles of a point light's shadow in the atlas
+ * GEOMETRY amplifies every triangle to all six faces in a geometry shader, culled against the union of the face frusta
+ * VERTEX_VIEWPORT culls per face and draws each mesh once, with an instance for every face that sees it, and the
+ * vertex shader picks that face's viewport (ARB_shader_viewport_layer_array)
+ * SIX_PASSES culls per face and draws each face with its own viewport
+ * The modes double as GPU timer labels, so their cost can be compared at runtime
+ */
+enum CubeShadowMode
 {
-    for (model obj : models)
-    {
-	    if (obj.textures.hasOpacity)
-            continue; // skip transparent
+    CUBE_SHADOW_GEOMETRY,
+    CUBE_SHADOW_VERTEX_VIEWPORT,
+    CUBE_SHADOW_SIX_PASSES,
+    CUBE_SHADOW_MODES
+};
 
-        glBindVertexArray(VAOs[obj.bufferIndex]);
+const char* cubeShadowModeNames[CUBE_SHADOW_MODES] = { "geometry shader", "vertex viewport", "six passes" };
 
-        glUniform1f(glGetUniformLocation(program, "textureScale"), obj.textures.textureScale);
+// Program of each mode, 0 if the mode is not supported by the driver
+GLuint cubeShadowPrograms[CUBE_SHADOW_MODES] = {};
+CubeShadowMode cubeShadowMode = CUBE_SHADOW_GEOMETRY;
 
-        // Bind the texture to unit 0
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, obj.textures.albedo);
-        glUniform1i(glGetUniformLocation(program, "albedoMap"), 0);
+// GPU timer label of the lighting pass under each shadow filter, after the cube shadow modes
+#define LIGHTING_TIMER_LABEL(filter) (CUBE_SHADOW_MODES + (filter))
 
-        // Bind roughness if available, otherwise use a default value
-        glActiveTexture(GL_TEXTURE1);
-        if (obj.textures.hasRoughness)
-        {
-            glBindTexture(GL_TEXTURE_2D, obj.textures.roughness);
-        }
-        else glBindTexture(GL_TEXTURE_2D, 0);
-        glUniform1i(glGetUniformLocation(program, "roughnessMap"), 1);
+// GPU timer labels of the directional and spot light updates, their cost is what the shadow scheduler budgets with
+#define SHADOW_MAP_TIMER_LABEL LIGHTING_TIMER_LABEL(SHADOW_FILTERS)
+#define CASCADES_TIMER_LABEL (SHADOW_MAP_TIMER_LABEL + 1)
 
-        // Bind metallic if available, otherwise use a default value
-        glActiveTexture(GL_TEXTURE2);
-        if (obj.textures.hasMetallic)
-        {
-            glBindTexture(GL_TEXTURE_2D, obj.textures.metallic);
-        }
-        else glBindTexture(GL_TEXTURE_2D, 0);
-        glUniform1i(glGetUniformLocation(program, "metallicMap"), 2);
+// Forward lighting and the overdraw view's counting, the only feature of the count is where the fragments land
+ShaderPermutations forwardPermutations = { "pbr.vert", "pbr.frag", "", PERMUTATION_MATERIAL | PERMUTATION_LIGHTING };
+ShaderPermutations overdrawPermutations = { "pbr.vert", "overdraw.frag", "", 0 };
 
-        // Bind normal if available, otherwise use a default value
-        glActiveTexture(GL_TEXTURE3);
-        if (obj.textures.hasNormal)
-        {
-            glBindTexture(GL_TEXTURE_2D, obj.textures.normal);
-        }
-        else glBindTexture(GL_TEXTURE_2D, 0);
-        glUniform1i(glGetUniformLocation(program, "normalMap"), 3);
+// G-buffer and deferred lighting permutations of each layout, filled in at start up
+ShaderPermutations gbufferPermutations[GBUFFER_LAYOUTS];
+ShaderPermutations deferredLightingPermutations[GBUFFER_LAYOUTS];
 
-        // Bind ao if available, otherwise use a default value
-        glActiveTexture(GL_TEXTURE4);
-        if (obj.textures.hasAO)
-        {
-            glBindTexture(GL_TEXTURE_2D, obj.textures.ao);
-        }
-        else glBindTexture(GL_TEXTURE_2D, 0);
-        glUniform1i(glGetUniformLocation(program, "aoMap"), 4);
+// GPU timer labels of the deferred geometry and lighting passes under each G-buffer layout
+#define DEFERRED_GEOMETRY_TIMER_LABEL(layout) (CASCADES_TIMER_LABEL + 1 + (layout))
+#define DEFERRED_LIGHTING_TIMER_LABEL(layout) (DEFERRED_GEOMETRY_TIMER_LABEL(GBUFFER_LAYOUTS) + (layout))
 
+// Optional depth-only pre-pass of the forward camera pass, the opaque models then only shade the visible surface
+GLuint depthPrepassProgram = 0;
+bool depthPrepass = false;
 
-        glm::mat4 model = glm::mat4(1.f);
-        model = glm::translate(model, obj.position);
-        model = glm::rotate(model, glm::radians(obj.rotation.x), glm::vec3(1.f, 0.f, 0.f));
-        model = glm::rotate(model, glm::radians(obj.rotation.y), glm::vec3(0.f, 1.f, 0.f));
-        model = glm::rotate(model, glm::radians(obj.rotation.z), glm::vec3(0.f, 0.f, 1.f));
-        model = glm::scale(model, obj.scale);
+// GPU timer labels of the pre-pass and of the forward lighting after it under each shadow filter
+#define DEPTH_PREPASS_TIMER_LABEL DEFERRED_LIGHTING_TIMER_LABEL(GBUFFER_LAYOUTS)
+#define PREPASS_LIGHTING_TIMER_LABEL(filter) (DEPTH_PREPASS_TIMER_LABEL + 1 + (filter))
 
-        // Set the model matrix uniform
-        glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(model));
+void resolvePassUniforms(GLuint program)
+{
+    PassUniforms& uniforms = passUniforms[program];
+    uniforms.textureScale = uniformLocation(program, "textureScale");
+    uniforms.lightSpaceMatrix = uniformLocation(program, "LightSpaceMatrix");
+    uniforms.shadowMatrices = uniformLocation(program, "shadowMatrices");
+    uniforms.lightPos = uniformLocation(program, "lightPos");
+    uniforms.farPlane = uniformLocation(program, "farPlane");
+    uniforms.face = uniformLocation(program, "face");
+    uniforms.faceMask = uniformLocation(program, "faceMask");
+}
 
-        // Draw the triangles
-        // position (3), colour (3), normal (3), alpha (1), and texcoords (2) = 12 floats per vertex
-        // length of vertices divided by floats per vertex gives number of vertices per object
-        glDrawArrays(GL_TRIANGLES, 0, obj.vertices.size() / 12);
-    }
+// Program of a permutation, its uniforms are resolved when it is first compiled
+GLuint passProgram(ShaderPermutations& permutations, uint32_t key)
+{
+    GLuint program = permutationProgram(permutations, key);
+    if (passUniforms.find(program) == passUniforms.end())
+        resolvePassUniforms(program);
+    return program;
+}
 
-    std::vector<std::pair<float, int>> sortedTransparentModels;
-    for (int i = 0; i < models.size(); i++)
+// Bind a material's textures to units 0-4, the maps it lacks are left as they are since its permutation never samples them
+// The sampler units themselves are fixed by layout (binding) in pbr.frag
+// Nothing is issued if the material is already bound on the current program, and only textures that differ are rebound otherwise
+void bindMaterial(const PassUniforms& uniforms, int materialId)
+{
+    if (renderState.material == materialId)
     {
-        if (models[i].textures.hasOpacity) {
-            // Calculate world AABB center
-            AABB worldAABB = calculateWorldAABB(models[i]);
-            glm::vec3 center = (worldAABB.min + worldAABB.max) * 0.5f;
-            float distance = glm::length(Camera.Position - center); // Use center distance
-            sortedTransparentModels.push_back(std::make_pair(-distance, i));
-        }
+        countStateChange(false);
+        return;
     }
 
-    std::sort(sortedTransparentModels.begin(), sortedTransparentModels.end());
+    const PBRTextures& textures = materials[materialId].textures;
+    glUniform1f(uniforms.textureScale, textures.textureScale);
+
+    bindTextureUnit(0, textures.albedo);
+    if (textures.hasRoughness)
+        bindTextureUnit(1, textures.roughness);
+    if (textures.hasMetallic)
+        bindTextureUnit(2, textures.metallic);
+    if (textures.hasNormal)
+        bindTextureUnit(3, textures.normal);
+    if (textures.hasAO)
+        bindTextureUnit(4, textures.ao);
+    renderState.material = materialId;
+}
 
-    glDepthMask(GL_FALSE); // Disable depth writing for transparent objects
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    for (auto& pair : sortedTransparentModels)
+// Grow the instance matrix buffer and the cube face buffer, a face instance per item and cube face at most, and point
+// every mesh VAO, depth VAO and cube face VAO at the new ones
+void reserveInstances(size_t count)
+{
+    if (count <= instanceCapacity)
+        return;
+
+    instanceCapacity = count > instanceCapacity * 2 ? count : instanceCapacity * 2;
+    if (instanceBuffer != 0)
+        glDeleteBuffers(1, &instanceBuffer);
+    glCreateBuffers(1, &instanceBuffer);
+    glNamedBufferData(instanceBuffer, instanceCapacity * sizeof(InstanceData), NULL, GL_DYNAMIC_DRAW);
+
+    if (cubeFaceBuffer != 0)
+        glDeleteBuffers(1, &cubeFaceBuffer);
+    glCreateBuffers(1, &cubeFaceBuffer);
+    glNamedBufferData(cubeFaceBuffer, 6 * instanceCapacity * sizeof(GLuint), NULL, GL_STREAM_DRAW);
+
+    for (auto& mesh : meshes)
     {
-        model& obj = models[pair.second];
-        glBindVertexArray(VAOs[obj.bufferIndex]);
+        if (mesh.VAO != 0)
+            glVertexArrayVertexBuffer(mesh.VAO, INSTANCE_BINDING, instanceBuffer, 0, sizeof(InstanceData));
+        if (mesh.depthVAO != 0)
+            glVertexArrayVertexBuffer(mesh.depthVAO, INSTANCE_BINDING, instanceBuffer, 0, sizeof(InstanceData));
+        if (mesh.cubeFaceVAO != 0)
+            glVertexArrayVertexBuffer(mesh.cubeFaceVAO, CUBE_FACE_BINDING, cubeFaceBuffer, 0, sizeof(GLuint));
+    }
+}
 
-        glUniform1f(glGetUniformLocation(program, "textureScale"), obj.textures.textureScale);
+// Copy a model's cached matrices into its instance slot
+void fillInstance(InstanceData& instance, const model& m)
+{
+    instance.model = m.world;
+    for (int column = 0; column < 3; column++)
+        instance.normal[column] = glm::vec4(m.normal[column], 0.f);
+}
 
-        // Bind the texture to unit 0
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, obj.textures.albedo);
-        glUniform1i(glGetUniformLocation(program, "albedoMap"), 0);
+/**
+ * Bring everything the render passes read up to date, once per frame before any pass
+ * Only models moved since the last frame are recomputed, refitted in the BVH and rewritten in the instance buffer,
+ * the draw list and all instances are only rebuilt when models were added or changed material
+ */
+void updateScene()
+{
+    // Dirty the shadow maps of the lights a moved model affects, both where it was and where it is now
+    for (int id : dirtyModels)
+        invalidateShadowsTouching(models[id].worldAABB, models[id].dynamic);
+    updateModelTransforms();
+    for (int id : dirtyModels)
+        invalidateShadowsTouching(models[id].worldAABB, models[id].dynamic);
 
-        // Bind roughness if available, otherwise use a default value
-        glActiveTexture(GL_TEXTURE1);
-        if (obj.textures.hasRoughness)
-        {
-            glBindTexture(GL_TEXTURE_2D, obj.textures.roughness);
-        }
-        else glBindTexture(GL_TEXTURE_2D, 0);
-        glUniform1i(glGetUniformLocation(program, "roughnessMap"), 1);
+    updateSceneBVH();
 
-        // Bind metallic if available, otherwise use a default value
-        glActiveTexture(GL_TEXTURE2);
-        if (obj.textures.hasMetallic)
+    if (drawListDirty)
+    {
+        buildDrawList();
+        if (!drawList.items.empty())
         {
-            glBindTexture(GL_TEXTURE_2D, obj.textures.metallic);
+            reserveInstances(drawList.items.size());
+            InstanceData* instances = (InstanceData*)glMapNamedBufferRange(instanceBuffer, 0, drawList.items.size() * sizeof(InstanceData),
+                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+            for (size_t i = 0; i < drawList.items.size(); i++)
+                fillInstance(instances[i], models[drawList.items[i].model]);
+            glUnmapNamedBuffer(instanceBuffer);
         }
-        else glBindTexture(GL_TEXTURE_2D, 0);
-        glUniform1i(glGetUniformLocation(program, "metallicMap"), 2);
-
-        // Bind normal if available, otherwise use a default value
-        glActiveTexture(GL_TEXTURE3);
-        if (obj.textures.hasNormal)
+    }
+    else
+    {
+        for (int id : dirtyModels)
         {
-            glBindTexture(GL_TEXTURE_2D, obj.textures.normal);
+            refreshDrawItem(id);
+
+            InstanceData instance;
+            fillInstance(instance, models[id]);
+            glNamedBufferSubData(instanceBuffer, drawList.itemOfModel[id] * sizeof(InstanceData), sizeof(InstanceData), &instance);
         }
-        else glBindTexture(GL_TEXTURE_2D, 0);
-        glUniform1i(glGetUniformLocation(program, "normalMap"), 3);
+    }
+
+    dirtyModels.clear();
+}
 
-        // Bind ao if available, otherwise use a default value
-        glActiveTexture(GL_TEXTURE4);
-        if (obj.textures.hasAO)
+// Draw the instances from first to last of a batch that the current pass can see, consecutive visible ones in one call
+void drawVisibleInstances(const PassUniforms& uniforms, int material, int first, int last)
+{
+    bool bound = false;
+    int run = -1;
+    for (int i = first; i <= last; i++)
+    {
+        bool visible = i < last && drawList.visibleModels[drawList.items[i].model];
+        if (visible && run < 0)
+            run = i;
+        if (visible || run < 0)
+            continue;
+
+        const DrawItem& item = drawList.items[run];
+        if (!bound)
         {
-            glBindTexture(GL_TEXTURE_2D, obj.textures.ao);
+            bindMaterial(uniforms, material);
+            bindVertexArray(item.VAO);
+            bound = true;
         }
-        else glBindTexture(GL_TEXTURE_2D, 0);
-        glUniform1i(glGetUniformLocation(program, "aoMap"), 4);
 
+        // Draw the run of instances, their model matrices are read from the instance buffer
+        glDrawElementsInstancedBaseInstance(GL_TRIANGLES, item.indexCount, GL_UNSIGNED_INT, 0, i - run, run);
+        run = -1;
+    }
+}
+
+/**
+ * Draw the opaque batches the last cullDrawList() found visible, each with its material's permutation of the pass
+ * The batches are sorted by permutation, so the program only changes between buckets
+ *
+ *@param passKey permutation bits shared by every draw of the pass, see lightingPermutation()
+ */
+void drawOpaqueModels(ShaderPermutations& permutations, uint32_t passKey)
+{
+    for (const DrawBatch& batch : drawList.batches)
+    {
+        GLuint program = passProgram(permutations, passKey | batch.permutation);
+        useProgram(program);
+        drawVisibleInstances(passUniforms.at(program), batch.material, batch.firstInstance, batch.firstInstance + batch.instanceCount);
+    }
+}
 
-        glm::mat4 model = glm::mat4(1.f);
-        model = glm::translate(model, obj.position);
-        model = glm::rotate(model, glm::radians(obj.rotation.x), glm::vec3(1.f, 0.f, 0.f));
-        model = glm::rotate(model, glm::radians(obj.rotation.y), glm::vec3(0.f, 1.f, 0.f));
-        model = glm::rotate(model, glm::radians(obj.rotation.z), glm::vec3(0.f, 0.f, 1.f));
-        model = glm::scale(model, obj.scale);
+// Draw the transparent items the last cullDrawList() found visible, back to front and blended over what is there
+// Their order is by distance, so the program can change between any two of them
+void drawTransparentModels(ShaderPermutations& permutations, uint32_t passKey)
+{
+    sortTransparentItems(Camera.Position);
 
-        // Set the model matrix uniform
-        glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(model));
+    glDepthMask(GL_FALSE); // Disable depth writing for transparent objects
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    for (auto& pair : drawList.transparentOrder)
+    {
+        const DrawItem& item = drawList.items[pair.second];
+        if (!drawList.visibleModels[item.model])
+            continue;
 
-        // Draw the triangles
-        // position (3), colour (3), normal (3), alpha (1), and texcoords (2) = 12 floats per vertex
-        // length of vertices divided by floats per vertex gives number of vertices per object
-        glDrawArrays(GL_TRIANGLES, 0, obj.vertices.size() / 12);
+        GLuint program = passProgram(permutations, passKey | item.permutation);
+        useProgram(program);
+        drawVisibleInstances(passUniforms.at(program), item.material, pair.second, pair.second + 1);
     }
     glDisable(GL_BLEND);
     glDepthMask(GL_TRUE);
 }
 
+/**
+ * Draw the models seen by any of the given frusta, everything else is culled through the scene BVH
+ *
+ *@param passKey permutation bits shared by every draw of the pass
+ *@param viewProjections projection * view matrices of the pass, one per frustum (six for a cube map)
+ *@param passName label for the drawn and culled counts in the frame stats
+ */
+void drawModels(ShaderPermutations& permutations, uint32_t passKey, const glm::mat4* viewProjections, int frustumCount, const char* passName)
+{
+    cullDrawList(viewProjections, frustumCount, passName);
+    drawOpaqueModels(permutations, passKey);
+    drawTransparentModels(permutations, passKey);
+}
+
 void processKeyboard(GLFWwindow* window, double deltaTime)
 {
     if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
@@ -326,6 +470,53 @@ void processKeyboard(GLFWwindow* window, double deltaTime)
         resetAnimations();
     }
 
+    // Print the drawn and culled counts of every pass in the last frame and how the lights fell into clusters
+    if (keyJustPressed(GLFW_KEY_P))
+    {
+        printPassStats();
+        printLightClusterStats();
+    }
+
+    // Compare the cube shadow modes measured so far and switch to the next supported one
+    if (keyJustPressed(GLFW_KEY_C))
+    {
+        printf("\n%-16s %10s %8s\n", "cube shadows", "ms/face", "samples");
+        for (int mode = 0; mode < CUBE_SHADOW_MODES; mode++)
+        {
+            if (cubeShadowPrograms[mode])
+                printf("%-16s %10.3f %8u\n", cubeShadowModeNames[mode], averageGpuMs(mode), gpuTimers.stats[mode].samples);
+            else
+                printf("%-16s %10s\n", cubeShadowModeNames[mode], "unsupported");
+        }
+
+        do
+            cubeShadowMode = (CubeShadowMode)((cubeShadowMode + 1) % CUBE_SHADOW_MODES);
+        while (!cubeShadowPrograms[cubeShadowMode]);
+        printf("Cube shadows: %s\n", cubeShadowModeNames[cubeShadowMode]);
+
+        // Re-render every cube map so the new mode gets timed
+        for (Light& light : lights)
+            if (light.type == POSITIONAL)
+                light.shadow.updateShadow = true;
+    }
+
+    // Compare the lighting pass under the shadow filters measured so far and switch to the next one
+    if (keyJustPressed(GLFW_KEY_V))
+    {
+        printf("\n%-16s %10s %8s\n", "shadow filter", "avg ms", "samples");
+        for (int filter = 0; filter < SHADOW_FILTERS; filter++)
+            printf("%-16s %10.3f %8u\n", shadowFilterNames[filter], averageGpuMs(LIGHTING_TIMER_LABEL(filter)),
+                gpuTimers.stats[LIGHTING_TIMER_LABEL(filter)].samples);
+
+        shadowFilter = (ShadowFilter)((shadowFilter + 1) % SHADOW_FILTERS);
+        printf("Shadow filter: %s\n", shadowFilterNames[shadowFilter]);
+
+        // Moments are only kept up to date while they are used, rebuild them from fresh shadow maps
+        if (shadowFilter == SHADOW_FILTER_EVSM)
+            for (Light& light : lights)
+                light.shadow.updateShadow = true;
+    }
+
     if (!state->noClipEnabled)
         Camera.Position.y = 2.5f; // ground camera for first person effect
 
@@ -352,8 +543,66 @@ void processKeyboard(GLFWwindow* window, double deltaTime)
         lights[selectedLight].direction = Camera.Front;
         lights[selectedLight].position = Camera.Position;
         lights[selectedLight].shadow.updateShadow = true;
-        //saveShadowMapToBitmap(lights[0].shadow.Texture, SH_MAP_WIDTH, SH_MAP_HEIGHT);
+        lights[selectedLight].shadow.staticValid = false;
+        updateShadowVolume(lights[selectedLight]);
+    }
+
+    // Compare forward and deferred timings and the G-buffer layouts' memory, then switch to the next renderer
+    // Forward, then deferred with each G-buffer layout in turn
+    if (keyJustPressed(GLFW_KEY_B))
+    {
+        printf("\n%-16s %12s %12s %8s\n", "renderer", "geometry ms", "lighting ms", "samples");
+        printf("%-16s %12s %12.3f %8u\n", "forward", "-", averageGpuMs(LIGHTING_TIMER_LABEL(shadowFilter)),
+            gpuTimers.stats[LIGHTING_TIMER_LABEL(shadowFilter)].samples);
+        for (int layout = 0; layout < GBUFFER_LAYOUTS; layout++)
+        {
+            printf("deferred %-7s %12.3f %12.3f %8u\n", gbufferLayoutNames[layout], averageGpuMs(DEFERRED_GEOMETRY_TIMER_LABEL(layout)),
+                averageGpuMs(DEFERRED_LIGHTING_TIMER_LABEL(layout)), gpuTimers.stats[DEFERRED_LIGHTING_TIMER_LABEL(layout)].samples);
+        }
+        printGBufferReport();
+
+        if (!deferredShading)
+        {
+            deferredShading = true;
+            createGBufferTargets((GBufferLayout)0);
+        }
+        else if (gbuffer.layout + 1 < GBUFFER_LAYOUTS)
+            createGBufferTargets((GBufferLayout)(gbuffer.layout + 1));
+        else
+            deferredShading = false;
+
+        if (deferredShading)
+            printf("Renderer: deferred, %s G-buffer\n", gbufferLayoutNames[gbuffer.layout]);
+        else
+            printf("Renderer: forward\n");
+    }
+
+    // Compare the forward lighting with and without the depth pre-pass, then toggle it
+    // With the overdraw view on, the invocations per pixel of the last frame are printed too
+    if (keyJustPressed(GLFW_KEY_Z))
+    {
+        printf("\n%-16s %12s %12s %8s\n", "forward", "prepass ms", "lighting ms", "samples");
+        printf("%-16s %12s %12.3f %8u\n", "no prepass", "-", averageGpuMs(LIGHTING_TIMER_LABEL(shadowFilter)),
+            gpuTimers.stats[LIGHTING_TIMER_LABEL(shadowFilter)].samples);
+        printf("%-16s %12.3f %12.3f %8u\n", "depth prepass", averageGpuMs(DEPTH_PREPASS_TIMER_LABEL),
+            averageGpuMs(PREPASS_LIGHTING_TIMER_LABEL(shadowFilter)), gpuTimers.stats[PREPASS_LIGHTING_TIMER_LABEL(shadowFilter)].samples);
+        if (showOverdraw && !deferredShading)
+            printOverdrawStats(depthPrepass ? "depth prepass" : "no prepass");
+
+        depthPrepass = !depthPrepass;
+        printf("Depth prepass: %s\n", depthPrepass ? "on" : "off");
+    }
+
+    // Show the fragment shader invocations per pixel of the forward camera pass as a heat map
+    if (keyJustPressed(GLFW_KEY_X))
+    {
+        showOverdraw = !showOverdraw;
+        printf("Overdraw view: %s%s\n", showOverdraw ? "on" : "off", showOverdraw && deferredShading ? ", shown with the forward renderer only" : "");
     }
+
+    // Save the selected light's shadow map as PNG and PFM images, written in the background
+    if (keyJustPressed(GLFW_KEY_O))
+        captureShadow(selectedLight, CAPTURE_PNG | CAPTURE_PFM);
 }
 
 void SizeCallback(GLFWwindow* window, int w, int h)
@@ -361,98 +610,379 @@ void SizeCallback(GLFWwindow* window, int w, int h)
     glViewport(0, 0, w, h);
 }
 
-void generateDepthMap(unsigned int shadowShaderProgram, ShadowStruct shadow, glm::mat4 LightSpaceMatrix)
+/**
+ * Depth-only submission for the shadow passes, position-only vertex arrays and no material binds
+ * Transparent items are skipped so they never cast shadows, consecutive visible instances of a mesh are drawn in one call
+ * Only the items matching casters are drawn, see ShadowCasters
+ */
+void drawDepth(const glm::mat4* viewProjections, int frustumCount, ShadowCasters casters, const char* passName, int passIndex = -1)
 {
-    glViewport(0, 0, SH_MAP_WIDTH, SH_MAP_HEIGHT);
-    glBindFramebuffer(GL_FRAMEBUFFER, shadow.FBO);
-    glClear(GL_DEPTH_BUFFER_BIT);
-    glUseProgram(shadowShaderProgram);
-    glUniformMatrix4fv(glGetUniformLocation(shadowShaderProgram, "LightSpaceMatrix"),1, GL_FALSE, glm::value_ptr(LightSpaceMatrix));
-    drawModels(shadowShaderProgram);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    cullDrawList(viewProjections, frustumCount, passName, passIndex);
+
+    int run = -1;
+    for (int i = 0; i <= drawList.firstTransparent; i++)
+    {
+        bool visible = i < drawList.firstTransparent && drawList.visibleModels[drawList.items[i].model] && castsIn(drawList.items[i], casters);
+        if (run >= 0 && (!visible || drawList.items[i].depthVAO != drawList.items[run].depthVAO))
+        {
+            const DrawItem& item = drawList.items[run];
+            bindVertexArray(item.depthVAO);
+            glDrawElementsInstancedBaseInstance(GL_TRIANGLES, item.indexCount, GL_UNSIGNED_INT, 0, i - run, run);
+            run = -1;
+        }
+        if (visible && run < 0)
+            run = i;
+    }
 }
 
-void generateCubeMap(unsigned int shadowCubeMapProgram, ShadowStruct cubeMap, glm::mat4 transforms[], float far_plane, int lightIndex)
+void generateDepthMap(unsigned int shadowShaderProgram, Light& light, const glm::mat4& LightSpaceMatrix)
 {
-    // Set viewport for shadow mapping
-    glViewport(0, 0, SH_MAP_WIDTH, SH_MAP_HEIGHT);
-    glBindFramebuffer(GL_FRAMEBUFFER, cubeMap.FBO);
-    glClear(GL_DEPTH_BUFFER_BIT);
+    ShadowStruct& shadow = light.shadow;
+    useProgram(shadowShaderProgram);
+    glUniformMatrix4fv(passUniforms.at(shadowShaderProgram).lightSpaceMatrix, 1, GL_FALSE, glm::value_ptr(LightSpaceMatrix));
 
-    // Use the shadow cubemap shader program
-    glUseProgram(shadowCubeMapProgram);
+    // Render into the light's tile of the atlas only
+    glEnable(GL_SCISSOR_TEST);
+    setShadowViewport(0, shadow.x, shadow.y, shadow.size, shadow.size);
 
-    // Pass the transforms for each face of the cubemap
-    glUniformMatrix4fv(glGetUniformLocation(shadowCubeMapProgram, "shadowMatrices[0]"), 1, GL_FALSE, glm::value_ptr(transforms[0]));
-    glUniformMatrix4fv(glGetUniformLocation(shadowCubeMapProgram, "shadowMatrices[1]"), 1, GL_FALSE, glm::value_ptr(transforms[1]));
-    glUniformMatrix4fv(glGetUniformLocation(shadowCubeMapProgram, "shadowMatrices[2]"), 1, GL_FALSE, glm::value_ptr(transforms[2]));
-    glUniformMatrix4fv(glGetUniformLocation(shadowCubeMapProgram, "shadowMatrices[3]"), 1, GL_FALSE, glm::value_ptr(transforms[3]));
-    glUniformMatrix4fv(glGetUniformLocation(shadowCubeMapProgram, "shadowMatrices[4]"), 1, GL_FALSE, glm::value_ptr(transforms[4]));
-    glUniformMatrix4fv(glGetUniformLocation(shadowCubeMapProgram, "shadowMatrices[5]"), 1, GL_FALSE, glm::value_ptr(transforms[5]));
-
-    // Use the correct light position based on index
-    glUniform3f(glGetUniformLocation(shadowCubeMapProgram, "lightPos"),
-        lights[lightIndex].position.x,
-        lights[lightIndex].position.y,
-        lights[lightIndex].position.z);
-    glUniform1f(glGetUniformLocation(shadowCubeMapProgram, "farPlane"), far_plane);
+    if (!shadow.staticValid)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, shadowAtlas.staticFBO);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        drawDepth(&LightSpaceMatrix, 1, CASTERS_STATIC, "static shadow");
+        shadow.staticValid = true;
+    }
 
-    // Draw the scene
-    drawModels(shadowCubeMapProgram);
+    // Only the moving models are drawn, on top of a copy of the static depth
+    copyStaticShadow(light);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadowAtlas.FBO);
+    drawDepth(&LightSpaceMatrix, 1, CASTERS_DYNAMIC, "shadow");
 
-    // Reset framebuffer
+    glDisable(GL_SCISSOR_TEST);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-void renderWithShadows(unsigned int renderShadowProgram, std::vector<glm::mat4> lightSpaceMatrices, std::vector<std::array<glm::mat4, 6>> transforms, State state)
+/**
+ * Render the cascades of the cascaded light into their 2 x 2 block of the atlas
+ * Static depth is only re-rendered for the cascades that moved with the camera, unless the light's whole static cache is stale
+ */
+void generateCascades(unsigned int shadowShaderProgram, Light& light)
 {
-    glViewport(0, 0, WIDTH, HEIGHT);
-    glm::vec3 colour = rgb2vec(20, 20, 20);
-    static const GLfloat bgd[] = { colour.r, colour.g, colour.b, 1.f };
-    glClearBufferfv(GL_COLOR, 0, bgd);
-    glClear(GL_DEPTH_BUFFER_BIT);
+    ShadowStruct& shadow = light.shadow;
+    useProgram(shadowShaderProgram);
+    GLint lightSpaceMatrix = passUniforms.at(shadowShaderProgram).lightSpaceMatrix;
+    glEnable(GL_SCISSOR_TEST);
+
+    int x, y;
+    glBindFramebuffer(GL_FRAMEBUFFER, shadowAtlas.staticFBO);
+    for (int cascade = 0; cascade < SHADOW_CASCADES; cascade++)
+    {
+        if (shadow.staticValid && !(shadowCascades.moved & (1u << cascade)))
+            continue;
+        shadowCascadeOrigin(shadow, cascade, x, y);
+        setShadowViewport(0, x, y, shadow.size, shadow.size);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glUniformMatrix4fv(lightSpaceMatrix, 1, GL_FALSE, glm::value_ptr(light.shadowMatrices[cascade]));
+        drawDepth(&light.shadowMatrices[cascade], 1, CASTERS_STATIC, "static cascade", cascade);
+    }
+    shadow.staticValid = true;
 
-    glUseProgram(renderShadowProgram);
-	updateLightUniforms(renderShadowProgram);
+    // Only the moving models are drawn, on top of a copy of the static depth of all cascades
+    copyStaticShadow(light);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadowAtlas.FBO);
+    for (int cascade = 0; cascade < SHADOW_CASCADES; cascade++)
+    {
+        shadowCascadeOrigin(shadow, cascade, x, y);
+        setShadowViewport(0, x, y, shadow.size, shadow.size);
+        glUniformMatrix4fv(lightSpaceMatrix, 1, GL_FALSE, glm::value_ptr(light.shadowMatrices[cascade]));
+        drawDepth(&light.shadowMatrices[cascade], 1, CASTERS_DYNAMIC, "cascade", cascade);
+    }
 
-    for (int i = 0; i < lights.size(); i++) 
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    markCascadesRendered();
+}
+
+/**
+ * Layered submission of the cube faces, each face is culled on its own and every mesh is then drawn once with an
+ * instance per face that sees each of its items, the vertex shader takes the face and the item from the instance
+ * Each face still only draws what its own frustum sees, but the draw calls no longer scale with the faces
+ */
+void drawCubeFaceInstances(const glm::mat4 transforms[], unsigned int faces, ShadowCasters casters, const char* passName)
+{
+    cubeFaceMasks.assign(drawList.firstTransparent, 0);
+    for (int face = 0; face < 6; face++)
     {
-        if (lights[i].type == DIRECTIONAL || lights[i].type == SPOT)
+        if (!(faces & (1u << face)))
+            continue;
+        cullDrawList(&transforms[face], 1, passName, face);
+        for (int i = 0; i < drawList.firstTransparent; i++)
         {
-            glActiveTexture(GL_TEXTURE5 + i);
-            glBindTexture(GL_TEXTURE_2D, lights[i].shadow.Texture);
-            std::string uniformName = "shadowMaps[" + std::to_string(i) + "]";
-            glUniform1i(glGetUniformLocation(renderShadowProgram, uniformName.c_str()), 5 + i);
-
-            // Pass the matrix to the shader
-            std::string matrixUniformName = "lightSpaceMatrices[" + std::to_string(i) + "]";
-            glUniformMatrix4fv(glGetUniformLocation(renderShadowProgram, matrixUniformName.c_str()),1, GL_FALSE, glm::value_ptr(lightSpaceMatrices[i]));
+            if (drawList.visibleModels[drawList.items[i].model] && castsIn(drawList.items[i], casters))
+                cubeFaceMasks[i] |= 1u << face;
         }
-        else if (lights[i].type == POSITIONAL)
+    }
+
+    // Face instances grouped by mesh, the draw list keeps the items of a mesh together
+    cubeFaceInstances.clear();
+    cubeFaceBatches.clear();
+    for (int i = 0; i < drawList.firstTransparent; i++)
+    {
+        if (!cubeFaceMasks[i])
+            continue;
+        if (cubeFaceBatches.empty() || drawList.items[cubeFaceBatches.back().item].depthVAO != drawList.items[i].depthVAO)
+            cubeFaceBatches.push_back({ i, (GLuint)cubeFaceInstances.size(), 0 });
+        for (int face = 0; face < 6; face++)
         {
-            // Use texture unit 15 + pointLightIndex
-            int textureUnit = 15 + i;
-            glActiveTexture(GL_TEXTURE0 + textureUnit);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, lights[i].shadow.Texture);
+            if (cubeFaceMasks[i] & (1u << face))
+                cubeFaceInstances.push_back((GLuint)i << 3 | (GLuint)face);
+        }
+        cubeFaceBatches.back().instanceCount = (GLsizei)(cubeFaceInstances.size() - cubeFaceBatches.back().firstInstance);
+    }
+    if (cubeFaceInstances.empty())
+        return;
+
+    glNamedBufferSubData(cubeFaceBuffer, 0, cubeFaceInstances.size() * sizeof(GLuint), cubeFaceInstances.data());
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCE_STORAGE_BINDING, instanceBuffer);
+    for (const CubeFaceBatch& batch : cubeFaceBatches)
+    {
+        const DrawItem& item = drawList.items[batch.item];
+        bindVertexArray(meshes[item.mesh].cubeFaceVAO);
+        glDrawElementsInstancedBaseInstance(GL_TRIANGLES, item.indexCount, GL_UNSIGNED_INT, 0, batch.instanceCount, batch.firstInstance);
+    }
+}
 
-            std::string uniformName = "shadowCubeMaps[" + std::to_string(i) + "]";
-            glUniform1i(glGetUniformLocation(renderShadowProgram, uniformName.c_str()), textureUnit);
+/**
+ * Draw the casters into the face tiles of a point light whose bit is set in faces, with one viewport per face or one pass
+ * per face depending on the cube shadow mode. The tiles are laid out from cubeMap's origin in the FBO's texture
+ */
+void drawCubeFaces(const PassUniforms& uniforms, const glm::mat4 transforms[], const ShadowStruct& cubeMap, unsigned int faces, GLuint FBO, bool clear, ShadowCasters casters, const char* passName)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
 
-            std::string posUniformName = "pointLightPositions[" + std::to_string(i) + "]";
-            glUniform3fv(glGetUniformLocation(renderShadowProgram, posUniformName.c_str()), 1, glm::value_ptr(lights[i].position));
+    int x, y;
+    for (int face = 0; face < 6 && clear; face++)
+    {
+        if (!(faces & (1u << face)))
+            continue;
+        shadowFaceOrigin(cubeMap, face, x, y);
+        setShadowViewport(0, x, y, cubeMap.size, cubeMap.size);
+        glClear(GL_DEPTH_BUFFER_BIT);
+    }
+
+    if (cubeShadowMode == CUBE_SHADOW_SIX_PASSES)
+    {
+        for (int face = 0; face < 6; face++)
+        {
+            if (!(faces & (1u << face)))
+                continue;
+            shadowFaceOrigin(cubeMap, face, x, y);
+            setShadowViewport(0, x, y, cubeMap.size, cubeMap.size);
+            glUniform1i(uniforms.face, face);
+            drawDepth(&transforms[face], 1, casters, passName, face);
         }
+        return;
     }
 
-    // Set up camera matrices
-    glm::mat4 view = glm::lookAt(Camera.Position, Camera.Position + Camera.Front, Camera.Up);
-    glUniformMatrix4fv(glGetUniformLocation(renderShadowProgram, "view"),1, GL_FALSE, glm::value_ptr(view));
+    // The shaders route each face to viewport index face
+    glm::mat4 drawnTransforms[6];
+    int drawnFaces = 0;
+    for (int face = 0; face < 6; face++)
+    {
+        if (!(faces & (1u << face)))
+            continue;
+        shadowFaceOrigin(cubeMap, face, x, y);
+        setShadowViewport(face, x, y, cubeMap.size, cubeMap.size);
+        drawnTransforms[drawnFaces++] = transforms[face];
+    }
+
+    if (cubeShadowMode == CUBE_SHADOW_GEOMETRY)
+    {
+        // Draw the scene once, culled against the drawn faces together, the geometry shader skips the others
+        glUniform1i(uniforms.faceMask, (GLint)faces);
+        drawDepth(drawnTransforms, drawnFaces, casters, passName);
+        return;
+    }
+
+    drawCubeFaceInstances(transforms, faces, casters, passName);
+}
+
+/**
+ * Render some faces of the point light update in progress into the staging region, see CubeShadowProgress
+ * Once all six faces are there they replace the light's tile in one copy and its moments are rebuilt
+ */
+void generateCubeFaces(unsigned int faces)
+{
+    CubeShadowProgress& progress = shadowScheduler.cube;
+    Light& light = lights[progress.light];
+    ShadowStruct& cubeMap = light.shadow;
+    GLuint program = cubeShadowPrograms[cubeShadowMode];
+    beginGpuTimer(cubeShadowMode, (float)cubeFaceCount(faces));
+    useProgram(program);
+
+    // Every face of the update uses the matrices and position the light had when it started
+    const PassUniforms& uniforms = passUniforms.at(program);
+    glUniformMatrix4fv(uniforms.shadowMatrices, 6, GL_FALSE, glm::value_ptr(progress.matrices[0]));
+    glUniform3fv(uniforms.lightPos, 1, glm::value_ptr(progress.position));
+    glUniform1f(uniforms.farPlane, CUBE_SHADOW_FAR_PLANE);
+
+    glEnable(GL_SCISSOR_TEST);
+    unsigned int staticFaces = faces & progress.staticStale;
+    if (staticFaces)
+    {
+        drawCubeFaces(uniforms, progress.matrices, cubeMap, staticFaces, shadowAtlas.staticFBO, true, CASTERS_STATIC, "static cube face");
+        progress.staticStale &= ~staticFaces;
+    }
+
+    // Only the moving models are drawn, on top of a copy of each face's static depth in the staging region
+    ShadowStruct staging = cubeMap;
+    staging.x = 0;
+    staging.y = 0;
+    int x, y, stagingX, stagingY;
+    for (int face = 0; face < 6; face++)
+    {
+        if (!(faces & (1u << face)))
+            continue;
+        shadowFaceOrigin(cubeMap, face, x, y);
+        shadowFaceOrigin(staging, face, stagingX, stagingY);
+        glCopyImageSubData(shadowAtlas.staticTexture, GL_TEXTURE_2D, 0, x, y, 0,
+            shadowAtlas.stagingTexture, GL_TEXTURE_2D, 0, stagingX, stagingY, 0, cubeMap.size, cubeMap.size, 1);
+    }
+    drawCubeFaces(uniforms, progress.matrices, staging, faces, shadowAtlas.stagingFBO, false, CASTERS_DYNAMIC, "cube face");
+    progress.done |= faces;
 
-    glUniform1f(glGetUniformLocation(renderShadowProgram, "farPlane"), 25.0f);
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (progress.done == ALL_CUBE_FACES)
+    {
+        glCopyImageSubData(shadowAtlas.stagingTexture, GL_TEXTURE_2D, 0, 0, 0, 0,
+            shadowAtlas.texture, GL_TEXTURE_2D, 0, cubeMap.x, cubeMap.y, 0, 3 * cubeMap.size, 2 * cubeMap.size, 1);
+        if (shadowFilter == SHADOW_FILTER_EVSM)
+            filterShadowMoments(light);
+        finishCubeShadowUpdate();
+    }
+    endGpuTimer();
+}
+
+// Cost of each kind of shadow update for the scheduler, measured on the GPU once there are samples
+ShadowUpdateCosts measuredShadowCosts()
+{
+    ShadowUpdateCosts costs;
+    if (gpuTimers.stats[SHADOW_MAP_TIMER_LABEL].samples > 0)
+        costs.mapMs = (float)averageGpuMs(SHADOW_MAP_TIMER_LABEL);
+    if (gpuTimers.stats[CASCADES_TIMER_LABEL].samples > 0)
+        costs.cascadesMs = (float)averageGpuMs(CASCADES_TIMER_LABEL);
+    if (gpuTimers.stats[cubeShadowMode].samples > 0)
+        costs.faceMs = (float)averageGpuMs(cubeShadowMode);
+    return costs;
+}
 
-    glm::mat4 projection = glm::perspective(glm::radians(state.FOV),(float)WIDTH / (float)HEIGHT, 0.01f, 100.f);
-    glUniformMatrix4fv(glGetUniformLocation(renderShadowProgram, "projection"),1, GL_FALSE, glm::value_ptr(projection));
+glm::mat4 cameraView()
+{
+    return glm::lookAt(Camera.Position, Camera.Position + Camera.Front, Camera.Up);
+}
 
-    drawModels(renderShadowProgram);
+glm::mat4 cameraProjection(const State& state)
+{
+    return glm::perspective(glm::radians(state.FOV), (float)WIDTH / (float)HEIGHT, CAMERA_NEAR_PLANE, CAMERA_FAR_PLANE);
+}
+
+/**
+ * Deferred shading of the camera pass, the opaque models fill the G-buffer and one full screen pass lights every
+ * pixel into the default framebuffer and fills its depth, then the transparent models are drawn forward on top
+ * Lighting is per pixel, so unlike the forward path the opaque edges are not multisampled
+ */
+void renderDeferred(uint32_t lightingKey, const glm::mat4& viewProjection)
+{
+    GBufferLayout layout = gbuffer.layout;
+    cullDrawList(&viewProjection, 1, "camera");
+
+    // Blending would mix the surface with what the previous frame left in the targets
+    beginGpuTimer(DEFERRED_GEOMETRY_TIMER_LABEL(layout));
+    glDisable(GL_BLEND);
+    glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.FBO);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    drawOpaqueModels(gbufferPermutations[layout], 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    endGpuTimer();
+
+    beginGpuTimer(DEFERRED_LIGHTING_TIMER_LABEL(layout));
+    useProgram(passProgram(deferredLightingPermutations[layout], lightingKey));
+    bindGBufferTextures();
+    bindVertexArray(gbuffer.vertexArray);
+    glDepthFunc(GL_ALWAYS);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glDepthFunc(GL_LESS);
+    endGpuTimer();
+
+    drawTransparentModels(forwardPermutations, lightingKey);
+}
+
+void renderWithShadows(const std::vector<glm::mat4>& lightSpaceMatrices, const State& state)
+{
+    glViewport(0, 0, WIDTH, HEIGHT);
+    glm::vec3 colour = rgb2vec(20, 20, 20);
+    static const GLfloat bgd[] = { colour.r, colour.g, colour.b, 1.f };
+    glClearBufferfv(GL_COLOR, 0, bgd);
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    // Sort the lights into the view's clusters, then set up camera matrices in one uniform buffer upload
+    glm::mat4 view = cameraView();
+    glm::mat4 projection = cameraProjection(state);
+    updateLightClusters(view, projection, CAMERA_NEAR_PLANE, CAMERA_FAR_PLANE, WIDTH, HEIGHT, lightSpaceMatrices);
+    updateFrameUniforms(view, projection, Camera.Position, CUBE_SHADOW_FAR_PLANE);
+
+    // Every light's shadow map is a tile of the atlas on unit 5, and again on unit 7 through the comparing sampler
+    // Their prefiltered moments are on unit 6
+    bindTextureUnit(5, shadowAtlas.texture);
+    bindTextureUnit(6, shadowMoments.texture);
+    bindTextureUnit(7, shadowAtlas.texture);
+
+    // Permutation of the lighting for the light types that are on and the shadow filter, each draw adds its material's
+    glm::mat4 viewProjection = projection * view;
+    uint32_t lightingKey = lightingPermutation();
+    if (deferredShading)
+    {
+        renderDeferred(lightingKey, viewProjection);
+        return;
+    }
+
+    // The overdraw view counts with its own program into the same depth the lit image would see, and is not timed
+    ShaderPermutations* colourPermutations = &forwardPermutations;
+    if (showOverdraw)
+    {
+        colourPermutations = &overdrawPermutations;
+        beginOverdrawCount();
+    }
+
+    if (!depthPrepass)
+    {
+        beginGpuTimer(showOverdraw ? -1 : LIGHTING_TIMER_LABEL(shadowFilter));
+        drawModels(*colourPermutations, lightingKey, &viewProjection, 1, "camera");
+        endGpuTimer();
+    }
+    else
+    {
+        beginGpuTimer(showOverdraw ? -1 : DEPTH_PREPASS_TIMER_LABEL);
+        useProgram(depthPrepassProgram);
+        drawDepth(&viewProjection, 1, CASTERS_ALL, "camera");
+        endGpuTimer();
+
+        // Hidden opaque fragments now fail the depth test before they are shaded, so each pixel is lit once
+        // Transparent models blend over what is behind them and go back to the usual test
+        beginGpuTimer(showOverdraw ? -1 : PREPASS_LIGHTING_TIMER_LABEL(shadowFilter));
+        glDepthFunc(GL_EQUAL);
+        glDepthMask(GL_FALSE);
+        drawOpaqueModels(*colourPermutations, lightingKey);
+        glDepthMask(GL_TRUE);
+        glDepthFunc(GL_LESS);
+        drawTransparentModels(*colourPermutations, lightingKey);
+        endGpuTimer();
+    }
+
+    if (showOverdraw)
+        drawOverdrawView();
 }
 
 void mouseCallback(GLFWwindow* window, double xpos, double ypos)
@@ -489,23 +1019,88 @@ void ScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
         state->FOV = 45.0f;
 }
 
-void initialiseBuffers(std::vector<float> vertices, int bufferIndex)
+void initialiseBuffers(Mesh& mesh)
 {
-    glNamedBufferStorage(Buffers[bufferIndex], vertices.size() * sizeof(float), vertices.data(), 0);
-    glBindVertexArray(VAOs[bufferIndex]);
-    glBindBuffer(GL_ARRAY_BUFFER, Buffers[bufferIndex]);
+    glCreateBuffers(1, &mesh.VBO);
+    glCreateBuffers(1, &mesh.EBO);
+    glGenVertexArrays(1, &mesh.VAO);
+
+    glNamedBufferStorage(mesh.VBO, mesh.vertices.size() * sizeof(float), mesh.vertices.data(), 0);
+    glNamedBufferStorage(mesh.EBO, mesh.indices.size() * sizeof(unsigned int), mesh.indices.data(), 0);
+    glBindVertexArray(mesh.VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.VBO);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.EBO);
     // Position (3 floats)
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 12 * sizeof(float), (void*)0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, FLOATS_PER_VERTEX * sizeof(float), (void*)0);
     glEnableVertexAttribArray(0);
     // Colour (3 floats) + alpha (1)
-    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 12 * sizeof(float), (void*)(3 * sizeof(float)));
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, FLOATS_PER_VERTEX * sizeof(float), (void*)(3 * sizeof(float)));
     glEnableVertexAttribArray(1);
     // Normal (3 floats)
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 12 * sizeof(float), (void*)(7 * sizeof(float)));
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, FLOATS_PER_VERTEX * sizeof(float), (void*)(7 * sizeof(float)));
     glEnableVertexAttribArray(2);
     // Texture (2 floats)
-    glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, 12 * sizeof(float), (void*)(10 * sizeof(float)));
+    glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, FLOATS_PER_VERTEX * sizeof(float), (void*)(10 * sizeof(float)));
     glEnableVertexAttribArray(3);
+
+    // Instance model matrix, one vec4 column per location, advancing once per instance
+    for (int column = 0; column < 4; column++)
+    {
+        glVertexArrayAttribFormat(mesh.VAO, INSTANCE_ATTRIB + column, 4, GL_FLOAT, GL_FALSE, column * sizeof(glm::vec4));
+        glVertexArrayAttribBinding(mesh.VAO, INSTANCE_ATTRIB + column, INSTANCE_BINDING);
+        glEnableVertexArrayAttrib(mesh.VAO, INSTANCE_ATTRIB + column);
+    }
+    // Instance normal matrix, three vec3 columns each padded to a vec4
+    for (int column = 0; column < 3; column++)
+    {
+        glVertexArrayAttribFormat(mesh.VAO, INSTANCE_NORMAL_ATTRIB + column, 3, GL_FLOAT, GL_FALSE, offsetof(InstanceData, normal) + column * sizeof(glm::vec4));
+        glVertexArrayAttribBinding(mesh.VAO, INSTANCE_NORMAL_ATTRIB + column, INSTANCE_BINDING);
+        glEnableVertexArrayAttrib(mesh.VAO, INSTANCE_NORMAL_ATTRIB + column);
+    }
+    glVertexArrayBindingDivisor(mesh.VAO, INSTANCE_BINDING, 1);
+    if (instanceBuffer != 0)
+        glVertexArrayVertexBuffer(mesh.VAO, INSTANCE_BINDING, instanceBuffer, 0, sizeof(InstanceData));
+
+    // Depth-only stream, the shadow passes only read a tightly packed position and the instance model matrix
+    std::vector<float> positions;
+    positions.reserve(mesh.vertices.size() / FLOATS_PER_VERTEX * 3);
+    for (size_t i = 0; i + 2 < mesh.vertices.size(); i += FLOATS_PER_VERTEX)
+        positions.insert(positions.end(), mesh.vertices.begin() + i, mesh.vertices.begin() + i + 3);
+
+    glCreateBuffers(1, &mesh.positionVBO);
+    glNamedBufferStorage(mesh.positionVBO, positions.size() * sizeof(float), positions.data(), 0);
+    glCreateVertexArrays(1, &mesh.depthVAO);
+    glVertexArrayElementBuffer(mesh.depthVAO, mesh.EBO);
+
+    glVertexArrayVertexBuffer(mesh.depthVAO, 0, mesh.positionVBO, 0, 3 * sizeof(float));
+    glVertexArrayAttribFormat(mesh.depthVAO, 0, 3, GL_FLOAT, GL_FALSE, 0);
+    glVertexArrayAttribBinding(mesh.depthVAO, 0, 0);
+    glEnableVertexArrayAttrib(mesh.depthVAO, 0);
+
+    for (int column = 0; column < 4; column++)
+    {
+        glVertexArrayAttribFormat(mesh.depthVAO, INSTANCE_ATTRIB + column, 4, GL_FLOAT, GL_FALSE, column * sizeof(glm::vec4));
+        glVertexArrayAttribBinding(mesh.depthVAO, INSTANCE_ATTRIB + column, INSTANCE_BINDING);
+        glEnableVertexArrayAttrib(mesh.depthVAO, INSTANCE_ATTRIB + column);
+    }
+    glVertexArrayBindingDivisor(mesh.depthVAO, INSTANCE_BINDING, 1);
+    if (instanceBuffer != 0)
+        glVertexArrayVertexBuffer(mesh.depthVAO, INSTANCE_BINDING, instanceBuffer, 0, sizeof(InstanceData));
+
+    // Layered cube face stream, the positions and one face instance per face a caster is drawn into
+    glCreateVertexArrays(1, &mesh.cubeFaceVAO);
+    glVertexArrayElementBuffer(mesh.cubeFaceVAO, mesh.EBO);
+    glVertexArrayVertexBuffer(mesh.cubeFaceVAO, 0, mesh.positionVBO, 0, 3 * sizeof(float));
+    glVertexArrayAttribFormat(mesh.cubeFaceVAO, 0, 3, GL_FLOAT, GL_FALSE, 0);
+    glVertexArrayAttribBinding(mesh.cubeFaceVAO, 0, 0);
+    glEnableVertexArrayAttrib(mesh.cubeFaceVAO, 0);
+
+    glVertexArrayAttribIFormat(mesh.cubeFaceVAO, CUBE_FACE_ATTRIB, 1, GL_UNSIGNED_INT, 0);
+    glVertexArrayAttribBinding(mesh.cubeFaceVAO, CUBE_FACE_ATTRIB, CUBE_FACE_BINDING);
+    glEnableVertexArrayAttrib(mesh.cubeFaceVAO, CUBE_FACE_ATTRIB);
+    glVertexArrayBindingDivisor(mesh.cubeFaceVAO, CUBE_FACE_BINDING, 1);
+    if (cubeFaceBuffer != 0)
+        glVertexArrayVertexBuffer(mesh.cubeFaceVAO, CUBE_FACE_BINDING, cubeFaceBuffer, 0, sizeof(GLuint));
 }
 
 void handleInteraction(int modelId, float distance)
@@ -530,27 +1125,44 @@ void handleInteraction(int modelId, float distance)
 
         setTranformations(modelId, newPosition, newRotation, models.at(modelId).scale);
 
-        // Toggle the lights
+        // Toggle the lights, switching does not change their depth so shadow maps left dirty while off are rendered when back on
         if (modelId == interactableObjects.at(0)) // First light switch toggles directional light
         {
             lights.at(0).isOn = !lights.at(0).isOn;
-            lights.at(0).shadow.updateShadow = true;
         }
         else if(modelId == interactableObjects.at(1)) // Middle light switch toggles both of the spotlights
         {
             lights.at(1).isOn = !lights.at(1).isOn;
             lights.at(2).isOn = !lights.at(2).isOn;
-            lights.at(1).shadow.updateShadow = true;
-            lights.at(2).shadow.updateShadow = true;
         }
         else if (modelId == interactableObjects.at(2)) // Third light switch toggles the positional light 
         {
             lights.at(3).isOn = !lights.at(3).isOn;
-            lights.at(3).shadow.updateShadow = true;
         }
     }
 }
 
+/**
+ * Mark the models an animation or interaction can move as dynamic, everything else is static
+ * Static models are rendered once into each light's cached shadow map, dynamic ones on every shadow update
+ */
+void tagDynamicModels()
+{
+    for (model& m : models)
+        m.dynamic = false;
+    for (const Animation& anim : animations)
+        models.at(anim.model).dynamic = true;
+    for (int id : interactableObjects)
+        models.at(id).dynamic = true;
+
+    int dynamicCount = 0;
+    for (const model& m : models)
+        dynamicCount += m.dynamic ? 1 : 0;
+    printf("Shadow: %i dynamic models drawn over the cached static shadows\n", dynamicCount);
+
+    drawListDirty = true;
+}
+
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 {
     if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS) 
@@ -565,7 +1177,7 @@ void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
         // Iterate through all models
         for (int i = 0; i < models.size(); ++i) 
         {
-            AABB worldAABB = calculateWorldAABB(models.at(i));
+            const AABB& worldAABB = models.at(i).worldAABB;
             float intersectionDist;
             // Check for intersection
             if (intersectRayAABB(rayOrigin, rayDir, worldAABB, intersectionDist)) 
@@ -605,7 +1217,6 @@ int main(int argc, char** argv)
 
     // Store the calculated matrices here
     std::vector<glm::mat4> lightSpaceMatrices;
-    std::vector<std::array<glm::mat4, 6>> cubeMapMatrices;
 
     // Use state to store variables like FOV and booleans for crouch
     State state;
@@ -740,17 +1351,21 @@ int main(int argc, char** argv)
     torus_blue = addModel(transparent_torus_vertices, "../textures/blue.png");
 
     // Manually set torus's opacity boolean
-    models.at(torus_green).textures.hasOpacity = true;
-    models.at(torus_red).textures.hasOpacity = true;
-    models.at(torus_blue).textures.hasOpacity = true;
+    setOpacity(torus_green, true);
+    setOpacity(torus_red, true);
+    setOpacity(torus_blue, true);
+
+    // Wait for the loader workers and upload every mesh and texture queued above
+    finishLoadingAssets();
+    print_texture_stats();
 
     // Add light switch to the interactable list of models
     interactableObjects.push_back(light_switch);
 
     // Make the textures smaller
-    models.at(floor).textures.textureScale = 12.f;
-    models.at(counter_top).textures.textureScale = 4.f;
-    models.at(wall).textures.textureScale = 4.f;
+    setTextureScale(floor, 12.f);
+    setTextureScale(counter_top, 4.f);
+    setTextureScale(wall, 4.f);
 
     // Setting transformations for models
     setTranformations(table, glm::vec3(5, 0, 0), glm::vec3(0), glm::vec3(0.0225f));
@@ -774,9 +1389,12 @@ int main(int argc, char** argv)
     setTranformations(torus_blue, glm::vec3(5.1, 1.82, 0), glm::vec3(90, 0, 0), glm::vec3(0.15));
     setTranformations(torus_green, glm::vec3(5.1, 1.87, 0), glm::vec3(90,0,0), glm::vec3(0.115));
 
-    // Initialise AABB
-    for (auto& model : models)
-        calculateAABB(model);
+    // Initialise AABB, meshes loaded from a .obj already have theirs from the mesh cache or parser
+    for (auto& mesh : meshes)
+    {
+        if (mesh.aabb.min.x > mesh.aabb.max.x)
+            calculateAABB(mesh);
+    }
 
     // Add lighting to the scene
     addDirectionalLight(glm::normalize(glm::vec3(0.01f, -1.0f, -0.01f)), glm::vec3(1), 0.35f);
@@ -785,21 +1403,52 @@ int main(int argc, char** argv)
     addPositionalLight(glm::vec3(5, 6, 0), rgb2vec(255,223,142) , 6.f);
 
     // Reserve memory for lights
-    cubeMapMatrices.reserve(lights.size());
     lightSpaceMatrices.reserve(lights.size());
 
-    GLuint program = CompileShader("pbr.vert", "pbr.frag");
     GLuint shadow_program = CompileShader("shadow.vert", "shadow.frag");
     GLuint shadow_cubemap_program = CompileShader("shadowCubeMap.vert", "shadowCubeMap.frag", "shadowCubeMap.geom");
 
-    InitCamera(Camera);
+    // Cube shadows cull per face when the vertex shader can pick the viewport, and fall back to six passes otherwise
+    cubeShadowPrograms[CUBE_SHADOW_GEOMETRY] = shadow_cubemap_program;
+    cubeShadowPrograms[CUBE_SHADOW_SIX_PASSES] = CompileShader("shadowCubeMapFace.vert", "shadowCubeMap.frag");
+    // The layered mode also reads the instance buffer as storage from its vertex shader, which GL 4.5 makes optional
+    GLint vertexStorageBlocks = 0;
+    glGetIntegerv(GL_MAX_VERTEX_SHADER_STORAGE_BLOCKS, &vertexStorageBlocks);
+    if (hasGLExtension("GL_ARB_shader_viewport_layer_array") && vertexStorageBlocks > 0)
+        cubeShadowPrograms[CUBE_SHADOW_VERTEX_VIEWPORT] = CompileShader("shadowCubeMapViewport.vert", "shadowCubeMap.frag");
+    cubeShadowMode = cubeShadowPrograms[CUBE_SHADOW_VERTEX_VIEWPORT] ? CUBE_SHADOW_VERTEX_VIEWPORT : CUBE_SHADOW_SIX_PASSES;
+    printf("Cube shadows: %s\n", cubeShadowModeNames[cubeShadowMode]);
+    resolvePassUniforms(shadow_program);
+    depthPrepassProgram = CompileShader("depthPrepass.vert", "shadow.frag");
+
+    // Deferred shading permutations, the G-buffer pass of each layout by material and its lighting pass by light types
+    // and shadow filter, the programs themselves are compiled the first time a frame needs them
+    for (int layout = 0; layout < GBUFFER_LAYOUTS; layout++)
+    {
+        std::string defines = "#define GBUFFER_LAYOUT " + std::to_string(layout) + "\n";
+        gbufferPermutations[layout] = { "pbr.vert", "pbr.frag", defines + "#define GBUFFER_WRITE\n", PERMUTATION_MATERIAL };
+        deferredLightingPermutations[layout] = { "shadowFilter.vert", "pbr.frag", defines + "#define DEFERRED_LIGHTING\n", PERMUTATION_LIGHTING };
+    }
+    for (GLuint cubeProgram : cubeShadowPrograms)
+        if (cubeProgram)
+            resolvePassUniforms(cubeProgram);
+    createFrameUniforms();
+    createLightClusters();
+    createGBuffer(WIDTH, HEIGHT);
+    printGBufferReport();
+    createOverdrawView(WIDTH, HEIGHT, CompileShader("shadowFilter.vert", "overdrawView.frag"));
+    createShadowAtlas();
+    glBindSampler(7, shadowAtlas.compareSampler);
+    createShadowMoments(CompileShader("shadowFilter.vert", "evsmResolve.frag"), CompileShader("shadowFilter.vert", "evsmBlur.frag"),
+        CompileShader("shadowFilter.vert", "evsmDownsample.frag"));
+    printProgramCacheStats();
+    printf("Shadow filter: %s\n", shadowFilterNames[shadowFilter]);
 
-    glCreateBuffers(NUM_BUFFERS, Buffers);
-    glGenVertexArrays(NUM_VAOS, VAOs);
+    InitCamera(Camera);
 
-    // Initialising buffers
-    for (auto& model : models)
-        initialiseBuffers(model.vertices, model.bufferIndex);
+    // Initialising buffers, once per shared mesh
+    for (auto& mesh : meshes)
+        initialiseBuffers(mesh);
 
     int duplicateID;
 	duplicateID = duplicateModel(chair);
@@ -832,9 +1481,10 @@ int main(int argc, char** argv)
     duplicateID = duplicateModel(plate);
     setTranformations(duplicateID, glm::vec3(6, -0.05, 0.55), glm::vec3(0), glm::vec3(0.07));
 
+    tagDynamicModels();
+
     // Resize the vector to match the number of lights
     lightSpaceMatrices.resize(lights.size());
-    cubeMapMatrices.resize(lights.size());
 
     glfwSetTime(0); // Reset glfw time to account for loading time
 
@@ -855,7 +1505,14 @@ int main(int argc, char** argv)
     printf("Interaction controls\n");
     printf("---------------------\n");
     printf("Use left mouse click to interact with objects (light switches on the wall)\n");
-    printf("Use 0 to 3 to select a light and press F to set that light's position at the camera location\n\n");
+    printf("Use 0 to 3 to select a light and press F to set that light's position at the camera location\n");
+    printf("Press O to save the selected light's shadow map as PNG and PFM images\n");
+    printf("Press P to print the drawn and culled models of each render pass\n");
+    printf("Press C to compare cube shadow timings and switch cube shadow mode\n");
+    printf("Press V to compare shadow filter timings and switch between PCF, hardware PCF and EVSM\n");
+    printf("Press B to compare forward and deferred timings and cycle between forward and the deferred G-buffer layouts\n");
+    printf("Press Z to compare forward timings with and without the depth prepass and toggle it\n");
+    printf("Press X to show the fragment shader invocations per pixel as a heat map\n\n");
 
     while (!glfwWindowShouldClose(window))
     {
@@ -882,8 +1539,20 @@ int main(int argc, char** argv)
             std::string dirY = std::to_string(Camera.Front.y).substr(0, 5);
             std::string dirZ = std::to_string(Camera.Front.z).substr(0, 5);
 
+            unsigned int cameraDrawn, cameraCulled, shadowDrawn, shadowCulled, allDrawn, allCulled;
+            sumPasses("camera", cameraDrawn, cameraCulled);
+            sumPasses(NULL, allDrawn, allCulled);
+            shadowDrawn = allDrawn - cameraDrawn;
+            shadowCulled = allCulled - cameraCulled;
+
+            std::string allocs = std::to_string(lastFrameStats.allocations) + " (" + std::to_string(lastFrameStats.allocatedBytes / 1024) + " KB)";
+
             std::string newTitle = "Coffee Shop Scene - " + fpsString + "FPS / " + msString.substr(0, 5) + "ms" +
-                "\t" + "Pos: X: " + posX + " Y: " + posY + " Z: " + posZ + "\tLook: " + "X: " + dirX + " Y: " + dirY + " Z: " + dirZ +"\t" + +" seconds: "+time;
+                "\t" + "Pos: X: " + posX + " Y: " + posY + " Z: " + posZ + "\tLook: " + "X: " + dirX + " Y: " + dirY + " Z: " + dirZ +"\t" + +" seconds: "+time +
+                "\tAllocs/frame: " + allocs + "\tGL calls/frame: " + std::to_string(lastFrameStats.driverCalls) +
+                "\tBinds/frame: " + std::to_string(lastFrameStats.stateChanges) + " (" + std::to_string(lastFrameStats.stateChangesSkipped) + " skipped)" +
+                "\tCamera drawn/culled: " + std::to_string(cameraDrawn) + "/" + std::to_string(cameraCulled) +
+                "\tShadows drawn/culled: " + std::to_string(shadowDrawn) + "/" + std::to_string(shadowCulled);
             glfwSetWindowTitle(window, newTitle.c_str());
 
             // Reset FPS counter variables
@@ -891,64 +1560,63 @@ int main(int argc, char** argv)
             frameCount = 0;
         }
 
+        // Count heap allocations from here to the end of the frame, the title update above is not included
+        beginFrameStats();
+        resetRenderState();
+
         // Process keyboard input
         processKeyboard(window, frameTime);
 
         // Update animation
         updateAnimations(frameTime);
 
-        // Generate a depth map for each light
-        for (int i = 0; i < lights.size(); i++)
+        // Refresh the transforms, BVH and instances of whatever moved
+        updateScene();
+
+        // Give each light a tile of the shadow atlas sized for the current view
+        updateShadowAtlas(cameraProjection(state) * cameraView());
+        updateCascades(cameraView(), glm::radians(state.FOV), (float)WIDTH / (float)HEIGHT, CAMERA_NEAR_PLANE);
+
+        // Re-render the shadow maps that a moved model or light dirtied, most important first within the frame's GPU budget
+        // Lights that are off keep their dirty flag until they are switched back on
+        for (Light& light : lights)
+            light.shadow.sinceUpdate += frameTime;
+        scheduleShadowUpdates(cameraProjection(state) * cameraView(), measuredShadowCosts());
+        for (const ShadowUpdate& update : shadowScheduler.updates)
         {
-            // Check if shadow map needs updating i.e. after light has moved
-            if (lights[i].shadow.updateShadow)
-	        {
-		        // Directional light depth map (orthogonal projection)
-	        	if (lights[i].type == DIRECTIONAL)
-	        	{
-	        		float near_plane = 1.f, far_plane = 70.f;
-	        		glm::mat4 lightProjection = glm::ortho(-15.f, 15.f, -15.f, 15.f, near_plane, far_plane);
-	        		glm::mat4 lightView = glm::lookAt(lights[i].position, lights[i].position + lights[i].direction, glm::vec3(0.f, 1.f, 0.f));
-	        		lightSpaceMatrices[i] = lightProjection * lightView;
-	        		generateDepthMap(shadow_program, lights[i].shadow, lightSpaceMatrices[i]);
-	        	}
-	        	// Spot light depth map (perspective projection)
-	        	else if (lights[i].type == SPOT)
-	        	{
-	        		float near_plane = 1.f, far_plane = 70.f;
-	        		float lightCutoffRadians = acos(sin(glm::radians(25.f)));
-	        		float fov = glm::degrees(lightCutoffRadians * 2.0f);
-	        		glm::mat4 lightProjection = glm::perspective(glm::radians(fov), (float)SH_MAP_WIDTH / (float)SH_MAP_HEIGHT, near_plane, far_plane);
-	        		glm::mat4 lightView = glm::lookAt(lights[i].position, lights[i].position + lights[i].direction, glm::vec3(0.f, 1.f, 0.f));
-	        		lightSpaceMatrices[i] = lightProjection * lightView;
-	        		generateDepthMap(shadow_program, lights[i].shadow, lightSpaceMatrices[i]);
-	        	}
-	        	else if (lights[i].type == POSITIONAL)
-	        	{
-	        		// Create shadow transforms for this light
-	        		float far_plane = 25.0f; float near_plane = 1.0f;
-	        		glm::mat4 shadowProj = glm::perspective(glm::radians(90.f), 1.f, near_plane, far_plane);
-
-	        		cubeMapMatrices[i][0] = shadowProj * glm::lookAt(lights[i].position, lights[i].position + glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f));
-	        		cubeMapMatrices[i][1] = shadowProj * glm::lookAt(lights[i].position, lights[i].position + glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f));
-	        		cubeMapMatrices[i][2] = shadowProj * glm::lookAt(lights[i].position, lights[i].position + glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-	        		cubeMapMatrices[i][3] = shadowProj * glm::lookAt(lights[i].position, lights[i].position + glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f));
-	        		cubeMapMatrices[i][4] = shadowProj * glm::lookAt(lights[i].position, lights[i].position + glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, -1.0f, 0.0f));
-	        		cubeMapMatrices[i][5] = shadowProj * glm::lookAt(lights[i].position, lights[i].position + glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, -1.0f, 0.0f));
-	        		// Generate cubemap for this positional light
-	        		generateCubeMap(shadow_cubemap_program, lights[i].shadow, cubeMapMatrices[i].data(), far_plane, i);
-	        		//++posLightIndex;
-	        	}
-                lights[i].shadow.updateShadow = false; // Stop the shadow map updating every frame
-	        }
+            int i = update.light;
+            if (lights[i].type == POSITIONAL)
+            {
+                generateCubeFaces(update.faces);
+                continue;
+            }
+
+            beginGpuTimer(lights[i].cascaded ? CASCADES_TIMER_LABEL : SHADOW_MAP_TIMER_LABEL);
+            if (lights[i].cascaded)
+            {
+                generateCascades(shadow_program, lights[i]);
+            }
+            else
+            {
+                lightSpaceMatrices[i] = lights[i].shadowMatrices[0];
+                generateDepthMap(shadow_program, lights[i], lightSpaceMatrices[i]);
+            }
+            if (shadowFilter == SHADOW_FILTER_EVSM)
+                filterShadowMoments(lights[i]);
+            endGpuTimer();
+            lights[i].shadow.sinceUpdate = 0.f;
         }
 
-        renderWithShadows(program, lightSpaceMatrices, cubeMapMatrices, state);
+        renderWithShadows(lightSpaceMatrices, state);
+        pollGpuTimers();
+        pollCaptures();
+        endFrameStats();
 
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
 
+    finishCaptures();
     glfwDestroyWindow(window);
     glfwTerminate();
 
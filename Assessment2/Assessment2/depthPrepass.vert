@@ -0,0 +1,20 @@
+#version 450 core
+
+layout (location = 0) in vec3 vPos; // packed position-only stream
+layout (location = 4) in mat4 model; // per instance, from the instance buffer
+
+// The lighting pass tests against this depth with GL_EQUAL, so the position must come out bit for bit the same as
+// pbr.vert's, from the same expression on the same matrices
+invariant gl_Position;
+
+// The start of FrameUniforms in frame_uniforms.h
+layout (std140, binding = 0) uniform FrameUniforms
+{
+	mat4 view;
+	mat4 projection;
+};
+
+void main()
+{
+	gl_Position = projection * view * model * vec4(vPos, 1.0);
+}
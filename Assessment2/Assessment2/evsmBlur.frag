@@ -0,0 +1,29 @@
+#version 450 core
+
+// One direction of the separable blur of the moments, samples stay inside the face or cascade they belong to
+
+layout (location = 0) out vec4 moments;
+
+layout (binding = 0) uniform sampler2D source;
+
+uniform ivec2 direction;    // (1, 0) across, (0, 1) down
+uniform ivec2 sourceOrigin; // Texel of the region's corner in the source
+uniform ivec2 targetOrigin; // and in the render target
+uniform int tileSize;       // Size of each face or cascade in the region
+
+// Binomial weights of a 7 texel kernel
+const float WEIGHTS[4] = float[](20.0 / 64.0, 15.0 / 64.0, 6.0 / 64.0, 1.0 / 64.0);
+
+void main()
+{
+	ivec2 texel = ivec2(gl_FragCoord.xy) - targetOrigin;
+	ivec2 tileMin = texel / tileSize * tileSize;
+	ivec2 tileMax = tileMin + tileSize - 1;
+
+	moments = texelFetch(source, sourceOrigin + texel, 0) * WEIGHTS[0];
+	for(int i = 1; i < 4; i++)
+	{
+		moments += texelFetch(source, sourceOrigin + clamp(texel + direction * i, tileMin, tileMax), 0) * WEIGHTS[i];
+		moments += texelFetch(source, sourceOrigin + clamp(texel - direction * i, tileMin, tileMax), 0) * WEIGHTS[i];
+	}
+}
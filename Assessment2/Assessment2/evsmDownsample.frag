@@ -0,0 +1,14 @@
+#version 450 core
+
+// Next mip level of a region of the moments, source is a view of the level above
+
+layout (location = 0) out vec4 moments;
+
+layout (binding = 0) uniform sampler2D source;
+
+void main()
+{
+	ivec2 texel = ivec2(gl_FragCoord.xy) * 2;
+	moments = (texelFetch(source, texel, 0) + texelFetch(source, texel + ivec2(1, 0), 0) +
+		texelFetch(source, texel + ivec2(0, 1), 0) + texelFetch(source, texel + ivec2(1, 1), 0)) * 0.25;
+}
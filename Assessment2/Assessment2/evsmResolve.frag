@@ -0,0 +1,38 @@
+#version 450 core
+
+// Exponential variance moments of a region of the depth atlas, each moment texel averages 2 x 2 depth texels
+
+layout (location = 0) out vec4 moments;
+
+layout (binding = 0) uniform sampler2D depthAtlas;
+
+uniform int perspectiveDepth; // Spot lights store perspective depth, it is made linear first so the warp spreads it evenly
+uniform vec2 depthRange;      // Near and far plane of perspective depth
+
+// Largest exponents whose moments still fit in 16-bit floats, must match pbr.frag
+const vec2 EVSM_EXPONENTS = vec2(5.54, 5.54);
+
+vec4 warpDepth(float depth)
+{
+	depth = 2.0 * depth - 1.0;
+	float positive = exp(EVSM_EXPONENTS.x * depth);
+	float negative = -exp(-EVSM_EXPONENTS.y * depth);
+	return vec4(positive, positive * positive, negative, negative * negative);
+}
+
+void main()
+{
+	ivec2 texel = ivec2(gl_FragCoord.xy) * 2;
+	vec4 sum = vec4(0.0);
+	for(int i = 0; i < 4; i++)
+	{
+		float depth = texelFetch(depthAtlas, texel + ivec2(i & 1, i >> 1), 0).r;
+		if(perspectiveDepth != 0)
+		{
+			float viewDepth = 2.0 * depthRange.x * depthRange.y / (depthRange.y + depthRange.x - (2.0 * depth - 1.0) * (depthRange.y - depthRange.x));
+			depth = (viewDepth - depthRange.x) / (depthRange.y - depthRange.x);
+		}
+		sum += warpDepth(depth);
+	}
+	moments = sum * 0.25;
+}
@@ -0,0 +1,12 @@
+#version 450 core
+
+// Counts the fragment shader invocations of every pixel for the overdraw view
+// Tested early like pbr.frag, which writes no depth and never discards, so the count is what the lighting shader runs
+layout (early_fragment_tests) in;
+
+layout (binding = 0, r32ui) uniform uimage2D overdraw;
+
+void main()
+{
+	imageAtomicAdd(overdraw, ivec2(gl_FragCoord.xy), 1u);
+}
@@ -0,0 +1,14 @@
+#version 450 core
+
+// Heat map of the overdraw counts, black for none, then blue, green, yellow, red and white for 5 or more
+layout (binding = 0, r32ui) uniform readonly uimage2D overdraw;
+
+layout (location = 0) out vec4 fColour;
+
+const vec3 HEAT[6] = vec3[](vec3(0.0), vec3(0.0, 0.0, 1.0), vec3(0.0, 1.0, 0.0), vec3(1.0, 1.0, 0.0), vec3(1.0, 0.0, 0.0), vec3(1.0));
+
+void main()
+{
+	uint count = imageLoad(overdraw, ivec2(gl_FragCoord.xy)).r;
+	fColour = vec4(HEAT[min(count, 5u)], 1.0);
+}
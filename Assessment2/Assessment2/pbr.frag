@@ -3,49 +3,148 @@
 #define HASHSCALE3 vec3(.1031, .1030, .0973)
 
 const float PI = 3.14159265359;
-const int MAX_LIGHTS = 7;
-
+const int SHADOW_CASCADES = 4;
+
+// Light cluster grid, must match light_clusters.h
+const int CLUSTER_TILES_X = 16;
+const int CLUSTER_TILES_Y = 9;
+const int CLUSTER_SLICES = 24;
+
+// Shadow filters, see ShadowFilter in shadow_filter.h
+// SHADOW_FILTER and the HAS_* features are defined by the program's permutation, see shader_permutations.h
+#define SHADOW_FILTER_PCF 0
+#define SHADOW_FILTER_HARDWARE_PCF 1
+#define SHADOW_FILTER_EVSM 2
+#ifndef SHADOW_FILTER
+#define SHADOW_FILTER SHADOW_FILTER_PCF // The G-buffer write lights nothing, so its permutations have no filter
+#endif
+
+// Depth range of the spot light shadows, must match light.h
+const float SHADOW_NEAR_PLANE = 1.0;
+const float SHADOW_FAR_PLANE = 70.0;
+
+// Exponential warp of the moments, must match evsmResolve.frag
+const vec2 EVSM_EXPONENTS = vec2(5.54, 5.54);
+const float EVSM_BLEED_REDUCTION = 0.25; // Part of the Chebyshev bound cut off, hides light leaking past overlapping casters
+
+// Deferred shading, see gbuffer.h
+// GBUFFER_WRITE is the geometry pass, which stores the surface in the G-buffer instead of lighting it, and
+// DEFERRED_LIGHTING the full screen pass that rebuilds the surface from the G-buffer and lights it
+// Both are defined with GBUFFER_LAYOUT
+#define GBUFFER_FULL 0
+#define GBUFFER_OCT16 1
+#define GBUFFER_OCT8 2
+
+#ifdef GBUFFER_WRITE
+layout (location = 0) out vec4 gAlbedo;
+layout (location = 1) out vec4 gNormal;
+#if GBUFFER_LAYOUT == GBUFFER_FULL
+layout (location = 2) out float gMetallic;
+#endif
+#else
 layout (location = 0) out vec4 fColour;
+#endif
+
+#ifdef DEFERRED_LIGHTING
+layout (binding = 8) uniform sampler2D gAlbedo;
+layout (binding = 9) uniform sampler2D gNormal;
+layout (binding = 10) uniform sampler2D gMetallic;
+layout (binding = 11) uniform sampler2D gDepth;
 
+vec3 FragPosWorldSpace;
+#else
 in vec4 col;
 in vec3 nor;
 in vec3 FragPosWorldSpace;
-in vec4 FragPosLightSpace[MAX_LIGHTS];
 in vec2 TexCoords;
+#endif
 
 // Light type constants
 const int DIRECTIONAL_LIGHT = 0;
 const int POINT_LIGHT = 1;
 const int SPOT_LIGHT = 2;
 
-// Light structure
+// Whether the permutation lights with each type, tests of a type that is not on fold away when compiled
+#ifdef HAS_DIRECTIONAL_LIGHTS
+const bool DIRECTIONAL_LIGHTS = true;
+#else
+const bool DIRECTIONAL_LIGHTS = false;
+#endif
+#ifdef HAS_POINT_LIGHTS
+const bool POINT_LIGHTS = true;
+#else
+const bool POINT_LIGHTS = false;
+#endif
+#ifdef HAS_SPOT_LIGHTS
+const bool SPOT_LIGHTS = true;
+#else
+const bool SPOT_LIGHTS = false;
+#endif
+
+// Light structure, members ordered to pack into std430, see LightData in light_clusters.h
 struct Light {
-    bool isOn;
-    int type;               // 0=directional, 1=point, 2=spot
     vec3 position;          // Used for point and spot lights
+    int type;               // 0=directional, 1=point, 2=spot
     vec3 direction;         // Used for directional and spot lights
-    vec3 colour;            // Light colour
     float intensity;        // Light intensity multiplier
+    vec3 colour;            // Light colour
+    bool isOn;
+    vec4 shadowTile;        // Atlas rect (x, y, width, height) of the light's shadow map, a point light's faces are 3 x 2 of these
+    mat4 lightSpaceMatrix;
+    float range;            // Distance the light is cut off at, 0 for directional lights
 };
 
-// Uniforms for lights
-uniform Light lights[MAX_LIGHTS];
-uniform int numLights;      // Actual number of lights
+// Camera and light data for the frame, see FrameUniforms in frame_uniforms.h
+layout (std140, binding = 0) uniform FrameUniforms
+{
+    mat4 view;
+    mat4 projection;
+    mat4 inverseViewProjection; // Window depth back to world space, for the deferred lighting pass
+    mat4 cascadeMatrices[SHADOW_CASCADES]; // Light space of each cascade of the cascaded light, laid out 2 x 2 in its tile
+    vec4 cascadeSplits;     // View distance of the far end of each cascade
+    vec4 clusterScale;      // Tiles per pixel in x and y, slices per log depth and the depth the log slices start at
+    vec3 camPos;
+    float farPlane;
+    int numLights;          // Number of lights in the light buffer
+    int cascadedLight;      // Light whose shadow uses the cascades, -1 if none
+};
 
-uniform sampler2D shadowMaps[MAX_LIGHTS];
-uniform samplerCube shadowCubeMaps[MAX_LIGHTS];
-uniform vec3 pointLightPositions[MAX_LIGHTS];
-uniform mat4 lightSpaceMatrices[MAX_LIGHTS];
-uniform float farPlane;
+// Every light, and for each cluster of the view the offset and count of its lights in clusterLights
+layout (std430, binding = 1) readonly buffer LightBuffer
+{
+    Light lights[];
+};
+
+layout (std430, binding = 2) readonly buffer ClusterRanges
+{
+    uvec2 clusterRanges[];
+};
+
+layout (std430, binding = 3) readonly buffer ClusterLights
+{
+    uint clusterLights[];
+};
+
+// Every light's shadow map is a tile of one atlas, see Light.shadowTile
+layout (binding = 5) uniform sampler2D shadowAtlas;
+// Blurred and mipmapped EVSM moments in the same layout at half resolution, used instead of the atlas by SHADOW_FILTER_EVSM
+layout (binding = 6) uniform sampler2D shadowMoments;
+#if SHADOW_FILTER == SHADOW_FILTER_HARDWARE_PCF
+// The atlas again through a comparing sampler, every tap returns the lit fraction of 2 x 2 bilinearly filtered texels
+layout (binding = 7) uniform sampler2DShadow shadowAtlasCompare;
+
+// Poisson disk the 4 tap kernels rotate per fragment
+const vec2 POISSON_DISK[4] = vec2[](vec2(-0.94201624, -0.39906216), vec2(0.94558609, -0.76890725),
+    vec2(-0.094184101, -0.92938870), vec2(0.34495938, 0.29387760));
+#endif
 uniform float textureScale;
-uniform vec3 camPos;
 
 // material parameters
-uniform sampler2D albedoMap;
-uniform sampler2D normalMap;
-uniform sampler2D metallicMap;
-uniform sampler2D roughnessMap;
-uniform sampler2D aoMap;
+layout (binding = 0) uniform sampler2D albedoMap;
+layout (binding = 3) uniform sampler2D normalMap;
+layout (binding = 2) uniform sampler2D metallicMap;
+layout (binding = 1) uniform sampler2D roughnessMap;
+layout (binding = 4) uniform sampler2D aoMap;
 uniform sampler2D opacityMap;
 
 // Function declarations
@@ -54,8 +153,16 @@ float DistributionGGX(vec3, vec3, float);
 float GeometrySmith(vec3, vec3, vec3, float);
 vec3 calculatePBR(Light light, vec3 N, vec3 V, vec3 F0, int lightIndex);
 vec3 getNormalFromMap();
-float shadowOnFragment(vec4 fragPosLightSpace, int lightIndex);
+void sampleSurface();
+void readGBuffer(ivec2 pixel);
+void writeGBuffer();
+int fragmentCluster();
+float shadowOnFragment(int lightIndex);
 float shadowCubeMapOnFragment(Light light, int lightIndex);
+vec2 atlasCoords(vec2 tileCoords, vec4 tile);
+vec2 cubeAtlasCoords(vec3 direction, vec4 tile);
+vec2 cubeFaceCoords(vec3 direction, vec4 tile, out vec4 faceTile);
+float momentShadow(vec2 tileCoords, vec4 tile, float footprint, float depth);
 
 float roughness;
 float metallic;
@@ -63,26 +170,48 @@ vec3 albedo;
 vec3 normal;
 float ao;
 
+// Screen space derivatives of the world position, taken up front where every fragment of the quad runs them
+vec3 worldDx;
+vec3 worldDy;
+
+#ifdef GBUFFER_WRITE
 void main()
 {
-    vec3 N = normalize(nor);
+    sampleSurface();
+    writeGBuffer();
+}
+#else
+void main()
+{
+#ifdef DEFERRED_LIGHTING
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gDepth, pixel, 0).r;
+    vec2 ndc = gl_FragCoord.xy / vec2(textureSize(gDepth, 0)) * 2.0 - 1.0;
+    vec4 world = inverseViewProjection * vec4(ndc, depth * 2.0 - 1.0, 1.0);
+    FragPosWorldSpace = world.xyz / world.w;
+
+    // Taken before any pixel of the quad can be discarded
+    worldDx = dFdx(FragPosWorldSpace);
+    worldDy = dFdy(FragPosWorldSpace);
+    if(depth == 1.0)
+        discard; // Nothing was drawn here, the background stays as cleared
+
+    // Transparent models are drawn forward afterwards and test against the opaque depth
+    gl_FragDepth = depth;
+    readGBuffer(pixel);
+    vec3 N = normal;
     vec3 V = normalize(camPos - FragPosWorldSpace);
-
-    float defaultRoughness = 0.5;
-    float defaultMetallic = 0.5;
-    float defaultAO = 1.0;
- 
-    // Full PBR texture mode
-    vec2 scaledTexCoords = TexCoords * textureScale;
-
-    albedo = pow(texture(albedoMap, scaledTexCoords).rgb, vec3(2.2));
-    // Use texture or default value
-    metallic = textureSize(metallicMap, 0).x > 1 ? texture(metallicMap, scaledTexCoords).r : defaultMetallic;
-    roughness = textureSize(roughnessMap, 0).x > 1 ? texture(roughnessMap, scaledTexCoords).r : defaultRoughness;
-    ao = textureSize(aoMap, 0).x > 1 ? texture(aoMap, scaledTexCoords).r : defaultAO;
-            
-    // Use normal map if available, otherwise use vertex normal
-    normal = textureSize(normalMap, 0).x > 1 ? getNormalFromMap() : N;
+    float alpha = 1.0;
+#else
+    worldDx = dFdx(FragPosWorldSpace);
+    worldDy = dFdy(FragPosWorldSpace);
+
+    sampleSurface();
+    albedo = pow(albedo, vec3(2.2));
+    vec3 N = normal;
+    vec3 V = normalize(camPos - FragPosWorldSpace);
+    float alpha = col.w;
+#endif
 
     vec3 F0 = vec3(0.04);
     F0 = mix(F0, albedo, metallic);
@@ -91,12 +220,12 @@ void main()
     vec3 ambient = vec3(0.25) * albedo * ao;
     vec3 Lo = vec3(0.0);
     
-    // Process all lights
-    for(int i = 0; i < numLights; i++) 
+    // Only the lights that reach this fragment's cluster, lights that are off are in no cluster
+    uvec2 cluster = clusterRanges[fragmentCluster()];
+    for(uint i = 0; i < cluster.y; i++)
     {
-        // Call only if light is switched on
-        if(lights[i].isOn)
-            Lo += calculatePBR(lights[i], N, V, F0, i);
+        int lightIndex = int(clusterLights[cluster.x + i]);
+        Lo += calculatePBR(lights[lightIndex], N, V, F0, lightIndex);
     }
     
     vec3 color = ambient + Lo;
@@ -107,8 +236,9 @@ void main()
     color = pow(color, vec3(1.0/2.2));  
     
     // use alpha value from colour input
-    fColour = vec4(color, col.w);
+    fColour = vec4(color, alpha);
 }
+#endif
 
 // Main source for physical based lighting - https://learnopengl.com/PBR/Lighting
 vec3 calculatePBR(Light light, vec3 N, vec3 V, vec3 F0, int lightIndex)
@@ -119,22 +249,24 @@ vec3 calculatePBR(Light light, vec3 N, vec3 V, vec3 F0, int lightIndex)
     cutOff = cos(radians(25.f));
     outerCutOff = cos(radians(45.f));
     
-    if(light.type == DIRECTIONAL_LIGHT) {
+    if(DIRECTIONAL_LIGHTS && light.type == DIRECTIONAL_LIGHT) {
         // For directional light, L is just the negative of the light direction
         L = normalize(-light.direction);
         attenuation = lights[lightIndex].intensity;
     } 
-    else if(light.type == POINT_LIGHT || light.type == SPOT_LIGHT) {
+    else if((POINT_LIGHTS && light.type == POINT_LIGHT) || (SPOT_LIGHTS && light.type == SPOT_LIGHT)) {
         // For point and spot lights, calculate direction to the light
         vec3 lightDir = light.position - FragPosWorldSpace;
         float distance = length(lightDir);
         L = normalize(lightDir);
         
-        // Calculate attenuation based on distance
+        // Calculate attenuation based on distance, faded to nothing at the range the light's clusters were assigned with
         attenuation = 1.0 / (constant + linear * distance + quadratic * pow(distance, 2));
+        float fade = clamp(1.0 - pow(distance / light.range, 4.0), 0.0, 1.0);
+        attenuation *= fade * fade;
         
         // Additional spot light calculations
-        if(light.type == SPOT_LIGHT) {
+        if(SPOT_LIGHTS && light.type == SPOT_LIGHT) {
             float theta = dot(L, normalize(-light.direction));
             float epsilon = cutOff - outerCutOff;
             float spotIntensity = clamp((theta - outerCutOff) / epsilon, 0.0, 1.0);
@@ -147,10 +279,10 @@ vec3 calculatePBR(Light light, vec3 N, vec3 V, vec3 F0, int lightIndex)
     
     // Calculate shadow factor based on light type and index
     float shadow = 0.0;
-    if(light.type == DIRECTIONAL_LIGHT || light.type == SPOT_LIGHT) {
-        shadow = shadowOnFragment(FragPosLightSpace[lightIndex], lightIndex);
+    if((DIRECTIONAL_LIGHTS && light.type == DIRECTIONAL_LIGHT) || (SPOT_LIGHTS && light.type == SPOT_LIGHT)) {
+        shadow = shadowOnFragment(lightIndex);
     }
-    else if(light.type == POINT_LIGHT) {
+    else if(POINT_LIGHTS && light.type == POINT_LIGHT) {
         shadow = shadowCubeMapOnFragment(light, lightIndex);
     }
     
@@ -224,6 +356,43 @@ float GeometrySmith(vec3 N, vec3 V, vec3 L, float roughness)
     return ggx1 * ggx2;
 }
 
+#if defined(DEFERRED_LIGHTING) || defined(GBUFFER_WRITE)
+vec2 signNotZero(vec2 v)
+{
+    return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+#endif
+
+#ifdef DEFERRED_LIGHTING
+// Inverse of octahedralEncode
+vec3 octahedralDecode(vec2 encoded)
+{
+    encoded = encoded * 2.0 - 1.0;
+    vec3 n = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+    if(n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * signNotZero(n.xy);
+    return normalize(n);
+}
+
+// Fill in the surface globals from the G-buffer
+void readGBuffer(ivec2 pixel)
+{
+    vec4 albedoAO = texelFetch(gAlbedo, pixel, 0);
+    vec4 packedNormal = texelFetch(gNormal, pixel, 0);
+    ao = albedoAO.a;
+#if GBUFFER_LAYOUT == GBUFFER_FULL
+    albedo = albedoAO.rgb;
+    normal = normalize(packedNormal.xyz);
+    roughness = packedNormal.w;
+    metallic = texelFetch(gMetallic, pixel, 0).r;
+#else
+    albedo = pow(albedoAO.rgb, vec3(2.2));
+    normal = octahedralDecode(packedNormal.xy);
+    roughness = packedNormal.z;
+    metallic = packedNormal.w;
+#endif
+}
+#else
 vec3 getNormalFromMap()
 {
     vec3 tangentNormal = texture(normalMap, TexCoords).xyz * 2.0 - 1.0;
@@ -241,6 +410,74 @@ vec3 getNormalFromMap()
     return normalize(TBN * tangentNormal);
 }
 
+/**
+ * Fill in the surface globals from the material, the one place both the forward pass and the G-buffer write get them
+ * Shading uses the normal-mapped normal when the material has a normal map, the vertex normal otherwise
+ * albedo is left gamma encoded as the texture stores it
+ */
+void sampleSurface()
+{
+    vec2 scaledTexCoords = TexCoords * textureScale;
+
+    albedo = texture(albedoMap, scaledTexCoords).rgb;
+    // Use texture or default value, the material's permutation says which maps it has
+#ifdef HAS_METALLIC_MAP
+    metallic = texture(metallicMap, scaledTexCoords).r;
+#else
+    metallic = 0.5;
+#endif
+#ifdef HAS_ROUGHNESS_MAP
+    roughness = texture(roughnessMap, scaledTexCoords).r;
+#else
+    roughness = 0.5;
+#endif
+#ifdef HAS_AO_MAP
+    ao = texture(aoMap, scaledTexCoords).r;
+#else
+    ao = 1.0;
+#endif
+#ifdef HAS_NORMAL_MAP
+    normal = getNormalFromMap();
+#else
+    normal = normalize(nor);
+#endif
+}
+#endif
+
+#ifdef GBUFFER_WRITE
+// Unit vector to the 0-1 square, the octahedron's lower half is folded over its upper half
+vec2 octahedralEncode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 folded = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * signNotZero(n.xy);
+    return folded * 0.5 + 0.5;
+}
+
+// Store the surface globals in the G-buffer targets of GBUFFER_LAYOUT, readGBuffer() is the inverse
+void writeGBuffer()
+{
+#if GBUFFER_LAYOUT == GBUFFER_FULL
+    gAlbedo = vec4(pow(albedo, vec3(2.2)), ao);
+    gNormal = vec4(normal, roughness);
+    gMetallic = metallic;
+#else
+    // The albedo texture is already gamma encoded, which is what 8 bits keep best
+    gAlbedo = vec4(albedo, ao);
+    gNormal = vec4(octahedralEncode(normal), roughness, metallic);
+#endif
+}
+#endif
+
+// Index of the light cluster the fragment is in, from its screen tile and its view depth's slice, see light_clusters.h
+int fragmentCluster()
+{
+    ivec2 tile = min(ivec2(gl_FragCoord.xy * clusterScale.xy), ivec2(CLUSTER_TILES_X - 1, CLUSTER_TILES_Y - 1));
+    float viewDepth = -(view * vec4(FragPosWorldSpace, 1.0)).z;
+    int slice = viewDepth < clusterScale.w ? 0 : 1 + int(log(viewDepth / clusterScale.w) * clusterScale.z);
+    slice = min(slice, CLUSTER_SLICES - 1);
+    return (slice * CLUSTER_TILES_Y + tile.y) * CLUSTER_TILES_X + tile.x;
+}
+
 
 // Source - https://www.shadertoy.com/view/lldyDn
 vec2 hash2d(vec2 p)
@@ -251,10 +488,30 @@ vec2 hash2d(vec2 p)
 }
 
 // Main source for spot light shadows - https://www.youtube.com/watch?v=Q8w_z2Ye-Go&t=31s
-float shadowOnFragment(vec4 fragPosLightSpace, int lightIndex)
+float shadowOnFragment(int lightIndex)
 {
     Light light = lights[lightIndex];
+    mat4 lightSpace = light.lightSpaceMatrix;
+    vec4 tile = light.shadowTile;
+    if(tile.z == 0.0)
+        return 0.0; // No room in the atlas for this light
+
+    // The cascaded light uses the nearest cascade that reaches the fragment, each cascade is a quarter of its tile
+    if(DIRECTIONAL_LIGHTS && lightIndex == cascadedLight)
+    {
+        float viewDepth = -(view * vec4(FragPosWorldSpace, 1.0)).z;
+        int cascade = 0;
+        while(cascade < SHADOW_CASCADES && viewDepth > cascadeSplits[cascade])
+            cascade++;
+        if(cascade == SHADOW_CASCADES)
+            return 0.0; // Beyond the last cascade
+
+        lightSpace = cascadeMatrices[cascade];
+        tile.xy += vec2(cascade % 2, cascade / 2) * tile.zw;
+    }
+
     // Perspective divide
+    vec4 fragPosLightSpace = lightSpace * vec4(FragPosWorldSpace, 1.0);
     vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
     projCoords = projCoords * 0.5 + 0.5;
 
@@ -263,19 +520,48 @@ float shadowOnFragment(vec4 fragPosLightSpace, int lightIndex)
         return 0.0; // Assume not in shadow
 
     float currentDepth = projCoords.z;
-    
+
+#if SHADOW_FILTER == SHADOW_FILTER_EVSM
+    // Footprint of the fragment in the tile, from where its screen neighbours land in light space
+    vec4 stepX = fragPosLightSpace + lightSpace * vec4(worldDx, 0.0);
+    vec4 stepY = fragPosLightSpace + lightSpace * vec4(worldDy, 0.0);
+    vec2 texels = tile.zw * vec2(textureSize(shadowMoments, 0));
+    float footprint = max(length((stepX.xy / stepX.w * 0.5 + 0.5 - projCoords.xy) * texels),
+        length((stepY.xy / stepY.w * 0.5 + 0.5 - projCoords.xy) * texels));
+
+    // The moments of spot lights hold linear depth
+    if(SPOT_LIGHTS && light.type == SPOT_LIGHT)
+    {
+        float viewDepth = 2.0 * SHADOW_NEAR_PLANE * SHADOW_FAR_PLANE /
+            (SHADOW_FAR_PLANE + SHADOW_NEAR_PLANE - (2.0 * currentDepth - 1.0) * (SHADOW_FAR_PLANE - SHADOW_NEAR_PLANE));
+        currentDepth = (viewDepth - SHADOW_NEAR_PLANE) / (SHADOW_FAR_PLANE - SHADOW_NEAR_PLANE);
+    }
+    return momentShadow(projCoords.xy, tile, footprint, currentDepth);
+#else
     vec3 lightDir = normalize(light.type == DIRECTIONAL_LIGHT ? -light.direction : light.position - FragPosWorldSpace);
 
     float bias;
-    if(light.type == SPOT_LIGHT)
+    if(SPOT_LIGHTS && light.type == SPOT_LIGHT)
     {
         bias = max(0.0025f * (1.f - dot(normal, lightDir)), 0.00045f);
     } else
         bias = max(0.0025f * (1.f - dot(normal, lightDir)), 0.0005f);
     
     float shadow = 0.0;
-    vec2 texelSize = 1.0 / textureSize(shadowMaps[lightIndex], 0);
+
+    // One atlas texel, in the tile's 0-1 coordinates
+    vec2 texelSize = 1.0 / (tile.zw * vec2(textureSize(shadowAtlas, 0)));
     
+#if SHADOW_FILTER == SHADOW_FILTER_HARDWARE_PCF
+    // Four filtered taps cover the 3 x 3 texel area of the loop below, rotated per fragment to hide the pattern
+    float angle = 2.0 * PI * hash2d(gl_FragCoord.xy).x;
+    mat2 rotation = mat2(cos(angle), sin(angle), -sin(angle), cos(angle));
+    for(int i = 0; i < 4; i++) {
+        vec2 offset = rotation * POISSON_DISK[i] * texelSize * 1.5;
+        shadow += 1.0 - texture(shadowAtlasCompare, vec3(atlasCoords(projCoords.xy + offset, tile), currentDepth - bias));
+    }
+    return shadow / 4.0;
+#else
     // Generate a per-fragment random offset to jitter the sampling pattern
     // Source - https://www.youtube.com/watch?v=uueB2kVvbHo&t=262s
     vec2 randomOffset = hash2d(gl_FragCoord.xy) * texelSize * 0.5;
@@ -290,11 +576,13 @@ float shadowOnFragment(vec4 fragPosLightSpace, int lightIndex)
         // Add random offset to break grid pattern
         vec2 offset = vec2(x, y) * texelSize + randomOffset;
         
-        float pcfDepth = texture(shadowMaps[lightIndex], projCoords.xy + offset).r;
+        float pcfDepth = texture(shadowAtlas, atlasCoords(projCoords.xy + offset, tile)).r;
         shadow += currentDepth - bias > pcfDepth ? 1.0 : 0.0;
     }
     
     return shadow / float(PCF_SAMPLES);
+#endif
+#endif
 }
 
 // Source for positional light shadows - https://www.youtube.com/watch?v=Q8w_z2Ye-Go&t=157s
@@ -302,18 +590,43 @@ float shadowOnFragment(vec4 fragPosLightSpace, int lightIndex)
 float shadowCubeMapOnFragment(Light light, int lightIndex)
 {
     float shadow = 0.0;
+    vec4 tile = light.shadowTile;
+    if(tile.z == 0.0)
+        return 0.0; // No room in the atlas for this light
     
     vec3 fragToLight = FragPosWorldSpace - light.position;
     float currentDepth = length(fragToLight);
     
     vec3 lightDir = normalize(fragToLight);
     float bias = max(0.005 * (1.0 - dot(normal, lightDir)), 0.0005);
-    
+
+#if SHADOW_FILTER == SHADOW_FILTER_EVSM
+    // A face texel spans 2 / size at unit distance along the face's axis
+    vec4 faceTile;
+    vec2 faceCoords = cubeFaceCoords(fragToLight, tile, faceTile);
+    vec3 a = abs(fragToLight);
+    float texelsPerUnit = 0.5 * faceTile.z * float(textureSize(shadowMoments, 0).x) / max(a.x, max(a.y, a.z));
+    float footprint = max(length(worldDx), length(worldDy)) * texelsPerUnit;
+    return momentShadow(faceCoords, faceTile, footprint, currentDepth / farPlane);
+#else
     // Point light shadow PCF technique source - https://learnopengl.com/Advanced-Lighting/Shadows/Point-Shadows
     int samples = 20;
     float viewDistance = length(camPos - FragPosWorldSpace);
     float diskRadius = (1.0 + (viewDistance / farPlane)) / 25.0;
 
+#if SHADOW_FILTER == SHADOW_FILTER_HARDWARE_PCF
+    // Four filtered taps on the same disk, spread across the plane facing the light and rotated per fragment
+    vec3 tangent = normalize(cross(lightDir, abs(lightDir.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0)));
+    vec3 bitangent = cross(lightDir, tangent);
+    float angle = 2.0 * PI * hash2d(gl_FragCoord.xy).x;
+    mat2 rotation = mat2(cos(angle), sin(angle), -sin(angle), cos(angle));
+    for(int i = 0; i < 4; i++) {
+        vec2 offset = rotation * POISSON_DISK[i] * diskRadius;
+        vec3 direction = fragToLight + tangent * offset.x + bitangent * offset.y;
+        shadow += 1.0 - texture(shadowAtlasCompare, vec3(cubeAtlasCoords(direction, tile), (currentDepth - bias) / farPlane));
+    }
+    return shadow / 4.0;
+#else
     vec3 sampleOffsetDirections[20] = vec3[]
     (
        vec3( 1,  1,  1), vec3( 1, -1,  1), vec3(-1, -1,  1), vec3(-1,  1,  1), 
@@ -325,7 +638,7 @@ float shadowCubeMapOnFragment(Light light, int lightIndex)
 
     for (int i = 0; i < samples; i++)
     {
-        float closestDepth = texture(shadowCubeMaps[lightIndex], fragToLight + sampleOffsetDirections[i] * diskRadius).r;
+        float closestDepth = texture(shadowAtlas, cubeAtlasCoords(fragToLight + sampleOffsetDirections[i] * diskRadius, tile)).r;
         closestDepth *= farPlane;
         if(currentDepth - bias > closestDepth)
             shadow += 1.0;
@@ -333,4 +646,79 @@ float shadowCubeMapOnFragment(Light light, int lightIndex)
    
     shadow /= float(samples); 
     return shadow;
+#endif
+#endif
+}
+
+// Atlas position of a point in a tile's 0-1 coordinates, kept half a texel inside so filtering never reads a neighbouring tile
+vec2 atlasCoords(vec2 tileCoords, vec4 tile)
+{
+    vec2 inset = 0.5 / (tile.zw * vec2(textureSize(shadowAtlas, 0)));
+    return tile.xy + clamp(tileCoords, inset, 1.0 - inset) * tile.zw;
+}
+
+// Atlas position a direction from a point light looks up
+vec2 cubeAtlasCoords(vec3 direction, vec4 tile)
+{
+    vec4 faceTile;
+    vec2 faceCoords = cubeFaceCoords(direction, tile, faceTile);
+    return atlasCoords(faceCoords, faceTile);
+}
+
+// Face tile and 0-1 position in it that a direction from a point light looks up, the cube faces are laid out 3 x 2
+// in face order (+X, -X, +Y, -Y, +Z, -Z) in the light's tile
+// Face selection and orientation follow the cube map rules, which the face matrices the shadows are rendered with also follow
+vec2 cubeFaceCoords(vec3 direction, vec4 tile, out vec4 faceTile)
+{
+    vec3 a = abs(direction);
+    int face;
+    float major;
+    vec2 st;
+    if(a.x >= a.y && a.x >= a.z) {
+        face = direction.x > 0.0 ? 0 : 1;
+        major = a.x;
+        st = vec2(direction.x > 0.0 ? -direction.z : direction.z, -direction.y);
+    }
+    else if(a.y >= a.z) {
+        face = direction.y > 0.0 ? 2 : 3;
+        major = a.y;
+        st = vec2(direction.x, direction.y > 0.0 ? direction.z : -direction.z);
+    }
+    else {
+        face = direction.z > 0.0 ? 4 : 5;
+        major = a.z;
+        st = vec2(direction.z > 0.0 ? direction.x : -direction.x, -direction.y);
+    }
+
+    faceTile = vec4(tile.xy + vec2(face % 3, face / 3) * tile.zw, tile.zw);
+    return st / major * 0.5 + 0.5;
+}
+
+// Chebyshev upper bound on the lit fraction of a filtered region with these two moments
+float chebyshevUpperBound(vec2 moments, float mean, float minVariance)
+{
+    if(mean <= moments.x)
+        return 1.0;
+    float variance = max(moments.y - moments.x * moments.x, minVariance);
+    float d = mean - moments.x;
+    float pMax = variance / (variance + d * d);
+    return clamp((pMax - EVSM_BLEED_REDUCTION) / (1.0 - EVSM_BLEED_REDUCTION), 0.0, 1.0);
+}
+
+// Shadow from the prefiltered moments, footprint is how many level 0 texels of the tile the fragment covers
+// One trilinear fetch replaces the PCF taps, the mip level matches the footprint and the blur softens the edges
+float momentShadow(vec2 tileCoords, vec4 tile, float footprint, float depth)
+{
+    float lod = clamp(log2(max(footprint, 1.0)), 0.0, float(textureQueryLevels(shadowMoments) - 1));
+
+    // Keep the fetch and the level above it clear of neighbouring tiles
+    vec2 inset = 0.5 * exp2(ceil(lod)) / (tile.zw * vec2(textureSize(shadowMoments, 0)));
+    vec4 moments = textureLod(shadowMoments, tile.xy + clamp(tileCoords, inset, 1.0 - inset) * tile.zw, lod);
+
+    depth = 2.0 * depth - 1.0;
+    vec2 warped = vec2(exp(EVSM_EXPONENTS.x * depth), -exp(-EVSM_EXPONENTS.y * depth));
+    vec2 depthScale = 0.0001 * EVSM_EXPONENTS * warped;
+    float positive = chebyshevUpperBound(moments.xy, warped.x, depthScale.x * depthScale.x);
+    float negative = chebyshevUpperBound(moments.zw, warped.y, depthScale.y * depthScale.y);
+    return 1.0 - min(positive, negative);
 }
\ No newline at end of file
@@ -5,32 +5,40 @@ layout (location = 0) in vec3 vPos;
 layout (location = 1) in vec4 vCol;
 layout (location = 2) in vec3 vNor;
 layout (location = 3) in vec2 vTexCoords;
+layout (location = 4) in mat4 model; // per instance, from the instance buffer
+layout (location = 8) in mat3 normalMatrix; // per instance, transpose(inverse(mat3(model))) computed on the CPU
 
-#define MAX_LIGHTS 7
+#define SHADOW_CASCADES 4
 
 out vec4 col;
 out vec3 nor;
 out vec3 FragPosWorldSpace;
 out vec2 TexCoords;
-out vec4 FragPosLightSpace[MAX_LIGHTS]; // Array for multiple light spaces
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-uniform mat4 lightSpaceMatrices[MAX_LIGHTS]; // Array of light space matrices
-uniform int numLights;
+// Must match depthPrepass.vert exactly, the lighting pass tests against the pre-pass depth with GL_EQUAL
+invariant gl_Position;
+
+// Camera and light data for the frame, see FrameUniforms in frame_uniforms.h
+layout (std140, binding = 0) uniform FrameUniforms
+{
+    mat4 view;
+    mat4 projection;
+    mat4 inverseViewProjection; // Window depth back to world space, for the deferred lighting pass
+    mat4 cascadeMatrices[SHADOW_CASCADES]; // Light space of each cascade of the cascaded light, laid out 2 x 2 in its tile
+    vec4 cascadeSplits;     // View distance of the far end of each cascade
+    vec4 clusterScale;      // Tiles per pixel in x and y, slices per log depth and the depth the log slices start at
+    vec3 camPos;
+    float farPlane;
+    int numLights;          // Number of lights in the light buffer
+    int cascadedLight;      // Light whose shadow uses the cascades, -1 if none
+};
 
 void main()
 {
     FragPosWorldSpace = vec3(model * vec4(vPos, 1.0));
     
-    // Calculate fragment position in each light's space
-    for(int i = 0; i < numLights; i++) {
-        FragPosLightSpace[i] = lightSpaceMatrices[i] * vec4(FragPosWorldSpace, 1.0);
-    }
-    
     col = vCol;
-    nor = mat3(transpose(inverse(model))) * vNor;
+    nor = normalMatrix * vNor;
     TexCoords = vTexCoords;
     
     gl_Position = projection * view * model * vec4(vPos, 1.0);
@@ -1,11 +1,11 @@
 #version 450 core
 
-layout (location = 0) in vec4 vPos;
+layout (location = 0) in vec3 vPos; // packed position-only stream
+layout (location = 4) in mat4 model; // per instance, from the instance buffer
 
 uniform mat4 LightSpaceMatrix;
-uniform mat4 model;
 
 void main()
 {
-	gl_Position = LightSpaceMatrix * model * vPos;
+	gl_Position = LightSpaceMatrix * model * vec4(vPos, 1.0);
 }
\ No newline at end of file
@@ -1,8 +1,7 @@
 #version 450 core
 
-layout (location = 0) in vec3 aPos;
-
-uniform mat4 model;
+layout (location = 0) in vec3 aPos; // packed position-only stream
+layout (location = 4) in mat4 model; // per instance, from the instance buffer
 
 void main()
 {
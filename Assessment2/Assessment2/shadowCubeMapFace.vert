@@ -0,0 +1,16 @@
+#version 450 core
+
+layout (location = 0) in vec3 aPos; // packed position-only stream
+layout (location = 4) in mat4 model; // per instance, from the instance buffer
+
+uniform mat4 shadowMatrices[6];
+uniform int face;
+
+out vec4 FragPos;
+
+void main()
+{
+	// Renders one face, the viewport is set to that face's tile of the shadow atlas
+	FragPos = model * vec4(aPos, 1.0);
+	gl_Position = shadowMatrices[face] * FragPos;
+}
\ No newline at end of file
@@ -0,0 +1,29 @@
+#version 450 core
+#extension GL_ARB_shader_viewport_layer_array : require
+
+layout (location = 0) in vec3 aPos; // packed position-only stream
+layout (location = 12) in uint faceInstance; // per instance, draw item << 3 | cube face, see drawCubeFaceInstances()
+
+// The instance buffer, read by draw item as every item is drawn once per face that sees it
+struct Instance
+{
+	mat4 model;
+	vec4 normal[3];
+};
+layout (std430, binding = 4) readonly buffer Instances
+{
+	Instance instances[];
+};
+
+uniform mat4 shadowMatrices[6];
+
+out vec4 FragPos;
+
+void main()
+{
+	// Pick the cube face's tile of the shadow atlas from the vertex shader, the CPU has already culled the instances to what each face sees
+	int face = int(faceInstance & 7u);
+	gl_ViewportIndex = face;
+	FragPos = instances[faceInstance >> 3].model * vec4(aPos, 1.0);
+	gl_Position = shadowMatrices[face] * FragPos;
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#version 450 core
+
+// One triangle covering the viewport, which is set to the atlas region being filtered or to the whole screen
+// Drawn without vertex buffers, the corners come from gl_VertexID
+void main()
+{
+	vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+	gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -87,18 +87,7 @@ int createAnimation(int model, float duration, float delay, glm::vec3 endPos, gl
 
 void updateAnimations(float deltaTime)
 {
-	// Add this static variable to track accumulated time between shadow updates
-	static float shadowUpdateTimer = 0.0f;
-	shadowUpdateTimer += deltaTime;
-
-	// Update shadow maps if animation is active
-	if (shadowUpdateTimer >= 0.025f && activeAnimation) 
-	{
-		for (auto& light : lights)
-			light.shadow.updateShadow = true;
-		shadowUpdateTimer = 0.0f; // Reset timer after update
-	}
-
+	// Shadow maps are not touched here, a moved model dirties the lights it affects in updateScene()
 	for (auto& anim : animations) 
 	{
 		if (!anim.isPlaying) continue;
@@ -130,9 +119,9 @@ void updateAnimations(float deltaTime)
 		// Calculate normalized time (0-1)
 		float t = anim.currentTime / anim.duration;
 
-		// Use casteljau to evaluate position on curve
-		std::list<point> points(anim.pathPoints.begin(), anim.pathPoints.end());
-		point currentPos = evaluate(t, points);
+		// Use casteljau to evaluate position on curve, reusing one scratch buffer across frames
+		static std::vector<point> scratch;
+		point currentPos = evaluate(t, anim.pathPoints, scratch);
 
 		// Linearly interpolate rotation and scale
 		glm::vec3 currentPosition(currentPos.x, currentPos.y, currentPos.z);
@@ -157,15 +146,10 @@ void resetAnimations()
 		setTranformations(anim.model, anim.startPosition, anim.startRotation, models.at(anim.model).scale);
 	}
 
-	// If we have animations, set activeAnimation to true to trigger shadow updates
+	// The reset moves dirty the affected shadow maps like any other move
 	if (!animations.empty()) {
 		activeAnimation = true;
 
-		// Also force shadow updates immediately
-		for (auto& light : lights) {
-			light.shadow.updateShadow = true;
-		}
-
 		std::cout << "Animations reset to initial state" << std::endl;
 	}
 }
\ No newline at end of file
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Loading stage: file parsing and image decoding run on a pool of worker threads,
+// the GL side of each asset is then drained in submission order on the context thread
+
+struct ThreadPool
+{
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+};
+
+struct AssetJob
+{
+    std::string kind;
+    std::string name;
+    std::future<void> done;
+    // Runs on the context thread once the worker part has finished, or failed instead if the worker part threw
+    std::function<void()> upload;
+    std::function<void()> failed;
+
+    double workMs = 0.0;
+    double uploadMs = 0.0;
+};
+
+struct AssetLoader
+{
+    ThreadPool pool;
+    std::vector<std::shared_ptr<AssetJob>> queue;
+    std::chrono::steady_clock::time_point started;
+};
+
+AssetLoader assetLoader;
+
+// Lexically normalise a path so "../textures/a/../a/b.png" and "..\\textures\\a\\b.png" are the same asset
+std::string canonical_path(const std::string& path)
+{
+    std::vector<std::string> parts;
+    std::string part;
+    for (size_t i = 0; i <= path.size(); i++)
+    {
+        char c = i < path.size() ? path[i] : '/';
+        if (c != '/' && c != '\\')
+        {
+#ifdef _WIN32
+            c = (char)tolower((unsigned char)c); // Windows paths are case insensitive
+#endif
+            part += c;
+            continue;
+        }
+
+        if (part == "..")
+        {
+            if (!parts.empty() && parts.back() != "..")
+                parts.pop_back();
+            else
+                parts.push_back(part);
+        }
+        else if (!part.empty() && part != ".")
+            parts.push_back(part);
+        part.clear();
+    }
+
+    std::string canonical = !path.empty() && (path[0] == '/' || path[0] == '\\') ? "/" : "";
+    for (size_t i = 0; i < parts.size(); i++)
+        canonical += (i > 0 ? "/" : "") + parts[i];
+    return canonical;
+}
+
+double elapsedMs(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+void startThreadPool(ThreadPool& pool, unsigned int count)
+{
+    pool.stopping = false;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        pool.workers.emplace_back([&pool]()
+        {
+            while (true)
+            {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> lock(pool.mutex);
+                    pool.wake.wait(lock, [&pool]() { return pool.stopping || !pool.jobs.empty(); });
+                    if (pool.jobs.empty())
+                        return; // stopping and nothing left to do
+                    job = std::move(pool.jobs.front());
+                    pool.jobs.pop_front();
+                }
+                job();
+            }
+        });
+    }
+}
+
+void stopThreadPool(ThreadPool& pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.stopping = true;
+    }
+    pool.wake.notify_all();
+    for (auto& worker : pool.workers)
+        worker.join();
+    pool.workers.clear();
+}
+
+void submitJob(ThreadPool& pool, std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.jobs.push_back(std::move(job));
+    }
+    pool.wake.notify_one();
+}
+
+/**
+ * Queue an asset for loading
+ *
+ *@param work runs on a worker thread and must not touch GL
+ *@param upload runs on the context thread in submission order during finishLoadingAssets()
+ *@param failed runs there instead of upload if work threw, so the owner of the asset can clean up
+ */
+void queueAsset(const std::string& kind, const std::string& name, std::function<void()> work, std::function<void()> upload,
+    std::function<void()> failed = nullptr)
+{
+    if (assetLoader.pool.workers.empty())
+    {
+        unsigned int count = std::thread::hardware_concurrency();
+        if (count == 0)
+            count = 1;
+        startThreadPool(assetLoader.pool, count);
+        assetLoader.started = std::chrono::steady_clock::now();
+        printf("Asset loader: started %u worker threads\n", count);
+    }
+
+    std::shared_ptr<AssetJob> job = std::make_shared<AssetJob>();
+    job->kind = kind;
+    job->name = name;
+    job->upload = std::move(upload);
+    job->failed = std::move(failed);
+
+    // packaged_task keeps any exception (e.g. from obj_parse) until the job is drained
+    AssetJob* timing = job.get();
+    auto task = std::make_shared<std::packaged_task<void()>>([work, timing]()
+    {
+        auto start = std::chrono::steady_clock::now();
+        work();
+        timing->workMs = elapsedMs(start);
+    });
+    job->done = task->get_future();
+
+    assetLoader.queue.push_back(job);
+    submitJob(assetLoader.pool, [task]() { (*task)(); });
+}
+
+/**
+ * Wait for every queued asset and run its GL upload on the calling (context) thread, in submission order
+ * An asset whose worker part failed is reported and skipped, it stays empty, and the workers are always joined
+ */
+void finishLoadingAssets()
+{
+    if (assetLoader.queue.empty())
+        return;
+
+    double workTotal = 0.0, uploadTotal = 0.0;
+    int failed = 0;
+    for (auto& job : assetLoader.queue)
+    {
+        try
+        {
+            job->done.get();
+        }
+        catch (const std::exception& error)
+        {
+            printf("Asset loader: failed to load %s %s, skipping it: %s\n", job->kind.c_str(), job->name.c_str(), error.what());
+            failed++;
+            if (job->failed)
+                job->failed();
+            continue;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        job->upload();
+        job->uploadMs = elapsedMs(start);
+
+        workTotal += job->workMs;
+        uploadTotal += job->uploadMs;
+    }
+    double wallMs = elapsedMs(assetLoader.started);
+
+    printf("\nAsset loader: timing per asset\n");
+    printf("%-8s %10s %10s  %s\n", "kind", "work ms", "upload ms", "name");
+    for (auto& job : assetLoader.queue)
+        printf("%-8s %10.2f %10.2f  %s\n", job->kind.c_str(), job->workMs, job->uploadMs, job->name.c_str());
+    printf("Asset loader: %d assets, %.2f ms of worker time + %.2f ms of uploads in %.2f ms wall clock (%.2fx)\n\n",
+        (int)assetLoader.queue.size(), workTotal, uploadTotal, wallMs, wallMs > 0.0 ? (workTotal + uploadTotal) / wallMs : 0.0);
+    if (failed > 0)
+        printf("Asset loader: %d assets failed to load\n\n", failed);
+
+    assetLoader.queue.clear();
+    stopThreadPool(assetLoader.pool);
+}
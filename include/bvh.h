@@ -0,0 +1,245 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "collision.h"
+#include "model.h"
+
+// Bounding volume hierarchy over the world AABBs of all models, used to cull every render pass against its frustum
+
+// Planes are stored as (normal, distance), a point p is inside when dot(normal, p) + distance >= 0
+struct Frustum
+{
+    glm::vec4 planes[6];
+};
+
+enum FrustumTest
+{
+    FRUSTUM_OUTSIDE,
+    FRUSTUM_INTERSECTS,
+    FRUSTUM_INSIDE
+};
+
+struct BVHNode
+{
+    AABB box;
+    int left = -1;
+    int right = -1;
+    int parent = -1;
+    int model = -1;     // Model id for leaves, -1 for inner nodes
+    int leafCount = 0;
+};
+
+struct SceneBVH
+{
+    std::vector<BVHNode> nodes;
+    std::vector<int> leafOfModel;
+    int root = -1;
+
+    // Reused between builds and queries so neither allocates once warmed up
+    std::vector<int> buildOrder;
+    std::vector<glm::vec3> centers;
+    std::vector<int> stack;
+};
+
+SceneBVH sceneBVH;
+
+// Gribb and Hartmann plane extraction from a (projection * view) matrix
+Frustum frustumFromMatrix(const glm::mat4& viewProjection)
+{
+    glm::mat4 m = glm::transpose(viewProjection);
+    Frustum frustum;
+    frustum.planes[0] = m[3] + m[0]; // Left
+    frustum.planes[1] = m[3] - m[0]; // Right
+    frustum.planes[2] = m[3] + m[1]; // Bottom
+    frustum.planes[3] = m[3] - m[1]; // Top
+    frustum.planes[4] = m[3] + m[2]; // Near
+    frustum.planes[5] = m[3] - m[2]; // Far
+
+    for (glm::vec4& plane : frustum.planes)
+        plane /= glm::length(glm::vec3(plane));
+    return frustum;
+}
+
+FrustumTest testFrustumAABB(const Frustum& frustum, const AABB& box)
+{
+    FrustumTest result = FRUSTUM_INSIDE;
+    for (const glm::vec4& plane : frustum.planes)
+    {
+        glm::vec3 normal(plane);
+
+        // Corner furthest along the plane normal, if it is behind the plane so is the whole box
+        glm::vec3 positive(normal.x >= 0.f ? box.max.x : box.min.x,
+                           normal.y >= 0.f ? box.max.y : box.min.y,
+                           normal.z >= 0.f ? box.max.z : box.min.z);
+        if (glm::dot(normal, positive) + plane.w < 0.f)
+            return FRUSTUM_OUTSIDE;
+
+        glm::vec3 negative(normal.x >= 0.f ? box.min.x : box.max.x,
+                           normal.y >= 0.f ? box.min.y : box.max.y,
+                           normal.z >= 0.f ? box.min.z : box.max.z);
+        if (glm::dot(normal, negative) + plane.w < 0.f)
+            result = FRUSTUM_INTERSECTS;
+    }
+    return result;
+}
+
+AABB mergeAABB(const AABB& a, const AABB& b)
+{
+    AABB merged;
+    merged.min = glm::min(a.min, b.min);
+    merged.max = glm::max(a.max, b.max);
+    return merged;
+}
+
+// Top down build splitting at the median centre along the longest axis, order[first, last) are model ids
+int buildBVHNode(int first, int last, int parent)
+{
+    SceneBVH& bvh = sceneBVH;
+    int index = (int)bvh.nodes.size();
+    bvh.nodes.push_back(BVHNode());
+    bvh.nodes[index].parent = parent;
+    bvh.nodes[index].leafCount = last - first;
+
+    if (last - first == 1)
+    {
+        int model = bvh.buildOrder[first];
+        bvh.nodes[index].model = model;
+        bvh.nodes[index].box = models[model].worldAABB;
+        bvh.leafOfModel[model] = index;
+        return index;
+    }
+
+    AABB centerBounds;
+    for (int i = first; i < last; i++)
+    {
+        centerBounds.min = glm::min(centerBounds.min, bvh.centers[bvh.buildOrder[i]]);
+        centerBounds.max = glm::max(centerBounds.max, bvh.centers[bvh.buildOrder[i]]);
+    }
+    glm::vec3 extent = centerBounds.max - centerBounds.min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+    int middle = (first + last) / 2;
+    std::nth_element(bvh.buildOrder.begin() + first, bvh.buildOrder.begin() + middle, bvh.buildOrder.begin() + last,
+        [axis](int a, int b) { return sceneBVH.centers[a][axis] < sceneBVH.centers[b][axis]; });
+
+    int left = buildBVHNode(first, middle, index);
+    int right = buildBVHNode(middle, last, index);
+    bvh.nodes[index].left = left;
+    bvh.nodes[index].right = right;
+    bvh.nodes[index].box = mergeAABB(bvh.nodes[left].box, bvh.nodes[right].box);
+    return index;
+}
+
+void buildSceneBVH()
+{
+    SceneBVH& bvh = sceneBVH;
+    bvh.nodes.clear();
+    bvh.root = -1;
+    bvh.leafOfModel.assign(models.size(), -1);
+    bvh.buildOrder.clear();
+    bvh.centers.resize(models.size());
+
+    for (int i = 0; i < (int)models.size(); i++)
+    {
+        if (models[i].mesh < 0)
+            continue;
+        const AABB& box = models[i].worldAABB;
+        bvh.centers[i] = (box.min + box.max) * 0.5f;
+        bvh.buildOrder.push_back(i);
+    }
+
+    if (!bvh.buildOrder.empty())
+        bvh.root = buildBVHNode(0, (int)bvh.buildOrder.size(), -1);
+}
+
+// Update a moved model's leaf and grow or shrink the boxes on the path to the root
+void refitSceneBVH(int model)
+{
+    SceneBVH& bvh = sceneBVH;
+    int node = bvh.leafOfModel[model];
+    if (node < 0)
+        return;
+
+    bvh.nodes[node].box = models[model].worldAABB;
+    for (node = bvh.nodes[node].parent; node >= 0; node = bvh.nodes[node].parent)
+        bvh.nodes[node].box = mergeAABB(bvh.nodes[bvh.nodes[node].left].box, bvh.nodes[bvh.nodes[node].right].box);
+}
+
+/**
+ * Bring the BVH up to date with the models' cached world AABBs, rebuilding it when models were added
+ * and refitting the dirty ones otherwise
+ * Refitting keeps the tree valid but not optimal, a model that moves far keeps its place in the hierarchy
+ */
+void updateSceneBVH()
+{
+    if (sceneBVH.leafOfModel.size() != models.size())
+    {
+        buildSceneBVH();
+        return;
+    }
+
+    for (int model : dirtyModels)
+        refitSceneBVH(model);
+}
+
+/**
+ * Mark the models whose world AABB touches the frustum, visible must already be sized to models.size()
+ *
+ *@return number of models found outside the frustum
+ */
+int queryFrustum(const Frustum& frustum, std::vector<unsigned char>& visible)
+{
+    SceneBVH& bvh = sceneBVH;
+    if (bvh.root < 0)
+        return 0;
+
+    int culled = 0;
+    bvh.stack.clear();
+    bvh.stack.push_back(bvh.root);
+    while (!bvh.stack.empty())
+    {
+        int index = bvh.stack.back();
+        bvh.stack.pop_back();
+        const BVHNode& node = bvh.nodes[index];
+
+        FrustumTest test = testFrustumAABB(frustum, node.box);
+        if (test == FRUSTUM_OUTSIDE)
+        {
+            culled += node.leafCount;
+            continue;
+        }
+
+        if (node.model >= 0)
+        {
+            visible[node.model] = 1;
+            continue;
+        }
+
+        if (test == FRUSTUM_INSIDE)
+        {
+            // Whole subtree is visible, collect its leaves without testing them
+            int end = (int)bvh.stack.size();
+            bvh.stack.push_back(node.left);
+            bvh.stack.push_back(node.right);
+            while ((int)bvh.stack.size() > end)
+            {
+                const BVHNode& inside = bvh.nodes[bvh.stack.back()];
+                bvh.stack.pop_back();
+                if (inside.model >= 0)
+                    visible[inside.model] = 1;
+                else
+                {
+                    bvh.stack.push_back(inside.left);
+                    bvh.stack.push_back(inside.right);
+                }
+            }
+            continue;
+        }
+
+        bvh.stack.push_back(node.left);
+        bvh.stack.push_back(node.right);
+    }
+    return culled;
+}
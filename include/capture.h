@@ -0,0 +1,353 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <GL/gl3w.h>
+
+#include "asset_loader.h"
+#include "frame_stats.h"
+#include "light.h"
+#include "shadow_atlas.h"
+
+// Debug captures of GPU images that never stall the frame
+// A region is copied into a pixel pack buffer with a fence behind it, once the fence has passed the buffer is mapped and
+// a worker thread converts and encodes the mapped pixels straight to disk, then the buffer is unmapped and reused
+// Only the standard library is used for the files, so captures work the same on Windows and Linux
+
+enum CaptureFormat
+{
+    CAPTURE_PNG = 1, // 8-bit greyscale, stretched over the image's range of values
+    CAPTURE_PFM = 2  // 32-bit float, the values exactly as read back
+};
+
+struct CaptureJob
+{
+    std::string name; // File name without the extension
+    unsigned int formats = 0;
+    int width = 0;
+    int height = 0;
+
+    GLuint buffer = 0;
+    GLsizeiptr bufferSize = 0;
+    GLsync fence = 0;
+
+    // Set once the buffer is mapped, the worker then reads pixels until it sets written
+    bool mapped = false;
+    const float* pixels = NULL;
+    std::atomic<bool> written{ false };
+};
+
+struct Captures
+{
+    ThreadPool worker;
+    std::vector<std::pair<GLuint, GLsizeiptr>> freeBuffers; // Pixel pack buffers and their sizes
+    std::vector<std::shared_ptr<CaptureJob>> jobs;          // Oldest first
+};
+
+Captures captures;
+
+std::vector<uint32_t> makeCrcTable()
+{
+    std::vector<uint32_t> table(256);
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        table[n] = c;
+    }
+    return table;
+}
+
+// CRC-32 of PNG chunks, continue a running CRC by passing its previous result, start from 0
+uint32_t updateCrc32(uint32_t crc, const unsigned char* data, size_t length)
+{
+    static const std::vector<uint32_t> table = makeCrcTable();
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+void appendBigEndian(std::vector<unsigned char>& bytes, uint32_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+        bytes.push_back((unsigned char)(value >> shift));
+}
+
+void writePngChunk(std::ofstream& file, const char* type, const std::vector<unsigned char>& data)
+{
+    std::vector<unsigned char> chunk;
+    appendBigEndian(chunk, (uint32_t)data.size());
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    appendBigEndian(chunk, updateCrc32(0, chunk.data() + 4, chunk.size() - 4));
+    file.write((const char*)chunk.data(), chunk.size());
+}
+
+/**
+ * Write 8-bit greyscale pixels, rows top to bottom, as a PNG
+ * The image data is stored uncompressed in a zlib stream, which needs no compressor and is still a valid PNG
+ *
+ *@return false if the file could not be written
+ */
+bool writePng(const std::string& filename, const unsigned char* grey, int width, int height)
+{
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+        return false;
+
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    file.write((const char*)signature, sizeof(signature));
+
+    std::vector<unsigned char> header;
+    appendBigEndian(header, (uint32_t)width);
+    appendBigEndian(header, (uint32_t)height);
+    header.push_back(8); // Bit depth
+    header.push_back(0); // Greyscale
+    header.push_back(0); // Deflate
+    header.push_back(0); // Adaptive filtering
+    header.push_back(0); // Not interlaced
+    writePngChunk(file, "IHDR", header);
+
+    // Every row starts with filter type 0, none
+    std::vector<unsigned char> rows;
+    rows.reserve((size_t)(width + 1) * height);
+    for (int y = 0; y < height; y++)
+    {
+        rows.push_back(0);
+        rows.insert(rows.end(), grey + (size_t)y * width, grey + (size_t)(y + 1) * width);
+    }
+
+    // zlib stream of stored deflate blocks, each up to 65535 bytes, and the Adler-32 of the rows
+    std::vector<unsigned char> data = { 0x78, 0x01 };
+    data.reserve(rows.size() + rows.size() / 65535 * 5 + 16);
+    size_t offset = 0;
+    do
+    {
+        size_t length = std::min(rows.size() - offset, (size_t)65535);
+        data.push_back(offset + length == rows.size() ? 1 : 0); // Final block flag
+        data.push_back((unsigned char)length);
+        data.push_back((unsigned char)(length >> 8));
+        data.push_back((unsigned char)~length);
+        data.push_back((unsigned char)(~length >> 8));
+        data.insert(data.end(), rows.begin() + offset, rows.begin() + offset + length);
+        offset += length;
+    } while (offset < rows.size());
+    uint32_t a = 1, b = 0;
+    for (unsigned char byte : rows)
+    {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    appendBigEndian(data, (b << 16) | a);
+    writePngChunk(file, "IDAT", data);
+    writePngChunk(file, "IEND", std::vector<unsigned char>());
+
+    return (bool)file;
+}
+
+/**
+ * Write float pixels, rows bottom to top as GL reads them back, as a greyscale PFM
+ *
+ *@return false if the file could not be written
+ */
+bool writePfm(const std::string& filename, const float* pixels, int width, int height)
+{
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+        return false;
+
+    // A negative scale marks the floats as little endian
+    std::string header = "Pf\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+    file.write(header.data(), header.size());
+    file.write((const char*)pixels, (std::streamsize)width * height * sizeof(float));
+    return (bool)file;
+}
+
+// Convert and write a mapped capture, runs on the worker thread and must not touch GL
+void encodeCapture(CaptureJob& job)
+{
+    if (job.formats & CAPTURE_PFM)
+    {
+        std::string filename = job.name + ".pfm";
+        if (writePfm(filename, job.pixels, job.width, job.height))
+            printf("Capture: wrote %s (%ix%i)\n", filename.c_str(), job.width, job.height);
+        else
+            printf("Capture: could not write %s\n", filename.c_str());
+    }
+
+    if (job.formats & CAPTURE_PNG)
+    {
+        size_t count = (size_t)job.width * job.height;
+        float low = job.pixels[0], high = job.pixels[0];
+        for (size_t i = 1; i < count; i++)
+        {
+            low = std::min(low, job.pixels[i]);
+            high = std::max(high, job.pixels[i]);
+        }
+        float scale = high > low ? 255.f / (high - low) : 0.f;
+
+        // PNG rows go top to bottom
+        std::vector<unsigned char> grey(count);
+        for (int y = 0; y < job.height; y++)
+        {
+            const float* row = job.pixels + (size_t)(job.height - 1 - y) * job.width;
+            for (int x = 0; x < job.width; x++)
+                grey[(size_t)y * job.width + x] = (unsigned char)((row[x] - low) * scale + 0.5f);
+        }
+
+        std::string filename = job.name + ".png";
+        if (writePng(filename, grey.data(), job.width, job.height))
+            printf("Capture: wrote %s (%ix%i, values %.4f to %.4f)\n", filename.c_str(), job.width, job.height, low, high);
+        else
+            printf("Capture: could not write %s\n", filename.c_str());
+    }
+
+    job.written = true;
+}
+
+/**
+ * Queue a readback of one channel of a texture region, written to name.png and/or name.pfm on the worker thread
+ * Returns straight away, call pollCaptures() every frame to move finished copies on to the worker
+ *
+ *@param pixelFormat GL_DEPTH_COMPONENT for depth textures, GL_RED for the first channel of colour ones
+ *@param formats CaptureFormat flags
+ */
+void captureTexture(GLuint texture, GLint level, GLenum pixelFormat, int x, int y, int width, int height, const std::string& name, unsigned int formats)
+{
+    std::shared_ptr<CaptureJob> job = std::make_shared<CaptureJob>();
+    job->name = name;
+    job->formats = formats;
+    job->width = width;
+    job->height = height;
+
+    // Reuse the smallest free buffer that is big enough
+    GLsizeiptr size = (GLsizeiptr)width * height * sizeof(float);
+    int best = -1;
+    for (int i = 0; i < (int)captures.freeBuffers.size(); i++)
+        if (captures.freeBuffers[i].second >= size && (best < 0 || captures.freeBuffers[i].second < captures.freeBuffers[best].second))
+            best = i;
+    if (best >= 0)
+    {
+        job->buffer = captures.freeBuffers[best].first;
+        job->bufferSize = captures.freeBuffers[best].second;
+        captures.freeBuffers.erase(captures.freeBuffers.begin() + best);
+    }
+    else
+    {
+        glCreateBuffers(1, &job->buffer);
+        glNamedBufferStorage(job->buffer, size, NULL, GL_MAP_READ_BIT);
+        job->bufferSize = size;
+    }
+
+    // With a pack buffer bound the copy is queued on the GPU and the pointer is an offset into the buffer
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, job->buffer);
+    glGetTextureSubImage(texture, level, x, y, 0, width, height, 1, pixelFormat, GL_FLOAT, (GLsizei)size, NULL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    job->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    captures.jobs.push_back(job);
+}
+
+// Queue a light's shadow as it is in the atlas, a point light's faces and a cascaded light's cascades as separate images
+void captureShadow(int lightIndex, unsigned int formats)
+{
+    const Light& light = lights[lightIndex];
+    const ShadowStruct& shadow = light.shadow;
+    if (shadow.size == 0)
+    {
+        printf("Capture: light %i has no shadow in the atlas\n", lightIndex);
+        return;
+    }
+
+    int x, y;
+    if (light.type == POSITIONAL)
+    {
+        for (int face = 0; face < 6; face++)
+        {
+            shadowFaceOrigin(shadow, face, x, y);
+            captureTexture(shadowAtlas.texture, 0, GL_DEPTH_COMPONENT, x, y, shadow.size, shadow.size,
+                "shadow_light" + std::to_string(lightIndex) + "_face" + std::to_string(face), formats);
+        }
+    }
+    else if (light.cascaded)
+    {
+        for (int cascade = 0; cascade < SHADOW_CASCADES; cascade++)
+        {
+            shadowCascadeOrigin(shadow, cascade, x, y);
+            captureTexture(shadowAtlas.texture, 0, GL_DEPTH_COMPONENT, x, y, shadow.size, shadow.size,
+                "shadow_light" + std::to_string(lightIndex) + "_cascade" + std::to_string(cascade), formats);
+        }
+    }
+    else
+        captureTexture(shadowAtlas.texture, 0, GL_DEPTH_COMPONENT, shadow.x, shadow.y, shadow.size, shadow.size,
+            "shadow_light" + std::to_string(lightIndex), formats);
+}
+
+/**
+ * Move captures along without waiting, call once per frame
+ * Copies the GPU has finished are mapped and handed to the worker, written ones are unmapped and their buffers freed
+ */
+void pollCaptures()
+{
+    for (size_t i = 0; i < captures.jobs.size();)
+    {
+        std::shared_ptr<CaptureJob> job = captures.jobs[i];
+        if (!job->mapped)
+        {
+            // A zero timeout only asks, a copy that is still running is checked again next frame
+            if (glClientWaitSync(job->fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+            {
+                i++;
+                continue;
+            }
+            glDeleteSync(job->fence);
+            job->mapped = true;
+            job->pixels = (const float*)glMapNamedBufferRange(job->buffer, 0, (GLsizeiptr)job->width * job->height * sizeof(float), GL_MAP_READ_BIT);
+            if (!job->pixels)
+            {
+                printf("Capture: could not map the readback of %s\n", job->name.c_str());
+                job->written = true;
+                continue;
+            }
+
+            if (captures.worker.workers.empty())
+                startThreadPool(captures.worker, 1);
+            submitJob(captures.worker, [job]() { encodeCapture(*job); });
+            i++;
+            continue;
+        }
+
+        if (!job->written)
+        {
+            i++;
+            continue;
+        }
+        if (job->pixels)
+            glUnmapNamedBuffer(job->buffer);
+        captures.freeBuffers.push_back(std::make_pair(job->buffer, job->bufferSize));
+        captures.jobs.erase(captures.jobs.begin() + i);
+    }
+}
+
+// Finish every queued capture and stop the worker, call before the context is destroyed
+void finishCaptures()
+{
+    if (!captures.jobs.empty())
+        glFinish();
+    while (!captures.jobs.empty())
+    {
+        pollCaptures();
+        std::this_thread::yield();
+    }
+    if (!captures.worker.workers.empty())
+        stopThreadPool(captures.worker);
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include <cmath>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "light.h"
+#include "shadow_atlas.h"
+
+// Cascaded shadow maps for the cascaded directional light, the view frustum up to SHADOW_CASCADE_DISTANCE is split
+// into SHADOW_CASCADES slices and each slice gets its own ortho shadow map tile, nearest slices get the most detail
+
+#define SHADOW_CASCADE_DISTANCE 30.f
+
+// Practical split scheme, blend between logarithmic (1) and uniform (0) split distances
+#define SHADOW_CASCADE_LAMBDA 0.75f
+
+// How far beyond a slice towards the light casters are still drawn into its cascade
+#define SHADOW_CASCADE_CASTER_DEPTH 20.f
+
+struct ShadowCascades
+{
+    int light = -1; // Index of the cascaded light, -1 if there is none
+
+    // View distance of the far end of each cascade, as fitted to the current camera
+    float splits[SHADOW_CASCADES] = {};
+
+    // Cascades whose matrix changed since they were last rendered, their static depth is stale too
+    unsigned int moved = 0;
+
+    // What the cascades in the atlas were last rendered with, the lighting shader uses these
+    glm::mat4 renderedMatrices[SHADOW_CASCADES];
+    float renderedSplits[SHADOW_CASCADES] = {};
+};
+
+ShadowCascades shadowCascades;
+
+/**
+ * Ortho view projection covering the world space corners of one camera frustum slice
+ * The box is fitted around the slice's bounding sphere so its size does not change as the camera turns, and
+ * its origin is snapped to whole texels so the shadow edges do not shimmer as the camera moves
+ */
+glm::mat4 cascadeMatrix(const glm::vec3& direction, const glm::vec3 corners[8], int tileSize)
+{
+    glm::vec3 center(0.f);
+    for (int i = 0; i < 8; i++)
+        center += corners[i] / 8.f;
+    float radius = 0.f;
+    for (int i = 0; i < 8; i++)
+        radius = std::max(radius, glm::length(corners[i] - center));
+    radius = std::ceil(radius * 16.f) / 16.f;
+
+    glm::vec3 up = std::abs(direction.y) > 0.99f ? glm::vec3(0.f, 0.f, 1.f) : glm::vec3(0.f, 1.f, 0.f);
+    glm::mat4 lightView = glm::lookAt(center - direction * (radius + SHADOW_CASCADE_CASTER_DEPTH), center, up);
+    glm::mat4 lightProjection = glm::ortho(-radius, radius, -radius, radius, 0.f, 2.f * radius + SHADOW_CASCADE_CASTER_DEPTH);
+
+    // Move the box by less than a texel so the world origin lands on a texel corner
+    glm::vec4 origin = lightProjection * lightView * glm::vec4(0.f, 0.f, 0.f, 1.f) * (tileSize / 2.f);
+    glm::vec2 offset = (glm::round(glm::vec2(origin)) - glm::vec2(origin)) * (2.f / tileSize);
+    lightProjection[3][0] += offset.x;
+    lightProjection[3][1] += offset.y;
+
+    return lightProjection * lightView;
+}
+
+/**
+ * Fit the cascades to the camera, call once per frame before the shadow passes
+ * Cascades whose matrix changed are flagged in shadowCascades.moved and the light's shadow is marked for an update
+ */
+void updateCascades(const glm::mat4& view, float fovY, float aspect, float nearPlane)
+{
+    shadowCascades.light = -1;
+    for (int i = 0; i < (int)lights.size(); i++)
+        if (lights[i].cascaded)
+            shadowCascades.light = i;
+    if (shadowCascades.light < 0)
+        return;
+
+    Light& light = lights[shadowCascades.light];
+    if (light.shadow.size == 0)
+        return;
+
+    glm::mat4 inverseView = glm::inverse(view);
+    glm::vec3 right(inverseView[0]), up(inverseView[1]), forward(-inverseView[2]), position(inverseView[3]);
+    glm::vec3 direction = glm::normalize(light.direction);
+    float tanHalfFov = std::tan(fovY / 2.f);
+
+    float sliceNear = nearPlane;
+    for (int cascade = 0; cascade < SHADOW_CASCADES; cascade++)
+    {
+        float fraction = (cascade + 1) / (float)SHADOW_CASCADES;
+        float logSplit = nearPlane * std::pow(SHADOW_CASCADE_DISTANCE / nearPlane, fraction);
+        float uniformSplit = nearPlane + (SHADOW_CASCADE_DISTANCE - nearPlane) * fraction;
+        float sliceFar = SHADOW_CASCADE_LAMBDA * logSplit + (1.f - SHADOW_CASCADE_LAMBDA) * uniformSplit;
+        shadowCascades.splits[cascade] = sliceFar;
+
+        glm::vec3 corners[8];
+        for (int corner = 0; corner < 8; corner++)
+        {
+            float distance = (corner & 4) ? sliceFar : sliceNear;
+            float halfHeight = distance * tanHalfFov;
+            float halfWidth = halfHeight * aspect;
+            corners[corner] = position + forward * distance +
+                right * ((corner & 1) ? halfWidth : -halfWidth) + up * ((corner & 2) ? halfHeight : -halfHeight);
+        }
+
+        glm::mat4 matrix = cascadeMatrix(direction, corners, light.shadow.size);
+        if (matrix != light.shadowMatrices[cascade])
+        {
+            light.shadowMatrices[cascade] = matrix;
+            shadowCascades.moved |= 1u << cascade;
+            light.shadow.updateShadow = true;
+        }
+        sliceNear = sliceFar;
+    }
+}
+
+// Record that every cascade in the atlas now matches the fitted matrices
+void markCascadesRendered()
+{
+    const Light& light = lights[shadowCascades.light];
+    for (int cascade = 0; cascade < SHADOW_CASCADES; cascade++)
+    {
+        shadowCascades.renderedMatrices[cascade] = light.shadowMatrices[cascade];
+        shadowCascades.renderedSplits[cascade] = shadowCascades.splits[cascade];
+    }
+    shadowCascades.moved = 0;
+}
@@ -28,6 +28,20 @@ point evaluate(float t, std::list<point> P)
 	return Q.front();
 }
 
+// Same as evaluate() but reduces in place in a caller owned buffer, so it does not allocate once scratch is large enough
+point evaluate(float t, const std::vector<point>& P, std::vector<point>& scratch)
+{
+	scratch.assign(P.begin(), P.end());
+
+	for (size_t n = scratch.size(); n > 1; n--)
+	{
+		for (size_t i = 0; i + 1 < n; i++)
+			scratch[i] = operator+(operator*(1 - t, scratch[i]), (operator*(t, scratch[i + 1])));
+	}
+
+	return scratch.front();
+}
+
 std::vector<point> EvaluateBezierCurve(std::vector<point>ctrl_points, int num_evaluations)
 {
 	std::list<point> ps(ctrl_points.begin(), ctrl_points.end());
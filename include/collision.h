@@ -1,10 +1,10 @@
 #pragma once
 #include "model.h"
 
-void calculateAABB(model&);
+void calculateAABB(Mesh&);
 AABB calculateWorldAABB(model&);
 
-void calculateAABB(model& m)
+void calculateAABB(Mesh& m)
 {
     m.aabb.min = glm::vec3(std::numeric_limits<float>::max());
     m.aabb.max = glm::vec3(std::numeric_limits<float>::lowest());
@@ -15,40 +15,13 @@ void calculateAABB(model& m)
         m.aabb.min = glm::min(m.aabb.min, pos);
         m.aabb.max = glm::max(m.aabb.max, pos);
     }
-    printf("Collision: Successfully calculated local AABB for %d\n", m.bufferIndex);
+    printf("Collision: Successfully calculated local AABB for %s\n", m.name.c_str());
 }
 
+// World AABB computed from scratch, the render loop uses the cached model.worldAABB instead
 AABB calculateWorldAABB(model& m)
 {
-    // Get the 8 corners of the local AABB
-    glm::vec3 corners[8] = {
-        glm::vec3(m.aabb.min.x, m.aabb.min.y, m.aabb.min.z),
-        glm::vec3(m.aabb.max.x, m.aabb.min.y, m.aabb.min.z),
-        glm::vec3(m.aabb.max.x, m.aabb.max.y, m.aabb.min.z),
-        glm::vec3(m.aabb.min.x, m.aabb.max.y, m.aabb.min.z),
-        glm::vec3(m.aabb.min.x, m.aabb.min.y, m.aabb.max.z),
-        glm::vec3(m.aabb.max.x, m.aabb.min.y, m.aabb.max.z),
-        glm::vec3(m.aabb.max.x, m.aabb.max.y, m.aabb.max.z),
-        glm::vec3(m.aabb.min.x, m.aabb.max.y, m.aabb.max.z)
-    };
-
-    // Calculate the world transformation matrix 
-    glm::mat4 modelMatrix = glm::mat4(1.f);
-    modelMatrix = glm::translate(modelMatrix, m.position);
-    modelMatrix = glm::rotate(modelMatrix, glm::radians(m.rotation.x), glm::vec3(1.f, 0.f, 0.f));
-    modelMatrix = glm::rotate(modelMatrix, glm::radians(m.rotation.y), glm::vec3(0.f, 1.f, 0.f));
-    modelMatrix = glm::rotate(modelMatrix, glm::radians(m.rotation.z), glm::vec3(0.f, 0.f, 1.f));
-    modelMatrix = glm::scale(modelMatrix, m.scale);
-
-    AABB worldAABB;
-    // Transform each corner
-    for (glm::vec3 corner : corners)
-    {
-        glm::vec4 transformedCorner = modelMatrix * glm::vec4(corner, 1.f);
-        worldAABB.min = glm::min(worldAABB.min, glm::vec3(transformedCorner));
-        worldAABB.max = glm::max(worldAABB.max, glm::vec3(transformedCorner));
-    }
-    return worldAABB;
+    return transformAABB(meshes.at(m.mesh).aabb, modelMatrix(m));
 }
 
 // https://en.wikipedia.org/wiki/Slab_method
@@ -0,0 +1,191 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "bvh.h"
+#include "collision.h"
+#include "frame_stats.h"
+#include "model.h"
+#include "shader_permutations.h"
+
+// Everything a draw needs, flattened out of the models so the render passes never walk the model vector
+struct DrawItem
+{
+    GLuint VAO;
+    GLuint depthVAO;
+    GLsizei indexCount;
+    int mesh;
+    int material;
+    int model;
+    bool transparent;
+    bool dynamic;
+    uint32_t permutation; // Material bits of the shader permutation, see materialPermutation()
+
+    // Opaque items are submitted in this order, see drawSortKey()
+    uint64_t sortKey;
+
+    glm::vec3 worldCenter; // Used to sort transparent items back to front
+};
+
+// Instances sharing a mesh and material, drawn with a single instanced call
+struct DrawBatch
+{
+    int mesh;
+    int material;
+    uint32_t permutation;
+    int firstInstance;
+    int instanceCount;
+};
+
+struct DrawList
+{
+    // Opaque items grouped by mesh and material, then the transparent items
+    // An item's index is also its slot in the instance matrix buffer
+    std::vector<DrawItem> items;
+    std::vector<DrawBatch> batches;
+    int firstTransparent = 0;
+
+    // Index of each model's item, so a moved model only updates its own slot
+    std::vector<int> itemOfModel;
+
+    // Back to front order of the transparent items, refilled every pass without reallocating
+    std::vector<std::pair<float, int>> transparentOrder;
+
+    // Per model flag set by cullDrawList() for the current pass
+    std::vector<unsigned char> visibleModels;
+};
+
+DrawList drawList;
+
+// Which models a depth pass draws, shadow maps cache the static ones and redraw only the dynamic ones
+enum ShadowCasters
+{
+    CASTERS_ALL,
+    CASTERS_STATIC,
+    CASTERS_DYNAMIC
+};
+
+bool castsIn(const DrawItem& item, ShadowCasters casters)
+{
+    return casters == CASTERS_ALL || item.dynamic == (casters == CASTERS_DYNAMIC);
+}
+
+/**
+ * Sort key ordering draws by program, then material, then vertex array, so consecutive draws
+ * share as much bound state as possible; transparent items always sort after opaque ones
+ * The program field is the item's permutation, so draws are bucketed by shader variant whatever the pass
+ *
+ * bit 63 transparent | bits 48-62 program | bits 24-47 material | bits 0-23 vertex array
+ */
+uint64_t drawSortKey(bool transparent, uint32_t program, uint32_t material, uint32_t vertexArray)
+{
+    return ((uint64_t)(transparent ? 1 : 0) << 63) |
+        ((uint64_t)(program & 0x7FFF) << 48) |
+        ((uint64_t)(material & 0xFFFFFF) << 24) |
+        (uint64_t)(vertexArray & 0xFFFFFF);
+}
+
+/**
+ * Rebuild the draw list from the models, only needed when drawListDirty is set
+ * The vectors keep their capacity so a rebuild does not allocate once the scene has been built
+ */
+void buildDrawList()
+{
+    drawList.items.clear();
+    drawList.batches.clear();
+
+    for (int i = 0; i < (int)models.size(); i++)
+    {
+        const Mesh& mesh = meshes.at(models[i].mesh);
+
+        DrawItem item;
+        item.VAO = mesh.VAO;
+        item.depthVAO = mesh.depthVAO;
+        item.indexCount = (GLsizei)mesh.indices.size();
+        item.mesh = models[i].mesh;
+        item.material = models[i].material;
+        item.model = i;
+        item.transparent = materials.at(models[i].material).textures.hasOpacity;
+        item.dynamic = models[i].dynamic;
+        item.permutation = materialPermutation(materials.at(models[i].material).textures);
+        item.sortKey = drawSortKey(item.transparent, item.permutation, (uint32_t)item.material, item.VAO);
+        item.worldCenter = (models[i].worldAABB.min + models[i].worldAABB.max) * 0.5f;
+
+        drawList.items.push_back(item);
+    }
+
+    std::sort(drawList.items.begin(), drawList.items.end(), [](const DrawItem& a, const DrawItem& b)
+    {
+        if (a.sortKey != b.sortKey)
+            return a.sortKey < b.sortKey;
+        return a.model < b.model;
+    });
+
+    drawList.itemOfModel.assign(models.size(), -1);
+    for (int i = 0; i < (int)drawList.items.size(); i++)
+        drawList.itemOfModel[drawList.items[i].model] = i;
+
+    // Split the opaque items into runs of the same mesh and material
+    drawList.firstTransparent = (int)drawList.items.size();
+    for (int i = 0; i < (int)drawList.items.size(); i++)
+    {
+        const DrawItem& item = drawList.items[i];
+        if (item.transparent)
+        {
+            drawList.firstTransparent = i;
+            break;
+        }
+
+        if (drawList.batches.empty() || drawList.batches.back().mesh != item.mesh || drawList.batches.back().material != item.material)
+        {
+            DrawBatch batch;
+            batch.mesh = item.mesh;
+            batch.material = item.material;
+            batch.permutation = item.permutation;
+            batch.firstInstance = i;
+            batch.instanceCount = 0;
+            drawList.batches.push_back(batch);
+        }
+        drawList.batches.back().instanceCount++;
+    }
+
+    drawListDirty = false;
+}
+
+// Refresh the world centre of a moved model's item, the list order does not depend on transforms
+void refreshDrawItem(int model)
+{
+    int item = drawList.itemOfModel[model];
+    drawList.items[item].worldCenter = (models[model].worldAABB.min + models[model].worldAABB.max) * 0.5f;
+}
+
+// Order the transparent items back to front as seen from viewPosition
+void sortTransparentItems(const glm::vec3& viewPosition)
+{
+    drawList.transparentOrder.clear();
+    for (int i = drawList.firstTransparent; i < (int)drawList.items.size(); i++)
+    {
+        float distance = glm::length(viewPosition - drawList.items[i].worldCenter); // Use center distance
+        drawList.transparentOrder.push_back(std::make_pair(-distance, i));
+    }
+    std::sort(drawList.transparentOrder.begin(), drawList.transparentOrder.end());
+}
+
+/**
+ * Find the models the current pass can see, a model is visible if any of the frusta contain part of its world AABB
+ * Records drawn and culled counts per frustum under passName, indexed by frustum or by passIndex when the pass has a single frustum
+ */
+void cullDrawList(const glm::mat4* viewProjections, int frustumCount, const char* passName, int passIndex = -1)
+{
+    drawList.visibleModels.assign(models.size(), 0);
+
+    unsigned int total = sceneBVH.root >= 0 ? (unsigned int)sceneBVH.nodes[sceneBVH.root].leafCount : 0;
+    for (int i = 0; i < frustumCount; i++)
+    {
+        unsigned int culled = (unsigned int)queryFrustum(frustumFromMatrix(viewProjections[i]), drawList.visibleModels);
+        recordPass(passName, frustumCount > 1 ? i : passIndex, total - culled, culled);
+    }
+}
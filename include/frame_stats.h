@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <GL/gl3w.h>
+
+// Per-frame counters shown in the window title, reset at the start of every frame
+
+#define MAX_PASS_STATS 64
+
+// Models drawn and culled by one render pass, index tells apart the lights or cube faces sharing a name
+struct PassStats
+{
+    const char* name;
+    int index;
+    unsigned int drawn;
+    unsigned int culled;
+};
+
+struct FrameStats
+{
+    // Heap allocations made through operator new, on any thread
+    std::atomic<unsigned int> allocations{ 0 };
+    std::atomic<size_t> allocatedBytes{ 0 };
+
+    // GL calls made by the render loop, only ever touched on the context thread
+    unsigned int driverCalls = 0;
+
+    // Program, vertex array and texture binds that were issued or skipped as redundant, see render_state.h
+    unsigned int stateChanges = 0;
+    unsigned int stateChangesSkipped = 0;
+
+    PassStats passes[MAX_PASS_STATS];
+    unsigned int passCount = 0;
+};
+
+// Plain copy of the counters of the last finished frame
+struct FrameCounters
+{
+    unsigned int allocations = 0;
+    size_t allocatedBytes = 0;
+    unsigned int driverCalls = 0;
+    unsigned int stateChanges = 0;
+    unsigned int stateChangesSkipped = 0;
+
+    PassStats passes[MAX_PASS_STATS];
+    unsigned int passCount = 0;
+};
+
+FrameStats frameStats;
+FrameCounters lastFrameStats;
+
+void beginFrameStats()
+{
+    frameStats.allocations.store(0, std::memory_order_relaxed);
+    frameStats.allocatedBytes.store(0, std::memory_order_relaxed);
+    frameStats.driverCalls = 0;
+    frameStats.stateChanges = 0;
+    frameStats.stateChangesSkipped = 0;
+    frameStats.passCount = 0;
+}
+
+void endFrameStats()
+{
+    lastFrameStats.allocations = frameStats.allocations.load(std::memory_order_relaxed);
+    lastFrameStats.allocatedBytes = frameStats.allocatedBytes.load(std::memory_order_relaxed);
+    lastFrameStats.driverCalls = frameStats.driverCalls;
+    lastFrameStats.stateChanges = frameStats.stateChanges;
+    lastFrameStats.stateChangesSkipped = frameStats.stateChangesSkipped;
+    lastFrameStats.passCount = frameStats.passCount;
+    for (unsigned int i = 0; i < frameStats.passCount; i++)
+        lastFrameStats.passes[i] = frameStats.passes[i];
+}
+
+void recordPass(const char* name, int index, unsigned int drawn, unsigned int culled)
+{
+    if (frameStats.passCount >= MAX_PASS_STATS)
+        return;
+    PassStats& pass = frameStats.passes[frameStats.passCount++];
+    pass.name = name;
+    pass.index = index;
+    pass.drawn = drawn;
+    pass.culled = culled;
+}
+
+// Drawn and culled totals of the last frame's passes with the given name, or of all passes if name is NULL
+void sumPasses(const char* name, unsigned int& drawn, unsigned int& culled)
+{
+    drawn = culled = 0;
+    for (unsigned int i = 0; i < lastFrameStats.passCount; i++)
+    {
+        const PassStats& pass = lastFrameStats.passes[i];
+        if (name == NULL || strcmp(pass.name, name) == 0)
+        {
+            drawn += pass.drawn;
+            culled += pass.culled;
+        }
+    }
+}
+
+void printPassStats()
+{
+    printf("\nFrame: %u GL calls, %u binds and %u redundant binds skipped, %u allocations\n", lastFrameStats.driverCalls,
+        lastFrameStats.stateChanges, lastFrameStats.stateChangesSkipped, lastFrameStats.allocations);
+    printf("%-12s %6s %8s %8s\n", "pass", "index", "drawn", "culled");
+    for (unsigned int i = 0; i < lastFrameStats.passCount; i++)
+    {
+        const PassStats& pass = lastFrameStats.passes[i];
+        printf("%-12s %6d %8u %8u\n", pass.name, pass.index, pass.drawn, pass.culled);
+    }
+}
+
+// Replace the global allocation functions so every new/delete goes through the counters,
+// array and nothrow forms forward to these in both MSVC's and libstdc++'s runtimes
+void* operator new(size_t size)
+{
+    frameStats.allocations.fetch_add(1, std::memory_order_relaxed);
+    frameStats.allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+
+    if (size == 0)
+        size = 1;
+    while (true)
+    {
+        void* memory = malloc(size);
+        if (memory)
+            return memory;
+
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    free(memory);
+}
+
+// Count every GL call made through gl3w, each glX macro of gl3w.h reads gl3wProcs, so the counter is added there
+// A macro naming itself is not expanded again, so the right hand gl3wProcs is the real table
+// Every header that calls GL includes this one before any of its own code, calls made before it would not be counted
+#define gl3wProcs (frameStats.driverCalls++, gl3wProcs)
@@ -0,0 +1,65 @@
+#pragma once
+#include <cstdint>
+#include <glm/glm.hpp>
+
+#include "cascades.h"
+#include "frame_stats.h"
+#include "light.h"
+#include "light_clusters.h"
+
+// Per-frame data shared by pbr.vert and pbr.frag through one std140 uniform block,
+// the block is bound once at start up and refreshed with a single upload per frame
+#define FRAME_UNIFORMS_BINDING 0
+
+// std140 layout of the FrameUniforms block
+struct FrameUniforms
+{
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::mat4 inverseViewProjection;
+    glm::mat4 cascadeMatrices[SHADOW_CASCADES];
+    glm::vec4 cascadeSplits; // View distance of the far end of each cascade
+    glm::vec4 clusterScale;  // See LightClusters::scale, the lights themselves are in shader storage buffers
+    glm::vec3 camPos;
+    float farPlane;
+    int32_t numLights;
+    int32_t cascadedLight; // -1 if no light is cascaded
+    int32_t padding[2];
+};
+
+static_assert(sizeof(FrameUniforms) == 3 * 64 + SHADOW_CASCADES * 64 + 2 * 16 + 32, "FrameUniforms must match the std140 FrameUniforms block");
+
+GLuint frameUniformBuffer = 0;
+FrameUniforms frameUniforms;
+
+void createFrameUniforms()
+{
+    glCreateBuffers(1, &frameUniformBuffer);
+    glNamedBufferStorage(frameUniformBuffer, sizeof(FrameUniforms), NULL, GL_DYNAMIC_STORAGE_BIT);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, frameUniformBuffer);
+}
+
+/**
+ * Fill in the camera data for this frame and upload it in one call
+ * Call after updateLightClusters(), which the cluster scale comes from
+ */
+void updateFrameUniforms(const glm::mat4& view, const glm::mat4& projection, const glm::vec3& camPos, float farPlane)
+{
+    frameUniforms.view = view;
+    frameUniforms.projection = projection;
+    frameUniforms.inverseViewProjection = glm::inverse(projection * view);
+    frameUniforms.camPos = camPos;
+    frameUniforms.farPlane = farPlane;
+    frameUniforms.numLights = (int32_t)lights.size();
+    frameUniforms.clusterScale = lightClusters.scale;
+
+    // Cascades as they were last rendered
+    frameUniforms.cascadedLight = shadowCascades.light;
+    for (int cascade = 0; cascade < SHADOW_CASCADES; cascade++)
+    {
+        frameUniforms.cascadeMatrices[cascade] = shadowCascades.renderedMatrices[cascade];
+        frameUniforms.cascadeSplits[cascade] = shadowCascades.renderedSplits[cascade];
+    }
+
+    glNamedBufferSubData(frameUniformBuffer, 0, sizeof(FrameUniforms), &frameUniforms);
+}
@@ -0,0 +1,151 @@
+#pragma once
+#include <cstdio>
+#include <GL/gl3w.h>
+
+#include "frame_stats.h"
+#include "render_state.h"
+
+// Optional deferred shading, the opaque models write their surface into the G-buffer and one full screen pass then
+// lights every pixel once, so overdrawn fragments no longer pay for the lighting loop
+// Transparent models are still drawn forward on top
+//
+// FULL keeps linear albedo and the world normal in half floats, the reference the packed layouts are compared with
+// OCT16 stores gamma albedo in 8 bits and the octahedral normal, roughness and metallic in 16 bits each
+// OCT8 puts the octahedral normal, roughness and metallic in one 8-bit target, the smallest layout
+// The layouts must match GBUFFER_LAYOUT in pbr.frag, which both writes and reads the G-buffer
+enum GBufferLayout
+{
+    GBUFFER_FULL,
+    GBUFFER_OCT16,
+    GBUFFER_OCT8,
+    GBUFFER_LAYOUTS
+};
+
+const char* gbufferLayoutNames[GBUFFER_LAYOUTS] = { "full", "oct16", "oct8" };
+
+#define GBUFFER_MAX_TARGETS 3
+
+// Units the lighting pass reads the targets and the depth from, must match pbr.frag
+#define GBUFFER_TEXTURE_UNIT 8
+#define GBUFFER_DEPTH_UNIT 11
+
+struct GBufferFormat
+{
+    int targets;
+    GLenum formats[GBUFFER_MAX_TARGETS];
+    int bytes[GBUFFER_MAX_TARGETS]; // Per pixel
+};
+
+const GBufferFormat gbufferFormats[GBUFFER_LAYOUTS] =
+{
+    { 3, { GL_RGBA16F, GL_RGBA16F, GL_R8 }, { 8, 8, 1 } }, // albedo and AO, normal and roughness, metallic
+    { 2, { GL_RGBA8, GL_RGBA16 }, { 4, 8 } },             // albedo and AO, normal, roughness and metallic
+    { 2, { GL_RGBA8, GL_RGBA8 }, { 4, 4 } },              // the same in 8 bits
+};
+
+#define GBUFFER_DEPTH_BYTES 4 // GL_DEPTH_COMPONENT32F
+
+struct GBuffer
+{
+    GBufferLayout layout = GBUFFER_OCT8;
+    int width = 0;
+    int height = 0;
+
+    GLuint targets[GBUFFER_MAX_TARGETS] = {};
+    GLuint depth = 0;
+    GLuint FBO = 0;
+    GLuint vertexArray = 0; // Empty, the lighting pass draws a single triangle from gl_VertexID
+};
+
+GBuffer gbuffer;
+bool deferredShading = false;
+
+int gbufferBytesPerPixel(GBufferLayout layout)
+{
+    int bytes = GBUFFER_DEPTH_BYTES;
+    for (int target = 0; target < gbufferFormats[layout].targets; target++)
+        bytes += gbufferFormats[layout].bytes[target];
+    return bytes;
+}
+
+// Create the colour targets of a layout in place of the current ones, the depth is kept
+void createGBufferTargets(GBufferLayout layout)
+{
+    GBuffer& buffer = gbuffer;
+    const GBufferFormat& format = gbufferFormats[layout];
+
+    // Deleting unbinds the targets, so the cached bindings of their units go back to 0 too
+    glDeleteTextures(GBUFFER_MAX_TARGETS, buffer.targets);
+    for (int target = 0; target < GBUFFER_MAX_TARGETS; target++)
+        forgetTexture(GBUFFER_TEXTURE_UNIT + target);
+
+    GLenum drawBuffers[GBUFFER_MAX_TARGETS];
+    for (int target = 0; target < GBUFFER_MAX_TARGETS; target++)
+    {
+        buffer.targets[target] = 0;
+        if (target >= format.targets)
+        {
+            glNamedFramebufferTexture(buffer.FBO, GL_COLOR_ATTACHMENT0 + target, 0, 0);
+            continue;
+        }
+
+        glCreateTextures(GL_TEXTURE_2D, 1, &buffer.targets[target]);
+        glTextureStorage2D(buffer.targets[target], 1, format.formats[target], buffer.width, buffer.height);
+        glTextureParameteri(buffer.targets[target], GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTextureParameteri(buffer.targets[target], GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glNamedFramebufferTexture(buffer.FBO, GL_COLOR_ATTACHMENT0 + target, buffer.targets[target], 0);
+        drawBuffers[target] = GL_COLOR_ATTACHMENT0 + target;
+    }
+    glNamedFramebufferDrawBuffers(buffer.FBO, format.targets, drawBuffers);
+    buffer.layout = layout;
+
+    if (glCheckNamedFramebufferStatus(buffer.FBO, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        printf("GBuffer: %s framebuffer is not complete!\n", gbufferLayoutNames[layout]);
+}
+
+void createGBuffer(int width, int height)
+{
+    GBuffer& buffer = gbuffer;
+    buffer.width = width;
+    buffer.height = height;
+
+    glCreateFramebuffers(1, &buffer.FBO);
+    glCreateTextures(GL_TEXTURE_2D, 1, &buffer.depth);
+    glTextureStorage2D(buffer.depth, 1, GL_DEPTH_COMPONENT32F, width, height);
+    glTextureParameteri(buffer.depth, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTextureParameteri(buffer.depth, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glNamedFramebufferTexture(buffer.FBO, GL_DEPTH_ATTACHMENT, buffer.depth, 0);
+    glCreateVertexArrays(1, &buffer.vertexArray);
+
+    createGBufferTargets(buffer.layout);
+}
+
+// Bind the targets and the depth for the lighting pass
+void bindGBufferTextures()
+{
+    for (int target = 0; target < GBUFFER_MAX_TARGETS; target++)
+        bindTextureUnit(GBUFFER_TEXTURE_UNIT + target, gbuffer.targets[target]);
+    bindTextureUnit(GBUFFER_DEPTH_UNIT, gbuffer.depth);
+}
+
+/**
+ * Memory and bandwidth of every layout at the G-buffer's size, to choose a layout per machine class
+ * The geometry pass writes every pixel once, overdraw adds to that, and the lighting pass reads every target and
+ * the depth once and writes the 4 byte colour
+ */
+void printGBufferReport()
+{
+    const GBuffer& buffer = gbuffer;
+    double pixels = (double)buffer.width * buffer.height;
+    double colourMegabytes = 4.0 * pixels / (1024.0 * 1024.0);
+    printf("\n%dx%d G-buffer\n", buffer.width, buffer.height);
+    printf("%-8s %8s %8s %14s %14s %12s\n", "layout", "bytes/px", "MB", "write MB/frame", "read MB/frame", "GB/s @60Hz");
+    for (int layout = 0; layout < GBUFFER_LAYOUTS; layout++)
+    {
+        int bytes = gbufferBytesPerPixel((GBufferLayout)layout);
+        double megabytes = bytes * pixels / (1024.0 * 1024.0);
+        double written = megabytes + colourMegabytes;
+        printf("%-8s %8i %8.1f %14.1f %14.1f %12.2f\n", gbufferLayoutNames[layout], bytes, megabytes, written, megabytes,
+            (written + megabytes) * 60.0 / 1024.0);
+    }
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <vector>
+#include <GL/gl3w.h>
+
+#include "frame_stats.h"
+
+// GPU time of tagged sections of the frame from GL_TIME_ELAPSED queries
+// Results are collected a few frames later when they are available, so timing never stalls the pipeline
+#define MAX_GPU_TIMER_LABELS 32
+
+struct GpuTimerStats
+{
+    double totalMs = 0.0;
+    double totalUnits = 0.0; // Work the sections did, e.g. cube faces, averages are per unit
+    double lastMs = 0.0;
+    unsigned int samples = 0;
+};
+
+struct PendingGpuTimer
+{
+    GLuint query;
+    int label;
+    float units;
+};
+
+struct GpuTimers
+{
+    std::vector<GLuint> freeQueries;
+    std::vector<PendingGpuTimer> pending; // Oldest first
+    GpuTimerStats stats[MAX_GPU_TIMER_LABELS];
+    int active = -1;
+};
+
+GpuTimers gpuTimers;
+
+// Start timing a section, time elapsed queries cannot nest so only one section can be open at a time
+// units is how much work the section does, so sections doing different amounts of the same work average out
+void beginGpuTimer(int label, float units = 1.f)
+{
+    if (gpuTimers.active >= 0 || label < 0 || label >= MAX_GPU_TIMER_LABELS)
+        return;
+
+    GLuint query;
+    if (gpuTimers.freeQueries.empty())
+        glCreateQueries(GL_TIME_ELAPSED, 1, &query);
+    else
+    {
+        query = gpuTimers.freeQueries.back();
+        gpuTimers.freeQueries.pop_back();
+    }
+
+    glBeginQuery(GL_TIME_ELAPSED, query);
+    PendingGpuTimer pending = { query, label, units };
+    gpuTimers.pending.push_back(pending);
+    gpuTimers.active = label;
+}
+
+void endGpuTimer()
+{
+    if (gpuTimers.active < 0)
+        return;
+    glEndQuery(GL_TIME_ELAPSED);
+    gpuTimers.active = -1;
+}
+
+// Collect every finished query, call once per frame
+void pollGpuTimers()
+{
+    size_t done = 0;
+    while (done < gpuTimers.pending.size())
+    {
+        GLuint query = gpuTimers.pending[done].query;
+        if (gpuTimers.active >= 0 && done + 1 == gpuTimers.pending.size())
+            break; // Still open
+
+        GLint available = 0;
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            break; // Queries finish in order, later ones are not ready either
+
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds);
+
+        GpuTimerStats& stats = gpuTimers.stats[gpuTimers.pending[done].label];
+        stats.lastMs = nanoseconds / 1.0e6;
+        stats.totalMs += stats.lastMs;
+        stats.totalUnits += gpuTimers.pending[done].units;
+        stats.samples++;
+
+        gpuTimers.freeQueries.push_back(query);
+        done++;
+    }
+    gpuTimers.pending.erase(gpuTimers.pending.begin(), gpuTimers.pending.begin() + done);
+}
+
+// Average GPU time per unit of work of a label, 0 until it has been measured
+double averageGpuMs(int label)
+{
+    const GpuTimerStats& stats = gpuTimers.stats[label];
+    return stats.totalUnits > 0.0 ? stats.totalMs / stats.totalUnits : 0.0;
+}
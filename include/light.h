@@ -2,10 +2,23 @@
 
 #include <vector>
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "bvh.h"
+#include "model.h"
 #include "shadow.h"
 
-#define SH_MAP_WIDTH 4096
-#define SH_MAP_HEIGHT 4096
+// Depth range of the shadow maps, the cube far plane must match farPlane given to pbr.frag
+#define SHADOW_NEAR_PLANE 1.f
+#define SHADOW_FAR_PLANE 70.f
+#define CUBE_SHADOW_FAR_PLANE 25.f
+
+// The first directional light's shadow is split into cascades fitted to the camera, see cascades.h
+#define SHADOW_CASCADES 4
+
+// Shortest time between two re-renders of a dirty shadow map, cube maps draw six faces so they get a longer budget
+#define SHADOW_MIN_INTERVAL 0.025f
+#define CUBE_SHADOW_MIN_INTERVAL 0.05f
 
 // Predefined colours
 #define RED glm::vec3(1, 0, 0)
@@ -26,10 +39,110 @@ struct Light {
     glm::vec3 colour = glm::vec3(1);
     float intensity = 1.f;
     ShadowStruct shadow;
+
+    // View projections the shadow map is rendered with, only the first is used by directional and spot lights
+    // Kept up to date with position and direction by updateShadowVolume(), a cascaded light holds one per cascade
+    // and follows the camera through updateCascades() instead
+    glm::mat4 shadowMatrices[6];
+    bool cascaded = false;
 };
 
 std::vector<Light> lights;
 
+// Recompute the shadow view projections, call whenever the light's position or direction changes
+void updateShadowVolume(Light& light)
+{
+    if (light.type == DIRECTIONAL && !light.cascaded)
+    {
+        glm::mat4 lightProjection = glm::ortho(-15.f, 15.f, -15.f, 15.f, SHADOW_NEAR_PLANE, SHADOW_FAR_PLANE);
+        glm::mat4 lightView = glm::lookAt(light.position, light.position + light.direction, glm::vec3(0.f, 1.f, 0.f));
+        light.shadowMatrices[0] = lightProjection * lightView;
+    }
+    else if (light.type == SPOT)
+    {
+        float lightCutoffRadians = acos(sin(glm::radians(25.f)));
+        float fov = glm::degrees(lightCutoffRadians * 2.0f);
+        glm::mat4 lightProjection = glm::perspective(glm::radians(fov), 1.f, SHADOW_NEAR_PLANE, SHADOW_FAR_PLANE);
+        glm::mat4 lightView = glm::lookAt(light.position, light.position + light.direction, glm::vec3(0.f, 1.f, 0.f));
+        light.shadowMatrices[0] = lightProjection * lightView;
+    }
+    else if (light.type == POSITIONAL)
+    {
+        glm::mat4 shadowProj = glm::perspective(glm::radians(90.f), 1.f, SHADOW_NEAR_PLANE, CUBE_SHADOW_FAR_PLANE);
+        const glm::vec3& p = light.position;
+        light.shadowMatrices[0] = shadowProj * glm::lookAt(p, p + glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f));
+        light.shadowMatrices[1] = shadowProj * glm::lookAt(p, p + glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f));
+        light.shadowMatrices[2] = shadowProj * glm::lookAt(p, p + glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+        light.shadowMatrices[3] = shadowProj * glm::lookAt(p, p + glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f));
+        light.shadowMatrices[4] = shadowProj * glm::lookAt(p, p + glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, -1.0f, 0.0f));
+        light.shadowMatrices[5] = shadowProj * glm::lookAt(p, p + glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, -1.0f, 0.0f));
+    }
+}
+
+// Whether a world AABB overlaps what the light's shadow map covers, the frustum or ortho box for directional and
+// spot lights and the far plane sphere for point lights
+bool shadowVolumeTouches(const Light& light, const AABB& box)
+{
+    if (box.min.x > box.max.x)
+        return false; // Empty, e.g. the previous box of a model that was just added
+
+    if (light.type == POSITIONAL)
+    {
+        glm::vec3 closest = glm::clamp(light.position, box.min, box.max);
+        glm::vec3 offset = closest - light.position;
+        return glm::dot(offset, offset) <= CUBE_SHADOW_FAR_PLANE * CUBE_SHADOW_FAR_PLANE;
+    }
+    if (light.cascaded)
+    {
+        for (int cascade = 0; cascade < SHADOW_CASCADES; cascade++)
+            if (testFrustumAABB(frustumFromMatrix(light.shadowMatrices[cascade]), box) != FRUSTUM_OUTSIDE)
+                return true;
+        return false;
+    }
+    return testFrustumAABB(frustumFromMatrix(light.shadowMatrices[0]), box) != FRUSTUM_OUTSIDE;
+}
+
+// World bounds of what the light's shadow map covers, the corners of the shadow frustum or the far plane sphere's box
+AABB shadowVolumeAABB(const Light& light)
+{
+    AABB box;
+    if (light.type == POSITIONAL)
+    {
+        box.min = light.position - glm::vec3(CUBE_SHADOW_FAR_PLANE);
+        box.max = light.position + glm::vec3(CUBE_SHADOW_FAR_PLANE);
+        return box;
+    }
+
+    for (int matrix = 0; matrix < (light.cascaded ? SHADOW_CASCADES : 1); matrix++)
+    {
+        glm::mat4 inverse = glm::inverse(light.shadowMatrices[matrix]);
+        for (int corner = 0; corner < 8; corner++)
+        {
+            glm::vec4 ndc((corner & 1) ? 1.f : -1.f, (corner & 2) ? 1.f : -1.f, (corner & 4) ? 1.f : -1.f, 1.f);
+            glm::vec4 world = inverse * ndc;
+            box.min = glm::min(box.min, glm::vec3(world) / world.w);
+            box.max = glm::max(box.max, glm::vec3(world) / world.w);
+        }
+    }
+    return box;
+}
+
+/**
+ * Mark dirty the shadow maps of the lights whose volume a moving model's box touches
+ * Call with both the box before and after the move, a static model also invalidates the lights' static caches
+ */
+void invalidateShadowsTouching(const AABB& box, bool dynamicModel)
+{
+    for (Light& light : lights)
+    {
+        if (!shadowVolumeTouches(light, box))
+            continue;
+        light.shadow.updateShadow = true;
+        if (!dynamicModel)
+            light.shadow.staticValid = false;
+    }
+}
+
 void addDirectionalLight(glm::vec3 direction, glm::vec3 colour, float intensity)
 {
     Light directionalLight;
@@ -37,7 +150,14 @@ void addDirectionalLight(glm::vec3 direction, glm::vec3 colour, float intensity)
     directionalLight.direction = direction;
     directionalLight.colour = colour;
     directionalLight.intensity = intensity;
-    directionalLight.shadow = setup_shadowmap(SH_MAP_WIDTH, SH_MAP_HEIGHT);
+
+    // Only one light's cascades fit in the frame uniforms, further directional lights get a single map
+    directionalLight.cascaded = true;
+    for (const Light& light : lights)
+        if (light.cascaded)
+            directionalLight.cascaded = false;
+    directionalLight.shadow.minInterval = directionalLight.shadow.sinceUpdate = SHADOW_MIN_INTERVAL;
+    updateShadowVolume(directionalLight);
 
     lights.push_back(directionalLight);
     printf("Light: added directional light\n");
@@ -50,7 +170,8 @@ void addPositionalLight(glm::vec3 position, glm::vec3 colour, float intensity)
     positionalLight.position = position;
     positionalLight.colour = colour;
     positionalLight.intensity = intensity;
-    positionalLight.shadow = setup_shadow_cubemap(SH_MAP_WIDTH, SH_MAP_HEIGHT);
+    positionalLight.shadow.minInterval = positionalLight.shadow.sinceUpdate = CUBE_SHADOW_MIN_INTERVAL;
+    updateShadowVolume(positionalLight);
 
     lights.push_back(positionalLight);
     printf("Light: added positional light\n");
@@ -64,7 +185,8 @@ void addSpotLight(glm::vec3 direction, glm::vec3 position, glm::vec3 colour, flo
     spotLight.position = position;
     spotLight.colour = colour;
     spotLight.intensity = intensity;
-    spotLight.shadow = setup_shadowmap(SH_MAP_WIDTH, SH_MAP_HEIGHT);
+    spotLight.shadow.minInterval = spotLight.shadow.sinceUpdate = SHADOW_MIN_INTERVAL;
+    updateShadowVolume(spotLight);
 
     lights.push_back(spotLight);
     printf("Light: added spot light\n");
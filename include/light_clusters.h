@@ -0,0 +1,295 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <GL/gl3w.h>
+#include <glm/glm.hpp>
+
+#include "bvh.h"
+#include "frame_stats.h"
+#include "light.h"
+#include "shadow_atlas.h"
+
+// Clustered forward lighting, the view frustum is split into screen tiles and depth slices and each cluster lists the
+// lights that reach it, so a fragment only shades the lights around it however many lights the scene has
+// The grid must match the constants in pbr.frag
+#define CLUSTER_TILES_X 16
+#define CLUSTER_TILES_Y 9
+#define CLUSTER_SLICES 24
+#define CLUSTER_COUNT (CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES)
+
+// The first slice runs from the near plane to here, the others split the rest of the view exponentially
+#define CLUSTER_NEAR_DEPTH 0.5f
+
+// Radiance below which a point or spot light is cut off, pbr.frag fades lights out smoothly towards this range
+#define LIGHT_CUTOFF 0.05f
+
+// Shader storage bindings of the light data, the clusters' ranges in the index list and the index list
+#define LIGHT_DATA_BINDING 1
+#define CLUSTER_RANGES_BINDING 2
+#define CLUSTER_LIGHTS_BINDING 3
+
+// std430 layout of the Light struct in pbr.frag
+struct LightData
+{
+    glm::vec3 position;
+    int32_t type;
+    glm::vec3 direction;
+    float intensity;
+    glm::vec3 colour;
+    int32_t isOn;
+    glm::vec4 shadowTile; // Atlas rect of the light's shadow map, see shadowTileRect()
+    glm::mat4 lightSpaceMatrix;
+    float range;          // Distance the light is cut off at, 0 for directional lights which reach everywhere
+    float padding[3];
+};
+
+static_assert(sizeof(LightData) == 144, "LightData must match the std430 Light struct");
+
+struct LightClusters
+{
+    GLuint lightBuffer = 0;
+    GLuint rangeBuffer = 0; // Offset and count of each cluster's lights in the index list
+    GLuint indexBuffer = 0;
+    size_t lightCapacity = 0;
+    size_t indexCapacity = 0;
+
+    // View space bounds of every cluster, rebuilt when the projection changes
+    std::vector<AABB> bounds;
+    glm::mat4 boundsProjection = glm::mat4(0.f);
+
+    // Filled every frame, reused so assignment does not allocate once warmed up
+    std::vector<LightData> lightData;
+    std::vector<glm::uvec2> ranges;
+    std::vector<uint32_t> indices;
+    std::vector<glm::uvec2> pairs; // Cluster and light of every overlap, before they are sorted by cluster
+
+    // Turns a fragment's window position and view depth into its cluster, see clusterScale in pbr.frag
+    glm::vec4 scale = glm::vec4(0.f);
+};
+
+LightClusters lightClusters;
+
+/**
+ * Distance at which a point or spot light's radiance drops to LIGHT_CUTOFF under the attenuation of pbr.frag
+ *
+ *@return 0 for directional lights, which are in every cluster
+ */
+float lightRange(const Light& light)
+{
+    if (light.type == DIRECTIONAL)
+        return 0.f;
+
+    // intensity * colour / (1 + 0.09 d + 0.032 d^2) = LIGHT_CUTOFF
+    float brightness = light.intensity * std::max(light.colour.r, std::max(light.colour.g, light.colour.b));
+    float c = 1.f - brightness / LIGHT_CUTOFF;
+    if (c >= 0.f)
+        return 0.01f; // Never brighter than the cut off
+    return (-0.09f + std::sqrt(0.09f * 0.09f - 4.f * 0.032f * c)) / (2.f * 0.032f);
+}
+
+// View depth of the near end of a depth slice
+float clusterSliceDepth(int slice, float nearPlane, float farPlane)
+{
+    if (slice == 0)
+        return nearPlane;
+    return CLUSTER_NEAR_DEPTH * std::pow(farPlane / CLUSTER_NEAR_DEPTH, (slice - 1) / (float)(CLUSTER_SLICES - 1));
+}
+
+int clusterIndex(int x, int y, int slice)
+{
+    return (slice * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x;
+}
+
+void createLightClusters()
+{
+    LightClusters& clusters = lightClusters;
+    glCreateBuffers(1, &clusters.rangeBuffer);
+    glNamedBufferStorage(clusters.rangeBuffer, CLUSTER_COUNT * sizeof(glm::uvec2), NULL, GL_DYNAMIC_STORAGE_BIT);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_RANGES_BINDING, clusters.rangeBuffer);
+    clusters.bounds.resize(CLUSTER_COUNT);
+    clusters.ranges.resize(CLUSTER_COUNT);
+    printf("Lights: %ix%ix%i light clusters\n", CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES);
+}
+
+// Grow a light storage buffer and bind the new one, the contents are uploaded every frame so nothing is copied over
+void reserveClusterBuffer(GLuint& buffer, size_t& capacity, size_t count, size_t stride, GLuint binding)
+{
+    if (count <= capacity)
+        return;
+
+    capacity = count > capacity * 2 ? count : capacity * 2;
+    if (buffer != 0)
+        glDeleteBuffers(1, &buffer);
+    glCreateBuffers(1, &buffer);
+    glNamedBufferData(buffer, capacity * stride, NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffer);
+}
+
+// View space box of every cluster, between the corners of its screen tile at the near and far depth of its slice
+void updateClusterBounds(const glm::mat4& projection, float nearPlane, float farPlane)
+{
+    LightClusters& clusters = lightClusters;
+    if (projection == clusters.boundsProjection)
+        return;
+    clusters.boundsProjection = projection;
+
+    for (int slice = 0; slice < CLUSTER_SLICES; slice++)
+    {
+        float depths[2] = { clusterSliceDepth(slice, nearPlane, farPlane), clusterSliceDepth(slice + 1, nearPlane, farPlane) };
+        for (int y = 0; y < CLUSTER_TILES_Y; y++)
+        {
+            for (int x = 0; x < CLUSTER_TILES_X; x++)
+            {
+                AABB box;
+                for (int corner = 0; corner < 8; corner++)
+                {
+                    float ndcX = (x + (corner & 1)) * 2.f / CLUSTER_TILES_X - 1.f;
+                    float ndcY = (y + ((corner >> 1) & 1)) * 2.f / CLUSTER_TILES_Y - 1.f;
+                    float depth = depths[corner >> 2];
+                    glm::vec3 point(ndcX * depth / projection[0][0], ndcY * depth / projection[1][1], -depth);
+                    box.min = glm::min(box.min, point);
+                    box.max = glm::max(box.max, point);
+                }
+                clusters.bounds[clusterIndex(x, y, slice)] = box;
+            }
+        }
+    }
+}
+
+// Screen tiles a view space sphere can cover, from the extremes of x / depth and y / depth over its bounding box
+void sphereTileRange(const glm::vec3& center, float radius, const glm::mat4& projection, float nearDepth, glm::ivec2& low, glm::ivec2& high)
+{
+    float depth = -center.z;
+    float nearest = std::max(depth - radius, nearDepth), farthest = depth + radius;
+    glm::vec2 scale(projection[0][0], projection[1][1]);
+    glm::vec2 boxLow = glm::vec2(center) - radius, boxHigh = glm::vec2(center) + radius;
+
+    glm::vec2 ndcLow, ndcHigh;
+    for (int axis = 0; axis < 2; axis++)
+    {
+        ndcLow[axis] = scale[axis] * boxLow[axis] / (boxLow[axis] < 0.f ? nearest : farthest);
+        ndcHigh[axis] = scale[axis] * boxHigh[axis] / (boxHigh[axis] > 0.f ? nearest : farthest);
+    }
+
+    glm::vec2 tiles(CLUSTER_TILES_X, CLUSTER_TILES_Y);
+    low = glm::clamp(glm::ivec2(glm::floor((ndcLow * 0.5f + 0.5f) * tiles)), glm::ivec2(0), glm::ivec2(tiles) - 1);
+    high = glm::clamp(glm::ivec2(glm::floor((ndcHigh * 0.5f + 0.5f) * tiles)), glm::ivec2(0), glm::ivec2(tiles) - 1);
+}
+
+// Depth slice a view depth falls in, clamped to the grid
+int clusterSlice(float depth, float farPlane)
+{
+    if (depth < CLUSTER_NEAR_DEPTH)
+        return 0;
+    int slice = 1 + (int)(std::log(depth / CLUSTER_NEAR_DEPTH) * (CLUSTER_SLICES - 1) / std::log(farPlane / CLUSTER_NEAR_DEPTH));
+    return std::min(slice, CLUSTER_SLICES - 1);
+}
+
+/**
+ * Assign every light that is on to the clusters its range reaches and upload the lights and the cluster lists
+ * Directional lights go in every cluster. The lists are sorted by a counting pass, so building them is linear in
+ * the number of overlaps
+ */
+void updateLightClusters(const glm::mat4& view, const glm::mat4& projection, float nearPlane, float farPlane, int width, int height,
+    const std::vector<glm::mat4>& lightSpaceMatrices)
+{
+    LightClusters& clusters = lightClusters;
+    updateClusterBounds(projection, nearPlane, farPlane);
+    clusters.scale = glm::vec4((float)CLUSTER_TILES_X / width, (float)CLUSTER_TILES_Y / height,
+        (CLUSTER_SLICES - 1) / std::log(farPlane / CLUSTER_NEAR_DEPTH), CLUSTER_NEAR_DEPTH);
+
+    clusters.lightData.resize(lights.size());
+    clusters.pairs.clear();
+    std::fill(clusters.ranges.begin(), clusters.ranges.end(), glm::uvec2(0));
+
+    for (int i = 0; i < (int)lights.size(); i++)
+    {
+        const Light& light = lights[i];
+        LightData& data = clusters.lightData[i];
+        data.position = light.position;
+        data.type = light.type;
+        data.direction = light.direction;
+        data.intensity = light.intensity;
+        data.colour = light.colour;
+        data.isOn = light.isOn ? 1 : 0;
+        data.shadowTile = shadowTileRect(light.shadow);
+        data.lightSpaceMatrix = i < (int)lightSpaceMatrices.size() ? lightSpaceMatrices[i] : glm::mat4(1.f);
+        data.range = lightRange(light);
+
+        if (!light.isOn)
+            continue;
+
+        if (light.type == DIRECTIONAL)
+        {
+            for (int cluster = 0; cluster < CLUSTER_COUNT; cluster++)
+                clusters.pairs.push_back(glm::uvec2(cluster, i));
+            continue;
+        }
+
+        glm::vec3 center = glm::vec3(view * glm::vec4(light.position, 1.f));
+        float depth = -center.z;
+        if (depth + data.range < nearPlane || depth - data.range > farPlane)
+            continue;
+
+        glm::ivec2 low, high;
+        sphereTileRange(center, data.range, projection, nearPlane, low, high);
+        int firstSlice = clusterSlice(depth - data.range, farPlane), lastSlice = clusterSlice(depth + data.range, farPlane);
+        for (int slice = firstSlice; slice <= lastSlice; slice++)
+        {
+            for (int y = low.y; y <= high.y; y++)
+            {
+                for (int x = low.x; x <= high.x; x++)
+                {
+                    int cluster = clusterIndex(x, y, slice);
+                    const AABB& box = clusters.bounds[cluster];
+                    glm::vec3 offset = glm::clamp(center, box.min, box.max) - center;
+                    if (glm::dot(offset, offset) <= data.range * data.range)
+                        clusters.pairs.push_back(glm::uvec2(cluster, i));
+                }
+            }
+        }
+    }
+
+    // Count the lights of each cluster, turn the counts into offsets, then place every light after its cluster's offset
+    for (const glm::uvec2& pair : clusters.pairs)
+        clusters.ranges[pair.x].y++;
+    uint32_t offset = 0;
+    for (glm::uvec2& range : clusters.ranges)
+    {
+        range.x = offset;
+        offset += range.y;
+        range.y = 0;
+    }
+    clusters.indices.resize(clusters.pairs.size());
+    for (const glm::uvec2& pair : clusters.pairs)
+    {
+        glm::uvec2& range = clusters.ranges[pair.x];
+        clusters.indices[range.x + range.y++] = pair.y;
+    }
+
+    reserveClusterBuffer(clusters.lightBuffer, clusters.lightCapacity, std::max<size_t>(lights.size(), 1), sizeof(LightData), LIGHT_DATA_BINDING);
+    reserveClusterBuffer(clusters.indexBuffer, clusters.indexCapacity, std::max<size_t>(clusters.indices.size(), 1), sizeof(uint32_t), CLUSTER_LIGHTS_BINDING);
+    if (!clusters.lightData.empty())
+        glNamedBufferSubData(clusters.lightBuffer, 0, clusters.lightData.size() * sizeof(LightData), clusters.lightData.data());
+    if (!clusters.indices.empty())
+        glNamedBufferSubData(clusters.indexBuffer, 0, clusters.indices.size() * sizeof(uint32_t), clusters.indices.data());
+    glNamedBufferSubData(clusters.rangeBuffer, 0, CLUSTER_COUNT * sizeof(glm::uvec2), clusters.ranges.data());
+}
+
+// Print how the lights were spread over the clusters in the last frame
+void printLightClusterStats()
+{
+    const LightClusters& clusters = lightClusters;
+    int occupied = 0;
+    uint32_t most = 0;
+    for (const glm::uvec2& range : clusters.ranges)
+    {
+        occupied += range.y > 0 ? 1 : 0;
+        most = std::max(most, range.y);
+    }
+    printf("Lights: %i lights in %i of %i clusters, %i entries, at most %u lights per cluster\n", (int)lights.size(), occupied,
+        CLUSTER_COUNT, (int)clusters.indices.size(), most);
+}
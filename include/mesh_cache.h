@@ -0,0 +1,245 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// glm undefines the windows.h min/max macros, so it has to come after it
+#include <glm/glm.hpp>
+
+#include "object_parser.h"
+
+// Binary cache written next to each .obj, holding the final interleaved vertices, indices and local AABB
+#define MESH_CACHE_EXTENSION ".meshcache"
+#define MESH_CACHE_MAGIC 0x4843534Du // "MSCH"
+#define MESH_CACHE_VERSION 1u
+
+struct MeshCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    // Source .obj stamp, the cache is stale if either of these change
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+
+    uint32_t floatsPerVertex;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t reserved;
+
+    float aabbMin[3];
+    float aabbMax[3];
+};
+
+// Read-only memory mapping of a whole file
+struct MappedFile
+{
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#else
+    int fd = -1;
+#endif
+};
+
+bool fileStamp(const std::string& path, uint64_t& size, int64_t& mtime)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(path.c_str(), &st) != 0)
+        return false;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+#endif
+    size = (uint64_t)st.st_size;
+    mtime = (int64_t)st.st_mtime;
+    return true;
+}
+
+bool mapFile(const std::string& path, MappedFile& mapped)
+{
+#ifdef _WIN32
+    mapped.file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mapped.file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(mapped.file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(mapped.file);
+        mapped.file = INVALID_HANDLE_VALUE;
+        return false;
+    }
+    mapped.size = (size_t)size.QuadPart;
+
+    mapped.mapping = CreateFileMappingA(mapped.file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapped.mapping != NULL)
+        mapped.data = (const unsigned char*)MapViewOfFile(mapped.mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+    mapped.fd = open(path.c_str(), O_RDONLY);
+    if (mapped.fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(mapped.fd, &st) != 0 || st.st_size == 0)
+    {
+        close(mapped.fd);
+        mapped.fd = -1;
+        return false;
+    }
+    mapped.size = (size_t)st.st_size;
+
+    void* view = mmap(NULL, mapped.size, PROT_READ, MAP_PRIVATE, mapped.fd, 0);
+    if (view != MAP_FAILED)
+        mapped.data = (const unsigned char*)view;
+#endif
+    return mapped.data != nullptr;
+}
+
+void unmapFile(MappedFile& mapped)
+{
+#ifdef _WIN32
+    if (mapped.data)
+        UnmapViewOfFile(mapped.data);
+    if (mapped.mapping != NULL)
+        CloseHandle(mapped.mapping);
+    if (mapped.file != INVALID_HANDLE_VALUE)
+        CloseHandle(mapped.file);
+    mapped.mapping = NULL;
+    mapped.file = INVALID_HANDLE_VALUE;
+#else
+    if (mapped.data)
+        munmap((void*)mapped.data, mapped.size);
+    if (mapped.fd >= 0)
+        close(mapped.fd);
+    mapped.fd = -1;
+#endif
+    mapped.data = nullptr;
+    mapped.size = 0;
+}
+
+// Local bounds of an interleaved vertex array
+void meshBounds(const std::vector<float>& vertices, glm::vec3& min, glm::vec3& max)
+{
+    min = glm::vec3(std::numeric_limits<float>::max());
+    max = glm::vec3(std::numeric_limits<float>::lowest());
+    for (size_t i = 0; i + 2 < vertices.size(); i += FLOATS_PER_VERTEX)
+    {
+        glm::vec3 pos(vertices[i], vertices[i + 1], vertices[i + 2]);
+        min = glm::min(min, pos);
+        max = glm::max(max, pos);
+    }
+}
+
+/**
+ * Load a mesh from the binary cache next to objPath
+ *
+ *@return false if there is no cache or it is stale, in which case the .obj has to be parsed
+ */
+bool readMeshCache(const std::string& objPath, std::vector<float>& vertices, std::vector<unsigned int>& indices, glm::vec3& aabbMin, glm::vec3& aabbMax)
+{
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    if (!fileStamp(objPath, sourceSize, sourceMtime))
+        return false;
+
+    std::string cachePath = objPath + MESH_CACHE_EXTENSION;
+    MappedFile mapped;
+    if (!mapFile(cachePath, mapped))
+        return false;
+
+    bool valid = mapped.size >= sizeof(MeshCacheHeader);
+    MeshCacheHeader header;
+    if (valid)
+    {
+        memcpy(&header, mapped.data, sizeof(header));
+        size_t payload = (size_t)header.vertexCount * header.floatsPerVertex * sizeof(float) + (size_t)header.indexCount * sizeof(unsigned int);
+
+        valid = header.magic == MESH_CACHE_MAGIC &&
+            header.version == MESH_CACHE_VERSION &&
+            header.floatsPerVertex == FLOATS_PER_VERTEX &&
+            header.sourceSize == sourceSize &&
+            header.sourceMtime == sourceMtime &&
+            mapped.size == sizeof(MeshCacheHeader) + payload;
+    }
+
+    if (!valid)
+    {
+        printf("Mesh cache: %s is stale, reparsing\n", cachePath.c_str());
+        unmapFile(mapped);
+        return false;
+    }
+
+    const unsigned char* data = mapped.data + sizeof(MeshCacheHeader);
+    size_t vertexBytes = (size_t)header.vertexCount * FLOATS_PER_VERTEX * sizeof(float);
+
+    vertices.resize((size_t)header.vertexCount * FLOATS_PER_VERTEX);
+    memcpy(vertices.data(), data, vertexBytes);
+    indices.resize(header.indexCount);
+    memcpy(indices.data(), data + vertexBytes, (size_t)header.indexCount * sizeof(unsigned int));
+
+    aabbMin = glm::vec3(header.aabbMin[0], header.aabbMin[1], header.aabbMin[2]);
+    aabbMax = glm::vec3(header.aabbMax[0], header.aabbMax[1], header.aabbMax[2]);
+
+    unmapFile(mapped);
+
+    printf("Mesh cache: Loaded %s (%d vertices, %d indices)\n", cachePath.c_str(), (int)header.vertexCount, (int)header.indexCount);
+    return true;
+}
+
+/**
+ * Write the mesh to the binary cache next to objPath, stamped with the .obj's size and modification time
+ */
+bool writeMeshCache(const std::string& objPath, const std::vector<float>& vertices, const std::vector<unsigned int>& indices, glm::vec3 aabbMin, glm::vec3 aabbMax)
+{
+    MeshCacheHeader header = {};
+    if (!fileStamp(objPath, header.sourceSize, header.sourceMtime))
+        return false;
+
+    header.version = MESH_CACHE_VERSION;
+    header.floatsPerVertex = FLOATS_PER_VERTEX;
+    header.vertexCount = (uint32_t)(vertices.size() / FLOATS_PER_VERTEX);
+    header.indexCount = (uint32_t)indices.size();
+    memcpy(header.aabbMin, &aabbMin[0], sizeof(header.aabbMin));
+    memcpy(header.aabbMax, &aabbMax[0], sizeof(header.aabbMax));
+
+    std::string cachePath = objPath + MESH_CACHE_EXTENSION;
+    std::ofstream out(cachePath, std::ios::binary | std::ios::trunc);
+    if (!out)
+    {
+        printf("Mesh cache: could not write %s\n", cachePath.c_str());
+        return false;
+    }
+
+    // Write the header with a zero magic first so an interrupted write never looks valid
+    header.magic = 0;
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)vertices.data(), vertices.size() * sizeof(float));
+    out.write((const char*)indices.data(), indices.size() * sizeof(unsigned int));
+
+    header.magic = MESH_CACHE_MAGIC;
+    out.seekp(0);
+    out.write((const char*)&header, sizeof(header));
+
+    if (!out)
+        return false;
+
+    printf("Mesh cache: Wrote %s\n", cachePath.c_str());
+    return true;
+}
@@ -2,8 +2,15 @@
 #include <vector>
 #include <GL/glcorearb.h>
 #include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 
+#include "asset_loader.h"
+#include "frame_stats.h"
+#include "mesh_cache.h"
 #include "object_parser.h"
 #include "texture.h"
 
@@ -31,94 +38,343 @@ struct PBRTextures {
     bool hasOpacity = false;
 };
 
-struct model
+// Geometry asset, shared by every model placed with it
+struct Mesh
 {
-    // Geometry
-    std::vector<triangle> triangles;
+    std::string name;
+
+    // Unique interleaved vertices and three indices per triangle
     std::vector<float> vertices;
+    std::vector<unsigned int> indices;
+
+    // Local axis aligned bounding box - AABB
+    AABB aabb;
+
+    GLuint VAO = 0;
+    GLuint VBO = 0;
+    GLuint EBO = 0;
+
+    // Depth-only stream for the shadow passes, packed positions sharing the EBO
+    GLuint positionVBO = 0;
+    GLuint depthVAO = 0;
+
+    // The same positions with the face instances of the layered point light shadow draws instead of the instance matrices
+    GLuint cubeFaceVAO = 0;
+
+    int refCount = 0;
+};
+
+// Albedo, normal, roughness, metallic, AO and opacity, the order acquireMaterial() takes them in
+#define MATERIAL_TEXTURE_FILES 6
 
+// Surface asset, shared by every model that uses the same set of texture files and the same settings
+struct Material
+{
+    std::string name;
+    std::string paths[MATERIAL_TEXTURE_FILES]; // Kept so a copy with other settings can be made, empty if unused
+    PBRTextures textures;
+    int refCount = 0;
+};
+
+std::vector<Mesh> meshes;
+std::vector<Material> materials;
+std::unordered_map<std::string, int> meshIds;
+std::unordered_map<std::string, int> materialIds;
+
+// A placed object, only a transform plus handles to its shared mesh and material
+struct model
+{
     // Transformations
     glm::vec3 position = glm::vec3(0.0f);
     glm::vec3 rotation = glm::vec3(0.0f);
     glm::vec3 scale = glm::vec3(1.0f);
 
-    int bufferIndex;
+    int mesh = -1;
+    int material = -1;
 
-    // Textures
-    PBRTextures textures;
+    // Cached from the transformations by updateModelTransforms(), valid while dirty is false
+    glm::mat4 world = glm::mat4(1.f);
+    glm::mat3 normal = glm::mat3(1.f);
+    AABB worldAABB;
+    bool dirty = true;
 
-    // axis aligned bounding box - AABB
-    AABB aabb;
+    // Targeted by an animation or interaction, so it is left out of the cached static shadow maps
+    bool dynamic = false;
 };
 std::vector<model> models;
 
+// Set whenever a model is added or its material changes, the draw list is rebuilt before the next draw
+bool drawListDirty = true;
+
+// Models added or moved since the last scene update, each listed once
+std::vector<int> dirtyModels;
+
+// Geometry produced by a loader worker before it is moved into its mesh
+struct LoadedMesh
+{
+    std::vector<float> vertices;
+    std::vector<unsigned int> indices;
+    AABB aabb;
+};
+
+// Read a mesh from the binary cache if it is still valid, otherwise parse the .obj and refresh the cache
+void loadMeshData(const std::string& objPath, LoadedMesh& mesh)
+{
+    if (readMeshCache(objPath, mesh.vertices, mesh.indices, mesh.aabb.min, mesh.aabb.max))
+        return;
+
+    obj_parse(objPath.c_str(), &mesh.vertices, &mesh.indices);
+    meshBounds(mesh.vertices, mesh.aabb.min, mesh.aabb.max);
+    writeMeshCache(objPath, mesh.vertices, mesh.indices, mesh.aabb.min, mesh.aabb.max);
+}
+
 /**
- * Load a model from a .obj file 
+ * Get the shared mesh for a .obj file, queueing it on the asset loader the first time it is asked for
  *
- *@return id of the newly added model
+ *@return mesh id, valid immediately, geometry is filled in by finishLoadingAssets()
  */
-int load(const std::string& objPath,
-    const std::string& albedoPath,
-    const std::string& normalPath = "",
-    const std::string& roughnessPath = "",
-    const std::string& metallicPath = "",
-    const std::string& aoPath = "",
-    const std::string& opacityPath = "")
-	{
+int acquireObjMesh(const std::string& objPath)
+{
+    std::string key = canonical_path(objPath);
+    auto found = meshIds.find(key);
+    if (found != meshIds.end())
+    {
+        meshes.at(found->second).refCount++;
+        return found->second;
+    }
 
-    model model;
-    // Load model geometry
-    obj_parse(objPath.c_str(), &model.triangles);
-    model.vertices = triangleToVertices(model.triangles);
-    model.bufferIndex = models.size();
+    int id = (int)meshes.size();
+    Mesh mesh;
+    mesh.name = objPath;
+    mesh.refCount = 1;
+    meshes.push_back(mesh);
+    meshIds[key] = id;
+
+    // Load the geometry on a worker, then move it into the mesh on the context thread
+    std::shared_ptr<LoadedMesh> loaded = std::make_shared<LoadedMesh>();
+    queueAsset("mesh", objPath,
+        [loaded, objPath]() { loadMeshData(objPath, *loaded); },
+        [loaded, id]()
+        {
+            meshes.at(id).vertices = std::move(loaded->vertices);
+            meshes.at(id).indices = std::move(loaded->indices);
+            meshes.at(id).aabb = loaded->aabb;
+        });
 
-    // Load model textures
-    // Albedo texture is required
-    model.textures.albedo = setup_texture(albedoPath.c_str());
-    model.textures.hasAlbedo = true;
+    return id;
+}
 
-    if (!normalPath.empty())
+/**
+ * Get the shared mesh for a flat triangle list (e.g. cube_vertices or a generated torus),
+ * identical lists are welded once and then shared
+ */
+int acquireGeneratedMesh(const std::vector<float>& vertices, const std::string& name)
+{
+    // Key generated geometry on its contents
+    size_t hash = 2166136261u;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(vertices.data());
+    for (size_t i = 0; i < vertices.size() * sizeof(float); i++)
     {
-        model.textures.normal = setup_texture(normalPath.c_str());
-        model.textures.hasNormal = true;
+        hash ^= bytes[i];
+        hash *= 16777619u;
     }
-    if (!roughnessPath.empty())
+    std::string key = "generated:" + std::to_string(hash) + ":" + std::to_string(vertices.size());
+
+    auto found = meshIds.find(key);
+    if (found != meshIds.end())
     {
-        model.textures.roughness = setup_texture(roughnessPath.c_str());
-        model.textures.hasRoughness = true;
+        meshes.at(found->second).refCount++;
+        return found->second;
     }
-    if (!metallicPath.empty())
+
+    Mesh mesh;
+    mesh.name = name;
+    mesh.refCount = 1;
+    indexVertices(vertices, mesh.vertices, mesh.indices, name.c_str());
+
+    int id = (int)meshes.size();
+    meshes.push_back(mesh);
+    meshIds[key] = id;
+    return id;
+}
+
+void releaseMesh(int id)
+{
+    Mesh& mesh = meshes.at(id);
+    if (--mesh.refCount > 0)
+        return;
+
+    glDeleteVertexArrays(1, &mesh.VAO);
+    glDeleteVertexArrays(1, &mesh.depthVAO);
+    glDeleteVertexArrays(1, &mesh.cubeFaceVAO);
+    glDeleteBuffers(1, &mesh.VBO);
+    glDeleteBuffers(1, &mesh.EBO);
+    glDeleteBuffers(1, &mesh.positionVBO);
+    mesh.VAO = mesh.VBO = mesh.EBO = 0;
+    mesh.depthVAO = mesh.cubeFaceVAO = mesh.positionVBO = 0;
+    mesh.vertices.clear();
+    mesh.indices.clear();
+
+    // Ids stay stable, the slot is only forgotten so a later load creates a fresh mesh
+    for (auto it = meshIds.begin(); it != meshIds.end(); ++it)
     {
-        model.textures.metallic = setup_texture(metallicPath.c_str());
-        model.textures.hasMetallic = true;
+        if (it->second == id)
+        {
+            meshIds.erase(it);
+            break;
+        }
     }
-    if (!aoPath.empty())
+}
+
+// Key of a material, its texture files and the settings a model can change, models only share a material if all match
+std::string materialKey(const std::string (&paths)[MATERIAL_TEXTURE_FILES], float textureScale, bool hasOpacity)
+{
+    std::string key;
+    for (const std::string& path : paths)
+        key += canonical_path(path) + "|";
+    return key + std::to_string(textureScale) + "|" + (hasOpacity ? "1" : "0");
+}
+
+/**
+ * Get the shared material for a set of texture files and settings, textures are only acquired the first time
+ * Albedo texture is required
+ *
+ *@param hasOpacity draw the models using it with the transparent ones, even without an opacity map
+ */
+int acquireMaterialVariant(const std::string (&paths)[MATERIAL_TEXTURE_FILES], float textureScale, bool hasOpacity)
+{
+    std::string key = materialKey(paths, textureScale, hasOpacity);
+
+    auto found = materialIds.find(key);
+    if (found != materialIds.end())
     {
-        model.textures.ao = setup_texture(aoPath.c_str());
-        model.textures.hasAO = true;
+        materials.at(found->second).refCount++;
+        return found->second;
     }
-    if (!opacityPath.empty())
+
+    Material material;
+    material.name = paths[0];
+    material.refCount = 1;
+    PBRTextures& textures = material.textures;
+    textures.textureScale = textureScale;
+    textures.hasOpacity = hasOpacity;
+
+    GLuint* handles[MATERIAL_TEXTURE_FILES] = { &textures.albedo, &textures.normal, &textures.roughness, &textures.metallic,
+        &textures.ao, &textures.opacity };
+    bool* present[MATERIAL_TEXTURE_FILES] = { &textures.hasAlbedo, &textures.hasNormal, &textures.hasRoughness, &textures.hasMetallic,
+        &textures.hasAO, nullptr };
+    for (int file = 0; file < MATERIAL_TEXTURE_FILES; file++)
     {
-        model.textures.opacity = setup_texture(opacityPath.c_str());
-        model.textures.hasOpacity = true;
+        material.paths[file] = paths[file];
+        if (paths[file].empty())
+            continue;
+
+        *handles[file] = acquire_texture(paths[file]);
+        if (present[file])
+            *present[file] = true;
     }
 
-    // Initialise default parameters
-    model.position = glm::vec3(0);
-    model.rotation = glm::vec3(0);
-    model.scale = glm::vec3(1);
+    int id = (int)materials.size();
+    materials.push_back(material);
+    materialIds[key] = id;
+    return id;
+}
+
+// Material for a set of texture files with the default settings, transparent if it has an opacity map
+int acquireMaterial(const std::string& albedoPath,
+    const std::string& normalPath = "",
+    const std::string& roughnessPath = "",
+    const std::string& metallicPath = "",
+    const std::string& aoPath = "",
+    const std::string& opacityPath = "")
+{
+    const std::string paths[MATERIAL_TEXTURE_FILES] = { albedoPath, normalPath, roughnessPath, metallicPath, aoPath, opacityPath };
+    return acquireMaterialVariant(paths, 1.f, !opacityPath.empty());
+}
+
+void releaseMaterial(int id)
+{
+    Material& material = materials.at(id);
+    if (--material.refCount > 0)
+        return;
+
+    PBRTextures& textures = material.textures;
+    for (GLuint texture : { textures.albedo, textures.normal, textures.metallic, textures.roughness, textures.ao, textures.opacity })
+    {
+        if (texture != 0)
+            release_texture(texture);
+    }
+    textures = PBRTextures();
+
+    for (auto it = materialIds.begin(); it != materialIds.end(); ++it)
+    {
+        if (it->second == id)
+        {
+            materialIds.erase(it);
+            break;
+        }
+    }
+}
+
+// Move a model to the material with the same textures and new settings, the old one is released afterwards so
+// the textures both share stay loaded
+void changeMaterialSettings(int id, float textureScale, bool hasOpacity)
+{
+    int previous = models.at(id).material;
+    models.at(id).material = acquireMaterialVariant(materials.at(previous).paths, textureScale, hasOpacity);
+    releaseMaterial(previous);
+    drawListDirty = true;
+}
+
+// Repeat the textures of a model this many times across its UVs, other models with the same textures are unchanged
+void setTextureScale(int id, float textureScale)
+{
+    changeMaterialSettings(id, textureScale, materials.at(models.at(id).material).textures.hasOpacity);
+}
+
+// Draw a model with the transparent ones or not, the only way its opacity changes, as it moves the model between draw groups
+void setOpacity(int id, bool hasOpacity)
+{
+    changeMaterialSettings(id, materials.at(models.at(id).material).textures.textureScale, hasOpacity);
+}
+
+// Shorthands for the assets a model refers to
+Mesh& meshOf(int id) { return meshes.at(models.at(id).mesh); }
+const PBRTextures& texturesOf(int id) { return materials.at(models.at(id).material).textures; }
+
+/**
+ * Load a model from a .obj file 
+ * Parsing and texture decoding are queued on the asset loader, the model's geometry
+ * and textures are filled in by finishLoadingAssets()
+ *
+ *@return id of the newly added model, valid immediately
+ */
+int load(const std::string& objPath,
+    const std::string& albedoPath,
+    const std::string& normalPath = "",
+    const std::string& roughnessPath = "",
+    const std::string& metallicPath = "",
+    const std::string& aoPath = "",
+    const std::string& opacityPath = "")
+	{
+
+    model model;
+    model.mesh = acquireObjMesh(objPath);
+    model.material = acquireMaterial(albedoPath, normalPath, roughnessPath, metallicPath, aoPath, opacityPath);
 
     // Add model to the models vector
     models.push_back(model);
-    return model.bufferIndex;
+    drawListDirty = true;
+    dirtyModels.push_back((int)models.size() - 1);
+    return (int)models.size() - 1;
 }
 
 /**
  * Add a model using a vector of vertices
 
- * @return The buffer index of the model
+ * @return id of the newly added model
  */
-int addModel(std::vector<float> vertices, 
+int addModel(const std::vector<float>& vertices, 
              const std::string& albedoPath,
              const std::string& normalPath = "",
              const std::string& roughnessPath = "",
@@ -126,45 +382,14 @@ int addModel(std::vector<float> vertices,
              const std::string& aoPath = "")
 {
     model model;
-    // Load model geometry
-    model.vertices = vertices;
-    model.bufferIndex = models.size();
-
-    // Load model textures
-    // Albedo texture is required
-    model.textures.albedo = setup_texture(albedoPath.c_str());
-    model.textures.hasAlbedo = true;
-
-    if (!normalPath.empty())
-    {
-        model.textures.normal = setup_texture(normalPath.c_str());
-        model.textures.hasNormal = true;
-    }
-    if (!roughnessPath.empty())
-    {
-        model.textures.roughness = setup_texture(roughnessPath.c_str());
-        model.textures.hasRoughness = true;
-    }
-    if (!metallicPath.empty())
-    {
-        model.textures.metallic = setup_texture(metallicPath.c_str());
-        model.textures.hasMetallic = true;
-    }
-    if (!aoPath.empty())
-    {
-        model.textures.ao = setup_texture(aoPath.c_str());
-        model.textures.hasAO = true;
-    }
-
-    // Initialise default parameters
-    model.position = glm::vec3(0);
-    model.rotation = glm::vec3(0);
-    model.scale = glm::vec3(1);
+    model.mesh = acquireGeneratedMesh(vertices, albedoPath);
+    model.material = acquireMaterial(albedoPath, normalPath, roughnessPath, metallicPath, aoPath);
 
     // Add model to the models vector
     models.push_back(model);
-
-    return models.back().bufferIndex;
+    drawListDirty = true;
+    dirtyModels.push_back((int)models.size() - 1);
+    return (int)models.size() - 1;
 }
 
 void setTranformations(int id, glm::vec3 position, glm::vec3 rotation, glm::vec3 scale)
@@ -172,10 +397,63 @@ void setTranformations(int id, glm::vec3 position, glm::vec3 rotation, glm::vec3
     models.at(id).position = position;
     models.at(id).rotation = rotation;
     models.at(id).scale = scale;
+
+    if (!models.at(id).dirty)
+    {
+        models.at(id).dirty = true;
+        dirtyModels.push_back(id);
+    }
+}
+
+// World transform of a model, translate * rotate(x, y, z) * scale
+glm::mat4 modelMatrix(const model& m)
+{
+    glm::mat4 matrix = glm::mat4(1.f);
+    matrix = glm::translate(matrix, m.position);
+    matrix = glm::rotate(matrix, glm::radians(m.rotation.x), glm::vec3(1.f, 0.f, 0.f));
+    matrix = glm::rotate(matrix, glm::radians(m.rotation.y), glm::vec3(0.f, 1.f, 0.f));
+    matrix = glm::rotate(matrix, glm::radians(m.rotation.z), glm::vec3(0.f, 0.f, 1.f));
+    matrix = glm::scale(matrix, m.scale);
+    return matrix;
+}
+
+// Bounds of a local AABB after an affine transform, from the transformed centre and the absolute matrix applied to the half extents
+AABB transformAABB(const AABB& local, const glm::mat4& matrix)
+{
+    glm::vec3 center = (local.min + local.max) * 0.5f;
+    glm::vec3 extent = (local.max - local.min) * 0.5f;
+
+    glm::mat3 absolute = glm::mat3(matrix);
+    for (int column = 0; column < 3; column++)
+        absolute[column] = glm::abs(absolute[column]);
+
+    glm::vec3 worldCenter = glm::vec3(matrix * glm::vec4(center, 1.f));
+    glm::vec3 worldExtent = absolute * extent;
+
+    AABB world;
+    world.min = worldCenter - worldExtent;
+    world.max = worldCenter + worldExtent;
+    return world;
 }
 
 /**
- * Makes a copy of a model and adds it to the vector of models
+ * Recompute the cached world matrix, normal matrix and world AABB of every dirty model
+ * Runs once per frame before rendering, static models cost nothing
+ */
+void updateModelTransforms()
+{
+    for (int id : dirtyModels)
+    {
+        model& m = models[id];
+        m.world = modelMatrix(m);
+        m.normal = glm::transpose(glm::inverse(glm::mat3(m.world)));
+        m.worldAABB = transformAABB(meshes.at(m.mesh).aabb, m.world);
+        m.dirty = false;
+    }
+}
+
+/**
+ * Places another copy of a model, the copy shares the original's mesh and material
  *
  *@param id of model to be duplicated
  *@return id of the duplicated model
@@ -183,7 +461,13 @@ void setTranformations(int id, glm::vec3 position, glm::vec3 rotation, glm::vec3
 int duplicateModel(int id)
 {
     model duplicateModel = models.at(id);
+    meshes.at(duplicateModel.mesh).refCount++;
+    materials.at(duplicateModel.material).refCount++;
+
     models.push_back(duplicateModel);
+    models.back().dirty = true;
+    drawListDirty = true;
+    dirtyModels.push_back((int)models.size() - 1);
 
     return models.size() - 1;
-}
\ No newline at end of file
+}
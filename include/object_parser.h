@@ -13,8 +13,12 @@
 
 #include <stdexcept>
 #include <cstring>
+#include <unordered_map>
 #include <glm/glm.hpp>
 
+// position (3), colour (3), alpha (1), normal (3) and texcoords (2)
+#define FLOATS_PER_VERTEX 12
+
 #define PIXEL_W 1920
 #define PIXEL_H 1080
 
@@ -37,6 +41,61 @@ public:
     int primID;
 };
 
+// Build a vertex from the attributes referenced by one OBJ face corner
+vertex read_vertex(const tinyobj::attrib_t& attrib, const tinyobj::index_t& index)
+{
+    vertex vert{};
+
+    // Position
+    vert.pos = {
+        attrib.vertices[3 * index.vertex_index + 0],
+        attrib.vertices[3 * index.vertex_index + 1],
+        attrib.vertices[3 * index.vertex_index + 2],
+        1.f
+    };
+
+    // Normal (if available)
+    if (!attrib.normals.empty() && index.normal_index >= 0)
+    {
+        vert.nor = {
+            attrib.normals[3 * index.normal_index + 0],
+            attrib.normals[3 * index.normal_index + 1],
+            attrib.normals[3 * index.normal_index + 2]
+        };
+    }
+    else {
+        vert.nor = { 0, 0, 0 };
+    }
+
+    // Texture coordinates
+    if (!attrib.texcoords.empty() && index.texcoord_index >= 0)
+    {
+        vert.tex = {
+            attrib.texcoords[2 * index.texcoord_index + 0],
+            attrib.texcoords[2 * index.texcoord_index + 1]
+        };
+    }
+    else {
+        vert.tex = { 0, 0 };
+    }
+
+    // Color from OBJ if available; OBJ colors, if present, are stored in groups of 3 floats.
+    if (!attrib.colors.empty() && (3 * index.vertex_index + 2) < attrib.colors.size())
+    {
+        vert.col = {
+            attrib.colors[3 * index.vertex_index + 0],
+            attrib.colors[3 * index.vertex_index + 1],
+            attrib.colors[3 * index.vertex_index + 2],
+            1.f
+        };
+    }
+    else {
+        vert.col = { 1, 1, 1 , 1};
+    }
+
+    return vert;
+}
+
 int obj_parse(const char* filename, std::vector<triangle>* io_tris)
 {
     tinyobj::attrib_t attrib;
@@ -58,54 +117,7 @@ int obj_parse(const char* filename, std::vector<triangle>* io_tris)
     {
         for (const auto& index : shape.mesh.indices)
         {
-            vertex vert{};
-
-            // Position
-            vert.pos = {
-                attrib.vertices[3 * index.vertex_index + 0],
-                attrib.vertices[3 * index.vertex_index + 1],
-                attrib.vertices[3 * index.vertex_index + 2],
-                1.f
-            };
-
-            // Normal (if available)
-            if (!attrib.normals.empty() && index.normal_index >= 0)
-            {
-                vert.nor = {
-                    attrib.normals[3 * index.normal_index + 0],
-                    attrib.normals[3 * index.normal_index + 1],
-                    attrib.normals[3 * index.normal_index + 2]
-                };
-            }
-            else {
-                vert.nor = { 0, 0, 0 };
-            }
-
-            // Texture coordinates
-            if (!attrib.texcoords.empty() && index.texcoord_index >= 0)
-            {
-                vert.tex = {
-                    attrib.texcoords[2 * index.texcoord_index + 0],
-                    attrib.texcoords[2 * index.texcoord_index + 1]
-                };
-            }
-            else {
-                vert.tex = { 0, 0 };
-            }
-
-            // Color from OBJ if available; OBJ colors, if present, are stored in groups of 3 floats.
-            if (!attrib.colors.empty() && (3 * index.vertex_index + 2) < attrib.colors.size())
-            {
-                vert.col = {
-                    attrib.colors[3 * index.vertex_index + 0],
-                    attrib.colors[3 * index.vertex_index + 1],
-                    attrib.colors[3 * index.vertex_index + 2],
-                    1.f
-                };
-            }
-            else {
-                vert.col = { 1, 1, 1 , 1};
-            }
+            vertex vert = read_vertex(attrib, index);
 
             vertices.push_back(vert);
             indices.push_back(static_cast<uint32_t>(indices.size()));
@@ -129,10 +141,134 @@ int obj_parse(const char* filename, std::vector<triangle>* io_tris)
     return 0;
 }
 
+// One interleaved vertex, used as the key when welding identical corners together
+struct packedVertex
+{
+    float data[FLOATS_PER_VERTEX];
+
+    bool operator==(const packedVertex& other) const
+    {
+        return memcmp(data, other.data, sizeof(data)) == 0;
+    }
+};
+
+// FNV-1a over the raw bytes of the vertex
+struct packedVertexHash
+{
+    size_t operator()(const packedVertex& v) const
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(v.data);
+        size_t hash = 2166136261u;
+        for (size_t i = 0; i < sizeof(v.data); i++)
+        {
+            hash ^= bytes[i];
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+};
+
+typedef std::unordered_map<packedVertex, unsigned int, packedVertexHash> vertexLookup;
+
+packedVertex packVertex(const vertex& vert)
+{
+    packedVertex packed = { {
+        vert.pos.x, vert.pos.y, vert.pos.z,
+        vert.col.x, vert.col.y, vert.col.z, vert.col.w,
+        vert.nor.x, vert.nor.y, vert.nor.z,
+        vert.tex.x, vert.tex.y
+    } };
+    return packed;
+}
+
+/**
+ * Append a corner to an indexed mesh, reusing an existing vertex if an identical one was already added
+ */
+void weldVertex(const packedVertex& vert, vertexLookup& lookup, std::vector<float>& vertices, std::vector<unsigned int>& indices)
+{
+    auto found = lookup.find(vert);
+    if (found != lookup.end())
+    {
+        indices.push_back(found->second);
+        return;
+    }
+
+    unsigned int index = static_cast<unsigned int>(vertices.size() / FLOATS_PER_VERTEX);
+    vertices.insert(vertices.end(), vert.data, vert.data + FLOATS_PER_VERTEX);
+    lookup.emplace(vert, index);
+    indices.push_back(index);
+}
+
+void printWeldStats(const char* name, size_t corners, size_t uniqueVertices)
+{
+    float ratio = uniqueVertices > 0 ? (float)corners / (float)uniqueVertices : 0.f;
+    printf("Model loader: %s welded %d corners into %d unique vertices (%.2fx)\n", name, (int)corners, (int)uniqueVertices, ratio);
+}
+
+/**
+ * Indexed loader mode, welds identical (position, colour, normal, texcoord) corners
+ * into a unique vertex table and returns a real index buffer
+ *
+ *@param io_vertices interleaved vertices, FLOATS_PER_VERTEX floats each
+ *@param io_indices three indices per triangle into io_vertices
+ */
+int obj_parse(const char* filename, std::vector<float>* io_vertices, std::vector<unsigned int>* io_indices)
+{
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::string warn, err;
+
+    if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filename))
+    {
+        std::cerr << "Warning: " << warn << std::endl;
+        std::cerr << "Error: " << err << std::endl;
+        throw std::runtime_error(warn + err);
+    }
+
+    size_t corners = 0;
+    for (const auto& shape : shapes)
+        corners += shape.mesh.indices.size();
+
+    vertexLookup lookup;
+    lookup.reserve(corners);
+    io_indices->reserve(io_indices->size() + corners);
+
+    for (const auto& shape : shapes)
+    {
+        for (const auto& index : shape.mesh.indices)
+            weldVertex(packVertex(read_vertex(attrib, index)), lookup, *io_vertices, *io_indices);
+    }
+
+    printf("Model loader: Successfully loaded %s and read %d triangles \n", filename, (int)(corners / 3));
+    printWeldStats(filename, corners, io_vertices->size() / FLOATS_PER_VERTEX);
+    return 0;
+}
+
+/**
+ * Weld a flat triangle list (e.g. cube_vertices or a generated torus) into an indexed mesh
+ */
+void indexVertices(const std::vector<float>& soup, std::vector<float>& vertices, std::vector<unsigned int>& indices, const char* name)
+{
+    size_t corners = soup.size() / FLOATS_PER_VERTEX;
+    vertexLookup lookup;
+    lookup.reserve(corners);
+    indices.reserve(indices.size() + corners);
+
+    for (size_t i = 0; i < corners; i++)
+    {
+        packedVertex vert;
+        memcpy(vert.data, &soup[i * FLOATS_PER_VERTEX], sizeof(vert.data));
+        weldVertex(vert, lookup, vertices, indices);
+    }
+
+    printWeldStats(name, corners, vertices.size() / FLOATS_PER_VERTEX);
+}
+
 std::vector<float> triangleToVertices(std::vector<triangle>& triangles)
 {
     // Each vertex contains: 3 floats (position) + 3 floats (color) + 1 (alpha) + 3 floats (normal) + 2 floats (texture) = 12 floats per vertex.
-    size_t floatsPerVertex = 12;
+    size_t floatsPerVertex = FLOATS_PER_VERTEX;
     size_t floatsPerTriangle = 3 * floatsPerVertex;
     std::vector<float> vertices;
     vertices.reserve(triangles.size() * floatsPerTriangle);
@@ -0,0 +1,85 @@
+#pragma once
+#include <cstdio>
+#include <vector>
+#include <GL/gl3w.h>
+
+#include "frame_stats.h"
+#include "render_state.h"
+
+// Overdraw view, every fragment shader invocation of the camera pass adds one to its pixel's count in an integer
+// image, which is then drawn as a heat map in place of the lit image
+// Comparing it with and without the depth pre-pass shows the lighting work the pre-pass saves
+#define OVERDRAW_IMAGE_UNIT 0 // Must match overdraw.frag and overdrawView.frag
+
+struct OverdrawView
+{
+    int width = 0;
+    int height = 0;
+
+    GLuint counts = 0;      // GL_R32UI, invocations per pixel, counted by the overdrawPermutations programs in Assessment2.cpp
+    GLuint viewProgram = 0; // shadowFilter.vert and overdrawView.frag
+    GLuint vertexArray = 0; // Empty, the heat map is a single triangle from gl_VertexID
+};
+
+OverdrawView overdrawView;
+bool showOverdraw = false;
+
+void createOverdrawView(int width, int height, GLuint viewProgram)
+{
+    OverdrawView& view = overdrawView;
+    view.width = width;
+    view.height = height;
+    view.viewProgram = viewProgram;
+
+    glCreateTextures(GL_TEXTURE_2D, 1, &view.counts);
+    glTextureStorage2D(view.counts, 1, GL_R32UI, width, height);
+    glCreateVertexArrays(1, &view.vertexArray);
+}
+
+// Clear the counts and bind them for overdraw.frag, colour writes are off as the heat map replaces the image anyway
+void beginOverdrawCount()
+{
+    const GLuint zero = 0;
+    glClearTexImage(overdrawView.counts, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    glBindImageTexture(OVERDRAW_IMAGE_UNIT, overdrawView.counts, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+}
+
+// Draw the counts as a heat map over the whole default framebuffer
+void drawOverdrawView()
+{
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+    useProgram(overdrawView.viewProgram);
+    bindVertexArray(overdrawView.vertexArray);
+    glDepthFunc(GL_ALWAYS);
+    glDepthMask(GL_FALSE);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glDepthMask(GL_TRUE);
+    glDepthFunc(GL_LESS);
+}
+
+/**
+ * Average and worst invocations per pixel of the last counted frame
+ * Reads the counts back and waits for the GPU, so it is only for printing on request
+ */
+void printOverdrawStats(const char* label)
+{
+    const OverdrawView& view = overdrawView;
+    std::vector<GLuint> counts((size_t)view.width * view.height);
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+    glGetTextureImage(view.counts, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, (GLsizei)(counts.size() * sizeof(GLuint)), counts.data());
+
+    unsigned long long total = 0;
+    size_t covered = 0;
+    GLuint worst = 0;
+    for (GLuint count : counts)
+    {
+        total += count;
+        covered += count > 0;
+        worst = count > worst ? count : worst;
+    }
+    printf("Overdraw: %s, %.2f invocations per covered pixel, %u at worst, %.2f per screen pixel\n", label,
+        covered ? (double)total / covered : 0.0, worst, (double)total / counts.size());
+}
@@ -0,0 +1,193 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <GL/gl3w.h>
+
+#include "frame_stats.h"
+
+// Linked program binaries cached next to the fragment shader, so a warm start loads its programs instead of compiling them
+// An entry's file name comes from the stage files and the defines, and its header holds a hash of the sources, the
+// defines and the driver's vendor, renderer and version, so an edited shader or a new driver recompiles over it
+#define PROGRAM_CACHE_EXTENSION ".programcache"
+#define PROGRAM_CACHE_MAGIC 0x47525043u // "CPRG"
+#define PROGRAM_CACHE_VERSION 1u
+
+struct ProgramCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key; // See programCacheKey()
+    uint32_t binaryFormat;
+    uint32_t binaryLength;
+};
+
+struct ProgramCache
+{
+    bool checked = false;
+    bool enabled = false; // False if the driver offers no binary formats, every program is then compiled
+    std::string driver;   // Vendor, renderer and version, part of every key
+
+    // Programs loaded and compiled so far, and the time both took
+    int loaded = 0;
+    int compiled = 0;
+    double milliseconds = 0.0;
+};
+
+ProgramCache programCache;
+
+// FNV-1a over size bytes, continuing from hash
+uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+uint64_t hashString(uint64_t hash, const char* text)
+{
+    // The terminator is hashed too, so moving text from one string to the next changes the hash
+    return hashBytes(hash, text, strlen(text) + 1);
+}
+
+// Query the driver once, a context must be current
+void checkProgramCache()
+{
+    ProgramCache& cache = programCache;
+    if (cache.checked)
+        return;
+    cache.checked = true;
+
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    cache.enabled = formats > 0;
+    if (!cache.enabled)
+        printf("Program cache: the driver has no program binary formats, programs are always compiled\n");
+
+    for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+    {
+        const char* value = (const char*)glGetString(name);
+        cache.driver += value ? value : "";
+        cache.driver += '\n';
+    }
+}
+
+// Path of the entry for these stage files and defines, beside the fragment shader
+std::string programCachePath(const char* const* filenames, int stageCount, const char* defines)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (int stage = 0; stage < stageCount; stage++)
+        hash = hashString(hash, filenames[stage]);
+    hash = hashString(hash, defines);
+
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+    return std::string(filenames[1]) + "." + name + PROGRAM_CACHE_EXTENSION;
+}
+
+// Hash of everything the binary depends on, an entry with any other key is stale
+uint64_t programCacheKey(const char* const* sources, int stageCount, const char* defines)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (int stage = 0; stage < stageCount; stage++)
+        hash = hashString(hash, sources[stage]);
+    hash = hashString(hash, defines);
+    return hashString(hash, programCache.driver.c_str());
+}
+
+/**
+ * Load a program from the cache entry at path
+ *
+ *@return 0 if there is no entry, it is stale or the driver rejects the binary, the program then has to be compiled
+ */
+GLuint readProgramCache(const std::string& path, uint64_t key)
+{
+    if (!programCache.enabled)
+        return 0;
+
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return 0;
+
+    ProgramCacheHeader header;
+    in.read((char*)&header, sizeof(header));
+    if (!in || header.magic != PROGRAM_CACHE_MAGIC || header.version != PROGRAM_CACHE_VERSION || header.key != key)
+    {
+        printf("Program cache: %s is stale, recompiling\n", path.c_str());
+        return 0;
+    }
+
+    std::vector<char> binary(header.binaryLength);
+    in.read(binary.data(), binary.size());
+    if (!in)
+        return 0;
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.binaryFormat, binary.data(), (GLsizei)binary.size());
+
+    // Drivers may refuse a binary they wrote themselves, e.g. after an update that kept the version string
+    GLint success = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        printf("Program cache: the driver rejected %s, recompiling\n", path.c_str());
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+/**
+ * Write a linked program's binary to the cache entry at path
+ * The program must have been linked with GL_PROGRAM_BINARY_RETRIEVABLE_HINT set
+ */
+bool writeProgramCache(GLuint program, const std::string& path, uint64_t key)
+{
+    if (!programCache.enabled)
+        return false;
+
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return false;
+
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &length, &format, binary.data());
+
+    ProgramCacheHeader header = {};
+    header.version = PROGRAM_CACHE_VERSION;
+    header.key = key;
+    header.binaryFormat = format;
+    header.binaryLength = (uint32_t)length;
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+    {
+        printf("Program cache: could not write %s\n", path.c_str());
+        return false;
+    }
+
+    // Write the header with a zero magic first so an interrupted write never looks valid
+    header.magic = 0;
+    out.write((const char*)&header, sizeof(header));
+    out.write(binary.data(), length);
+
+    header.magic = PROGRAM_CACHE_MAGIC;
+    out.seekp(0);
+    out.write((const char*)&header, sizeof(header));
+    return (bool)out;
+}
+
+void printProgramCacheStats()
+{
+    printf("Program cache: %d programs loaded and %d compiled in %.1f ms\n", programCache.loaded, programCache.compiled,
+        programCache.milliseconds);
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <GL/gl3w.h>
+
+#include "frame_stats.h"
+
+// Shadow copy of the GL bindings the render loop changes, so a bind to what is already bound is skipped
+#define MAX_TEXTURE_UNITS 32
+
+struct RenderState
+{
+    GLuint program = 0;
+    GLuint vertexArray = 0;
+    GLuint textures[MAX_TEXTURE_UNITS] = {};
+
+    // Material whose textures and uniforms are on the current program, -1 if unknown
+    int material = -1;
+};
+
+RenderState renderState;
+
+/**
+ * Forget everything bound, the next bind of each kind is always issued
+ * Call at the start of every frame and after any code binds outside these helpers
+ */
+void resetRenderState()
+{
+    renderState = RenderState();
+}
+
+// Count a state change, issued tells whether it reached GL or was skipped as redundant
+void countStateChange(bool issued)
+{
+    if (issued)
+        frameStats.stateChanges++;
+    else
+        frameStats.stateChangesSkipped++;
+}
+
+void useProgram(GLuint program)
+{
+    bool issued = renderState.program != program;
+    countStateChange(issued);
+    if (!issued)
+        return;
+
+    glUseProgram(program);
+    renderState.program = program;
+    renderState.material = -1; // Material uniforms are per program
+}
+
+void bindVertexArray(GLuint vertexArray)
+{
+    bool issued = renderState.vertexArray != vertexArray;
+    countStateChange(issued);
+    if (!issued)
+        return;
+
+    glBindVertexArray(vertexArray);
+    renderState.vertexArray = vertexArray;
+}
+
+// Bind through DSA, no glActiveTexture round trip is needed to pick the unit
+void bindTextureUnit(GLuint unit, GLuint texture)
+{
+    bool issued = unit >= MAX_TEXTURE_UNITS || renderState.textures[unit] != texture;
+    countStateChange(issued);
+    if (!issued)
+        return;
+
+    glBindTextureUnit(unit, texture);
+    if (unit < MAX_TEXTURE_UNITS)
+        renderState.textures[unit] = texture;
+}
+
+// Record that nothing is bound to a unit any more, e.g. after deleting the texture that was, GL unbinds it itself
+void forgetTexture(GLuint unit)
+{
+    if (unit < MAX_TEXTURE_UNITS)
+        renderState.textures[unit] = 0;
+}
@@ -1,110 +1,203 @@
 #pragma once
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <GL/gl3w.h>
 
-GLuint CompileShader(const char* vsFilename, const char* fsFilename)
+#include "file.h"
+#include "frame_stats.h"
+#include "program_cache.h"
+
+// Locations of a program's active uniforms and the bindings of its uniform blocks, filled in once after linking
+struct ShaderReflection
 {
-	int success;
-	char infoLog[512];
+	std::unordered_map<std::string, GLint> uniforms;
+	std::unordered_map<std::string, GLint> blocks;
+};
 
-	unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-	char* vertexShaderSource = read_file(vsFilename);
-	glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-	glCompileShader(vertexShader);
-	glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-	if (!success)
-	{
-		glGetShaderInfoLog(vertexShader, 512, NULL, infoLog);
-		fprintf(stderr, "Vertex Shader Compilation Failed: %s\n", infoLog);
-	}
+std::unordered_map<GLuint, ShaderReflection> shaderReflections;
 
-	unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-	char* fragmentShaderSource = read_file(fsFilename);
-	glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-	glCompileShader(fragmentShader);
-	glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-	if (!success)
+void reflectProgram(GLuint program)
+{
+	ShaderReflection& reflection = shaderReflections[program];
+	char name[256];
+
+	GLint uniformCount = 0;
+	glGetProgramInterfaceiv(program, GL_UNIFORM, GL_ACTIVE_RESOURCES, &uniformCount);
+	for (GLint i = 0; i < uniformCount; i++)
 	{
-		glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog);
-		fprintf(stderr, "Fragment Shader Compilation Failed: %s\n", infoLog);
+		const GLenum properties[] = { GL_LOCATION, GL_ARRAY_SIZE, GL_BLOCK_INDEX };
+		GLint values[3];
+		glGetProgramResourceiv(program, GL_UNIFORM, i, 3, properties, 3, NULL, values);
+		if (values[2] != -1)
+			continue; // Member of a uniform block, set through its buffer instead
+
+		glGetProgramResourceName(program, GL_UNIFORM, i, sizeof(name), NULL, name);
+		std::string uniform = name;
+		reflection.uniforms[uniform] = values[0];
+
+		// Arrays are reported once as "name[0]", register the bare name and every element too
+		if (uniform.size() > 3 && uniform.compare(uniform.size() - 3, 3, "[0]") == 0)
+		{
+			std::string base = uniform.substr(0, uniform.size() - 3);
+			reflection.uniforms[base] = values[0];
+			for (GLint element = 1; element < values[1]; element++)
+			{
+				std::string elementName = base + "[" + std::to_string(element) + "]";
+				reflection.uniforms[elementName] = glGetProgramResourceLocation(program, GL_UNIFORM, elementName.c_str());
+			}
+		}
 	}
 
-	unsigned int program = glCreateProgram();
-	glAttachShader(program, vertexShader);
-	glAttachShader(program, fragmentShader);
-	glLinkProgram(program);
-	glGetProgramiv(program, GL_LINK_STATUS, &success);
-	if (!success)
+	GLint blockCount = 0;
+	glGetProgramInterfaceiv(program, GL_UNIFORM_BLOCK, GL_ACTIVE_RESOURCES, &blockCount);
+	for (GLint i = 0; i < blockCount; i++)
 	{
-		glGetProgramInfoLog(program, 512, NULL, infoLog);
-		fprintf(stderr, "Shader Program Link Failed: %s\n", infoLog);
+		const GLenum property = GL_BUFFER_BINDING;
+		GLint binding;
+		glGetProgramResourceiv(program, GL_UNIFORM_BLOCK, i, 1, &property, 1, NULL, &binding);
+		glGetProgramResourceName(program, GL_UNIFORM_BLOCK, i, sizeof(name), NULL, name);
+		reflection.blocks[name] = binding;
 	}
 
-	free(fragmentShaderSource);
-	free(vertexShaderSource);
+	printf("Shader: program %u has %d uniforms and %d uniform blocks\n", program, (int)reflection.uniforms.size(), blockCount);
+}
 
-	glDeleteShader(vertexShader);
-	glDeleteShader(fragmentShader);
+/**
+ * Location of a uniform found when the program was linked, use this instead of glGetUniformLocation
+ *
+ *@return -1 if the uniform is not active in the program, glUniform* calls then do nothing
+ */
+GLint uniformLocation(GLuint program, const std::string& name)
+{
+	auto reflection = shaderReflections.find(program);
+	if (reflection == shaderReflections.end())
+		return -1;
 
-	return program;
+	auto found = reflection->second.uniforms.find(name);
+	return found != reflection->second.uniforms.end() ? found->second : -1;
 }
 
-// Function overload for geometric shader
-GLuint CompileShader(const char* vsFilename, const char* fsFilename, const char* gsFilename)
+// Whether the driver exposes an OpenGL extension, e.g. "GL_ARB_shader_viewport_layer_array"
+bool hasGLExtension(const char* name)
+{
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; i++)
+	{
+		const char* extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+		if (extension && strcmp(extension, name) == 0)
+			return true;
+	}
+	return false;
+}
+
+// Compile one stage with #define lines inserted after its #version line, which GLSL requires to come first
+unsigned int compileShaderStage(GLenum type, const char* filename, const char* source, const char* defines)
 {
 	int success;
 	char infoLog[512];
 
-	unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-	char* vertexShaderSource = read_file(vsFilename);
-	glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-	glCompileShader(vertexShader);
-	glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-	if (!success)
-	{
-		glGetShaderInfoLog(vertexShader, 512, NULL, infoLog);
-		fprintf(stderr, "Vertex Shader Compilation Failed: %s\n", infoLog);
-	}
+	unsigned int shader = glCreateShader(type);
+	const char* body = strchr(source, '\n');
+	body = body ? body + 1 : source + strlen(source);
 
-	unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-	char* fragmentShaderSource = read_file(fsFilename);
-	glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-	glCompileShader(fragmentShader);
-	glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
+	const char* strings[3] = { source, defines, body };
+	const GLint lengths[3] = { (GLint)(body - source), -1, -1 };
+	glShaderSource(shader, 3, strings, lengths);
+	glCompileShader(shader);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
 	if (!success)
 	{
-		glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog);
-		fprintf(stderr, "Fragment Shader Compilation Failed: %s\n", infoLog);
+		glGetShaderInfoLog(shader, 512, NULL, infoLog);
+		fprintf(stderr, "%s Compilation Failed (%s): %s\n", filename, defines, infoLog);
 	}
+	return shader;
+}
 
-	unsigned int geometricShader = glCreateShader(GL_GEOMETRY_SHADER);
-	char* geometricShaderSource = read_file(gsFilename);
-	glShaderSource(geometricShader, 1, &geometricShaderSource, NULL);
-	glCompileShader(geometricShader);
-	glGetShaderiv(geometricShader, GL_COMPILE_STATUS, &success);
-	if (!success)
+/**
+ * Build a program from vertex, fragment and optionally geometry stages, defines is added to every stage
+ * The program is loaded from the program cache when its sources, defines and the driver match the cached binary,
+ * otherwise it is compiled and linked and the binary is cached for the next start
+ */
+GLuint linkProgram(const char* const* filenames, int stageCount, const char* defines)
+{
+	const GLenum types[3] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER, GL_GEOMETRY_SHADER };
+	auto start = std::chrono::steady_clock::now();
+	checkProgramCache();
+
+	char* sources[3] = {};
+	for (int stage = 0; stage < stageCount; stage++)
 	{
-		glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog);
-		fprintf(stderr, "Geometric Shader Compilation Failed: %s\n", infoLog);
+		sources[stage] = read_file(filenames[stage]);
+		if (sources[stage] == NULL)
+		{
+			fprintf(stderr, "%s could not be read\n", filenames[stage]);
+			sources[stage] = (char*)calloc(1, 1);
+		}
 	}
 
-	unsigned int program = glCreateProgram();
-	glAttachShader(program, vertexShader);
-	glAttachShader(program, fragmentShader);
-	glAttachShader(program, geometricShader);
-	glLinkProgram(program);
-	glGetProgramiv(program, GL_LINK_STATUS, &success);
-	if (!success)
+	std::string cachePath = programCachePath(filenames, stageCount, defines);
+	uint64_t key = programCacheKey(sources, stageCount, defines);
+	GLuint program = readProgramCache(cachePath, key);
+	if (program != 0)
+		programCache.loaded++;
+	else
 	{
-		glGetProgramInfoLog(program, 512, NULL, infoLog);
-		fprintf(stderr, "Shader Program Link Failed: %s\n", infoLog);
-	}
+		int success;
+		char infoLog[512];
+
+		unsigned int shaders[3];
+		program = glCreateProgram();
+		for (int stage = 0; stage < stageCount; stage++)
+		{
+			shaders[stage] = compileShaderStage(types[stage], filenames[stage], sources[stage], defines);
+			glAttachShader(program, shaders[stage]);
+		}
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glLinkProgram(program);
+		glGetProgramiv(program, GL_LINK_STATUS, &success);
+		if (!success)
+		{
+			glGetProgramInfoLog(program, 512, NULL, infoLog);
+			fprintf(stderr, "Shader Program Link Failed: %s\n", infoLog);
+		}
+		else
+			writeProgramCache(program, cachePath, key);
 
-	free(fragmentShaderSource);
-	free(vertexShaderSource);
-	free(geometricShaderSource);
+		for (int stage = 0; stage < stageCount; stage++)
+			glDeleteShader(shaders[stage]);
+		programCache.compiled++;
+	}
 
-	glDeleteShader(vertexShader);
-	glDeleteShader(fragmentShader);
-	glDeleteShader(geometricShader);
+	for (int stage = 0; stage < stageCount; stage++)
+		free(sources[stage]);
+	programCache.milliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 
+	reflectProgram(program);
 	return program;
-}
\ No newline at end of file
+}
+
+GLuint CompileShader(const char* vsFilename, const char* fsFilename)
+{
+	const char* filenames[2] = { vsFilename, fsFilename };
+	return linkProgram(filenames, 2, "");
+}
+
+// Function overload for geometric shader
+GLuint CompileShader(const char* vsFilename, const char* fsFilename, const char* gsFilename)
+{
+	const char* filenames[3] = { vsFilename, fsFilename, gsFilename };
+	return linkProgram(filenames, 3, "");
+}
+
+/**
+ * Permutation of a vertex and fragment shader pair, defines (e.g. "#define DEFERRED_LIGHTING\n") is added to both
+ * Lets one source file be compiled into variants that can be swapped at runtime and compared
+ */
+GLuint CompileShaderVariant(const char* vsFilename, const char* fsFilename, const char* defines)
+{
+	const char* filenames[2] = { vsFilename, fsFilename };
+	return linkProgram(filenames, 2, defines);
+}
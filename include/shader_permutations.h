@@ -0,0 +1,115 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <GL/gl3w.h>
+
+#include "light.h"
+#include "model.h"
+#include "shader.h"
+#include "shadow_filter.h"
+
+// Features a shader permutation is compiled with, each one a #define, so the maps a material lacks and the light types
+// and shadow filters the frame does not use cost nothing per pixel instead of being branched around
+// The material bits come from the PBRTextures has* flags, the light bits from the types of the lights that are on,
+// and the shadow filter is a 2 bit number
+#define PERMUTATION_NORMAL_MAP (1u << 0)
+#define PERMUTATION_METALLIC_MAP (1u << 1)
+#define PERMUTATION_ROUGHNESS_MAP (1u << 2)
+#define PERMUTATION_AO_MAP (1u << 3)
+#define PERMUTATION_DIRECTIONAL_LIGHTS (1u << 4)
+#define PERMUTATION_POINT_LIGHTS (1u << 5)
+#define PERMUTATION_SPOT_LIGHTS (1u << 6)
+#define PERMUTATION_SHADOW_FILTER_SHIFT 7
+#define PERMUTATION_SHADOW_FILTER (3u << PERMUTATION_SHADOW_FILTER_SHIFT)
+
+#define PERMUTATION_FLAGS 7 // The single bit features, each has a name in permutationFlagDefines
+#define PERMUTATION_MATERIAL (PERMUTATION_NORMAL_MAP | PERMUTATION_METALLIC_MAP | PERMUTATION_ROUGHNESS_MAP | PERMUTATION_AO_MAP)
+#define PERMUTATION_LIGHTING (PERMUTATION_DIRECTIONAL_LIGHTS | PERMUTATION_POINT_LIGHTS | PERMUTATION_SPOT_LIGHTS | PERMUTATION_SHADOW_FILTER)
+
+const char* permutationFlagDefines[PERMUTATION_FLAGS] = { "HAS_NORMAL_MAP", "HAS_METALLIC_MAP", "HAS_ROUGHNESS_MAP", "HAS_AO_MAP",
+    "HAS_DIRECTIONAL_LIGHTS", "HAS_POINT_LIGHTS", "HAS_SPOT_LIGHTS" };
+
+/**
+ * Every permutation of a vertex and fragment shader pair that has been asked for, compiled the first time it is
+ * features are the bits the source reacts to, the rest of a key is masked off so it never compiles a duplicate
+ */
+struct ShaderPermutations
+{
+    ShaderPermutations(const char* vsFilename = "", const char* fsFilename = "", const std::string& defines = "", uint32_t features = 0)
+        : vsFilename(vsFilename), fsFilename(fsFilename), defines(defines), features(features)
+    {
+    }
+
+    const char* vsFilename;
+    const char* fsFilename;
+    std::string defines; // Common to every permutation, e.g. the G-buffer layout
+    uint32_t features;
+    std::unordered_map<uint32_t, GLuint> programs;
+};
+
+// Material bits of a permutation, the maps the material has
+uint32_t materialPermutation(const PBRTextures& textures)
+{
+    uint32_t key = 0;
+    if (textures.hasNormal)
+        key |= PERMUTATION_NORMAL_MAP;
+    if (textures.hasMetallic)
+        key |= PERMUTATION_METALLIC_MAP;
+    if (textures.hasRoughness)
+        key |= PERMUTATION_ROUGHNESS_MAP;
+    if (textures.hasAO)
+        key |= PERMUTATION_AO_MAP;
+    return key;
+}
+
+// Lighting bits of a permutation for this frame, the types of the lights that are on and the shadow filter
+uint32_t lightingPermutation()
+{
+    uint32_t key = (uint32_t)shadowFilter << PERMUTATION_SHADOW_FILTER_SHIFT;
+    for (const Light& light : lights)
+    {
+        if (!light.isOn)
+            continue;
+        if (light.type == DIRECTIONAL)
+            key |= PERMUTATION_DIRECTIONAL_LIGHTS;
+        else if (light.type == POSITIONAL)
+            key |= PERMUTATION_POINT_LIGHTS;
+        else if (light.type == SPOT)
+            key |= PERMUTATION_SPOT_LIGHTS;
+    }
+    return key;
+}
+
+// #define lines of a permutation, after the ones every permutation shares
+std::string permutationDefines(const ShaderPermutations& permutations, uint32_t key)
+{
+    std::string defines = permutations.defines;
+    for (int flag = 0; flag < PERMUTATION_FLAGS; flag++)
+    {
+        if (key & (1u << flag))
+            defines += std::string("#define ") + permutationFlagDefines[flag] + "\n";
+    }
+    if (permutations.features & PERMUTATION_SHADOW_FILTER)
+        defines += "#define SHADOW_FILTER " + std::to_string((key & PERMUTATION_SHADOW_FILTER) >> PERMUTATION_SHADOW_FILTER_SHIFT) + "\n";
+    return defines;
+}
+
+/**
+ * Program of a permutation, compiled or loaded from the program cache on first use
+ *
+ *@param key any mix of PERMUTATION_* bits, those outside the shader's features are ignored
+ */
+GLuint permutationProgram(ShaderPermutations& permutations, uint32_t key)
+{
+    key &= permutations.features;
+    auto found = permutations.programs.find(key);
+    if (found != permutations.programs.end())
+        return found->second;
+
+    GLuint program = CompileShaderVariant(permutations.vsFilename, permutations.fsFilename, permutationDefines(permutations, key).c_str());
+    permutations.programs[key] = program;
+    printf("Shader: %s permutation 0x%03x ready, %d of this shader so far\n", permutations.fsFilename, key, (int)permutations.programs.size());
+    return program;
+}
@@ -1,129 +1,21 @@
 #pragma once
 
-#include "bitmap.h"
-
+// A light's shadow map, a region of the shared shadow atlas, see shadow_atlas.h
 struct ShadowStruct
 {
 	bool updateShadow = true;
-	unsigned int FBO;
-	unsigned int Texture;
-	int width;
-	int height;
-};
-
-ShadowStruct setup_shadowmap(int w, int h)
-{
-	ShadowStruct shadow;
-	shadow.width = w;
-	shadow.height = h;
 
-	glGenFramebuffers(1, &shadow.FBO);
-	glBindFramebuffer(GL_FRAMEBUFFER, shadow.FBO);
-	glGenTextures(1, &shadow.Texture);
-	glBindTexture(GL_TEXTURE_2D, shadow.Texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, w, h, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-	float borderColour[] = { 1.f, 1.f, 1.f, 1.f };
-	glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColour);
-	glBindFramebuffer(GL_FRAMEBUFFER, shadow.FBO);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadow.Texture, 0);
-	glDrawBuffer(GL_NONE);
-	glReadBuffer(GL_NONE);
+	// Tile in the atlas in texels, point lights use a 3 x 2 block of size x size tiles, one per cube face
+	// size is 0 until the atlas has been packed
+	int x = 0;
+	int y = 0;
+	int size = 0;
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	// The same region of the static atlas holds the depth of the static models only, it is copied in
+	// before the dynamic models are drawn on top and re-rendered only when staticValid is cleared
+	bool staticValid = false;
 
-	printf("Shadow: shadow map setup\n");
-	return shadow;
-}
-
-ShadowStruct setup_shadow_cubemap(unsigned int width, unsigned int height)
-{
-    ShadowStruct shadow;
-	shadow.width = width;
-	shadow.height = height;
-    
-    // Generate framebuffer
-    glGenFramebuffers(1, &shadow.FBO);
-    
-    // Generate texture
-    glGenTextures(1, &shadow.Texture);
-    
-    // IMPORTANT: Bind with the correct target
-    glBindTexture(GL_TEXTURE_CUBE_MAP, shadow.Texture);
-    
-    // Create all six faces of the cubemap
-    for (unsigned int i = 0; i < 6; ++i)
-        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT,
-                     width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    
-    // Set texture parameters
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    
-    glBindFramebuffer(GL_FRAMEBUFFER, shadow.FBO);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadow.Texture, 0);
-    
-    glDrawBuffer(GL_NONE);
-    glReadBuffer(GL_NONE);
-    
-    // Check if framebuffer is complete
-    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-        printf("Cubemap shadow framebuffer is not complete!\n");
-    }
-    
-    // Unbind framebuffer
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    
-	printf("Shadow: Shadow cube map setup\n");
-	return shadow;
-}
-
-void saveShadowMapToBitmap(unsigned int Texture, int w, int h)
-{
-	float* pixelBuffer = (float*)malloc(sizeof(float) * w * h);// [] ;
-	glBindTexture(GL_TEXTURE_2D, Texture);
-	glGetTexImage(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, GL_FLOAT, pixelBuffer);
-
-	char* charBuffer = (char*)malloc(sizeof(unsigned char) * w * h * 3);
-
-	for (int y = 0; y < h; y++)
-	{
-		for (int x = 0; x < w; x++)
-		{
-			charBuffer[(y * w * 3) + (x * 3) + 0] = pixelBuffer[(y * w) + x] * 255;
-			charBuffer[(y * w * 3) + (x * 3) + 1] = pixelBuffer[(y * w) + x] * 255;
-			charBuffer[(y * w * 3) + (x * 3) + 2] = pixelBuffer[(y * w) + x] * 255;
-		}
-
-	}
-
-	BITMAPINFOHEADER infoHdr;
-	infoHdr.biSize = 40;
-	infoHdr.biWidth = w;
-	infoHdr.biHeight = h;
-	infoHdr.biPlanes = 1;
-	infoHdr.biBitCount = 24;
-	infoHdr.biCompression = 0;
-	infoHdr.biSizeImage = sizeof(unsigned char) * w * h * 3;
-	infoHdr.biXPelsPerMeter = 0;
-	infoHdr.biYPelsPerMeter = 0;
-	infoHdr.biClrUsed = 0;
-	infoHdr.biClrImportant = 0;
-
-	BITMAPFILEHEADER fileHdr;
-	fileHdr.bfType = 19778;
-	fileHdr.bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + (sizeof(unsigned char) * w * h * 3);
-	fileHdr.bfReserved1 = 0;
-	fileHdr.bfReserved2 = 0;
-	fileHdr.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
-	savebitmap("shadowMap.bmp", (unsigned char*)charBuffer, &infoHdr, &fileHdr);
-
-	free(charBuffer);
-	free(pixelBuffer);
-}
\ No newline at end of file
+	// Update budget, a dirty shadow map is re-rendered at most once every minInterval seconds
+	float minInterval = 0.f;
+	float sinceUpdate = 0.f;
+};
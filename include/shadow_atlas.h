@@ -0,0 +1,330 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include <GL/gl3w.h>
+#include <glm/glm.hpp>
+
+#include "bvh.h"
+#include "frame_stats.h"
+#include "light.h"
+
+// One depth texture shared by the shadow maps of every light, each light renders into its own tile
+// Tiles are sized from how much of the screen a light's shadow volume covers and repacked whenever those sizes change
+#define SHADOW_ATLAS_SIZE 8192
+#define MAX_SHADOW_TILE 4096
+#define MAX_CUBE_SHADOW_TILE 2048 // Per face, a point light takes a 3 x 2 block of these
+#define MAX_CASCADE_TILE 2048     // Per cascade, a cascaded light takes a 2 x 2 block of these
+#define MIN_SHADOW_TILE 256
+
+// A light's tile halves each time the share of the screen its shadow volume covers quarters below this,
+// so its texels stay about the same size on screen
+#define SHADOW_DETAIL_COVERAGE 0.25f
+
+// A tile only shrinks once its coverage is this many times smaller than the coverage it grew at, so it does not flicker
+#define SHADOW_TILE_HYSTERESIS 1.5f
+
+// Share of the screen counted for lights whose shadow volume is outside the view, they still update eventually
+#define SHADOW_OFFSCREEN_COVERAGE 0.02f
+
+struct ShadowAtlas
+{
+    // 16-bit depth, the directional and point light maps store linear depth and the spot lights' perspective depth
+    // (near 1, far 70), whose steps grow with the square of the distance, about 0.4 mm at 5 m, 1.5 mm at 10 m and 7 cm at 70 m
+    GLuint texture = 0;
+    GLuint FBO = 0;
+
+    // Reads the atlas with depth comparison and bilinear filtering, for the SHADOW_FILTER_HARDWARE_PCF lighting permutation
+    GLuint compareSampler = 0;
+
+    // Static model depth in the same layout, see ShadowStruct::staticValid
+    GLuint staticTexture = 0;
+    GLuint staticFBO = 0;
+
+    // One point light's faces, a cube update spread over frames renders here until all six are done, see shadow_scheduler.h
+    GLuint stagingTexture = 0;
+    GLuint stagingFBO = 0;
+
+    // Tile size each light asks for, the packed size can be smaller when the atlas is full
+    std::vector<int> requested;
+
+    // Reused between repacks so packing does not allocate once warmed up
+    std::vector<int> sizes;
+    std::vector<int> order;
+    std::vector<glm::ivec3> shelves;  // y, height and used width of each row
+    std::vector<glm::ivec3> previous; // x, y and size of each tile before the repack
+};
+
+ShadowAtlas shadowAtlas;
+
+// Size in texels of a light's region for a given tile size
+int shadowRegionWidth(const Light& light, int size)
+{
+    return light.type == POSITIONAL ? 3 * size : light.cascaded ? 2 * size : size;
+}
+
+int shadowRegionHeight(const Light& light, int size)
+{
+    return light.type == POSITIONAL || light.cascaded ? 2 * size : size;
+}
+
+// Texel origin of one cube face of a point light's region, faces are laid out in cube map face order
+void shadowFaceOrigin(const ShadowStruct& shadow, int face, int& x, int& y)
+{
+    x = shadow.x + (face % 3) * shadow.size;
+    y = shadow.y + (face / 3) * shadow.size;
+}
+
+// Texel origin of one cascade of a cascaded light's region, laid out 2 x 2 nearest first
+void shadowCascadeOrigin(const ShadowStruct& shadow, int cascade, int& x, int& y)
+{
+    x = shadow.x + (cascade % 2) * shadow.size;
+    y = shadow.y + (cascade / 2) * shadow.size;
+}
+
+// Tile of a shadow map in atlas texture coordinates (x, y, width, height), zero sized if the light has no tile
+glm::vec4 shadowTileRect(const ShadowStruct& shadow)
+{
+    return glm::vec4(shadow.x, shadow.y, shadow.size, shadow.size) / (float)SHADOW_ATLAS_SIZE;
+}
+
+void createShadowAtlasTarget(GLuint& texture, GLuint& FBO, int width, int height)
+{
+    glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+    glTextureStorage2D(texture, 1, GL_DEPTH_COMPONENT16, width, height);
+    glTextureParameteri(texture, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTextureParameteri(texture, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTextureParameteri(texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glCreateFramebuffers(1, &FBO);
+    glNamedFramebufferTexture(FBO, GL_DEPTH_ATTACHMENT, texture, 0);
+    glNamedFramebufferDrawBuffer(FBO, GL_NONE);
+    glNamedFramebufferReadBuffer(FBO, GL_NONE);
+
+    if (glCheckNamedFramebufferStatus(FBO, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        printf("Shadow: atlas framebuffer is not complete!\n");
+}
+
+void createShadowAtlas()
+{
+    createShadowAtlasTarget(shadowAtlas.texture, shadowAtlas.FBO, SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE);
+    createShadowAtlasTarget(shadowAtlas.staticTexture, shadowAtlas.staticFBO, SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE);
+    createShadowAtlasTarget(shadowAtlas.stagingTexture, shadowAtlas.stagingFBO, 3 * MAX_CUBE_SHADOW_TILE, 2 * MAX_CUBE_SHADOW_TILE);
+
+    glCreateSamplers(1, &shadowAtlas.compareSampler);
+    glSamplerParameteri(shadowAtlas.compareSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glSamplerParameteri(shadowAtlas.compareSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glSamplerParameteri(shadowAtlas.compareSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glSamplerParameteri(shadowAtlas.compareSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glSamplerParameteri(shadowAtlas.compareSampler, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glSamplerParameteri(shadowAtlas.compareSampler, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+    printf("Shadow: %ix%i 16-bit shadow atlas, %i MB with its static copy and cube staging\n", SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE,
+        (int)((2ull * SHADOW_ATLAS_SIZE * SHADOW_ATLAS_SIZE + 6ull * MAX_CUBE_SHADOW_TILE * MAX_CUBE_SHADOW_TILE) * 2 / (1024 * 1024)));
+}
+
+/**
+ * Share of the screen a light's shadow can appear on, from the projected bounds of its shadow volume
+ *
+ *@return 1 for directional lights and volumes around the camera, SHADOW_OFFSCREEN_COVERAGE at least
+ */
+float shadowScreenCoverage(const Light& light, const glm::mat4& viewProjection)
+{
+    if (light.type == DIRECTIONAL)
+        return 1.f;
+
+    AABB volume = shadowVolumeAABB(light);
+    glm::vec2 low(1.f), high(-1.f);
+    for (int corner = 0; corner < 8; corner++)
+    {
+        glm::vec3 position((corner & 1) ? volume.max.x : volume.min.x, (corner & 2) ? volume.max.y : volume.min.y,
+            (corner & 4) ? volume.max.z : volume.min.z);
+        glm::vec4 clip = viewProjection * glm::vec4(position, 1.f);
+        if (clip.w <= 0.f)
+            return 1.f; // Part of the volume is behind the camera, which is as good as inside it
+        low = glm::min(low, glm::vec2(clip) / clip.w);
+        high = glm::max(high, glm::vec2(clip) / clip.w);
+    }
+
+    low = glm::clamp(low, glm::vec2(-1.f), glm::vec2(1.f));
+    high = glm::clamp(high, glm::vec2(-1.f), glm::vec2(1.f));
+    glm::vec2 extent = glm::max(high - low, glm::vec2(0.f));
+    return std::max(extent.x * extent.y / 4.f, SHADOW_OFFSCREEN_COVERAGE);
+}
+
+// Tile for a light whose shadow volume covers this share of the screen, halved each time it quarters below SHADOW_DETAIL_COVERAGE
+int shadowTileForCoverage(int maxTile, float coverage)
+{
+    int size = maxTile;
+    for (float limit = SHADOW_DETAIL_COVERAGE; coverage < limit && size > MIN_SHADOW_TILE; limit /= 4.f)
+        size /= 2;
+    return size;
+}
+
+/**
+ * Tile size a light needs, from how much of the screen its shadow volume covers
+ * Lights that are off or whose volume is outside the view frustum only keep a minimum tile,
+ * directional lights always cover the view so they always get the largest one
+ *
+ *@return tile size in texels, current is the light's previous request and is kept within the hysteresis band
+ */
+int requestShadowTile(const Light& light, const Frustum& view, const glm::mat4& viewProjection, int current)
+{
+    if (!light.isOn)
+        return MIN_SHADOW_TILE;
+    if (light.cascaded)
+        return MAX_CASCADE_TILE; // Cascades follow the camera, so they always cover the view
+    if (light.type == DIRECTIONAL)
+        return MAX_SHADOW_TILE;
+
+    if (testFrustumAABB(view, shadowVolumeAABB(light)) == FRUSTUM_OUTSIDE)
+        return MIN_SHADOW_TILE;
+
+    int maxTile = light.type == POSITIONAL ? MAX_CUBE_SHADOW_TILE : MAX_SHADOW_TILE;
+    float coverage = shadowScreenCoverage(light, viewProjection);
+    int smallest = shadowTileForCoverage(maxTile, coverage);
+    int largest = shadowTileForCoverage(maxTile, coverage * SHADOW_TILE_HYSTERESIS);
+    return std::min(std::max(current, smallest), largest);
+}
+
+// Shelf pack the regions of shadowAtlas.sizes, tallest first, each into the first row with room for it
+bool tryPackShadowAtlas()
+{
+    ShadowAtlas& atlas = shadowAtlas;
+    atlas.order.clear();
+    for (int i = 0; i < (int)lights.size(); i++)
+        atlas.order.push_back(i);
+    std::sort(atlas.order.begin(), atlas.order.end(), [](int a, int b)
+    {
+        int heightA = shadowRegionHeight(lights[a], shadowAtlas.sizes[a]);
+        int heightB = shadowRegionHeight(lights[b], shadowAtlas.sizes[b]);
+        if (heightA != heightB)
+            return heightA > heightB;
+        return a < b;
+    });
+
+    atlas.shelves.clear();
+    int top = 0;
+    for (int i : atlas.order)
+    {
+        ShadowStruct& shadow = lights[i].shadow;
+        int width = shadowRegionWidth(lights[i], atlas.sizes[i]);
+        int height = shadowRegionHeight(lights[i], atlas.sizes[i]);
+
+        bool placed = false;
+        for (glm::ivec3& shelf : atlas.shelves)
+        {
+            if (shelf.y >= height && shelf.z + width <= SHADOW_ATLAS_SIZE)
+            {
+                shadow.x = shelf.z;
+                shadow.y = shelf.x;
+                shelf.z += width;
+                placed = true;
+                break;
+            }
+        }
+        if (placed)
+            continue;
+
+        if (top + height > SHADOW_ATLAS_SIZE)
+            return false;
+        shadow.x = 0;
+        shadow.y = top;
+        atlas.shelves.push_back(glm::ivec3(top, height, width));
+        top += height;
+    }
+    return true;
+}
+
+/**
+ * Place every light's tile, shrinking the largest tiles (later lights first) until they all fit
+ * Lights whose tile moved or changed size are re-rendered from scratch on their next update
+ */
+void packShadowAtlas()
+{
+    ShadowAtlas& atlas = shadowAtlas;
+    atlas.sizes = atlas.requested;
+
+    // Remember where each light was, packing overwrites the tiles
+    atlas.previous.clear();
+    for (const Light& light : lights)
+        atlas.previous.push_back(glm::ivec3(light.shadow.x, light.shadow.y, light.shadow.size));
+
+    while (!tryPackShadowAtlas())
+    {
+        int largest = -1;
+        for (int i = 0; i < (int)lights.size(); i++)
+            if (atlas.sizes[i] > MIN_SHADOW_TILE && (largest < 0 || atlas.sizes[i] >= atlas.sizes[largest]))
+                largest = i;
+
+        if (largest >= 0)
+        {
+            atlas.sizes[largest] /= 2;
+            continue;
+        }
+
+        // Even minimum tiles do not fit, the last lights lose their shadows
+        int last = (int)lights.size() - 1;
+        while (last >= 0 && atlas.sizes[last] == 0)
+            last--;
+        if (last < 0)
+            break;
+        atlas.sizes[last] = 0;
+        printf("Shadow: atlas is full, light %i casts no shadows\n", last);
+    }
+
+    long long used = 0;
+    for (int i = 0; i < (int)lights.size(); i++)
+    {
+        ShadowStruct& shadow = lights[i].shadow;
+        shadow.size = atlas.sizes[i];
+        used += (long long)shadowRegionWidth(lights[i], shadow.size) * shadowRegionHeight(lights[i], shadow.size);
+
+        if (glm::ivec3(shadow.x, shadow.y, shadow.size) != atlas.previous[i])
+        {
+            // The old contents are somewhere else now, render the new tile before it is next sampled
+            shadow.updateShadow = true;
+            shadow.staticValid = false;
+            shadow.sinceUpdate = std::max(shadow.sinceUpdate, shadow.minInterval);
+        }
+    }
+
+    printf("Shadow: packed %i lights into the atlas, %.1f%% used\n", (int)lights.size(),
+        100.0 * used / ((double)SHADOW_ATLAS_SIZE * SHADOW_ATLAS_SIZE));
+}
+
+// Re-request every light's tile for the current camera and repack the atlas if any request changed
+void updateShadowAtlas(const glm::mat4& viewProjection)
+{
+    ShadowAtlas& atlas = shadowAtlas;
+    bool changed = atlas.requested.size() != lights.size();
+    atlas.requested.resize(lights.size(), 0);
+
+    Frustum view = frustumFromMatrix(viewProjection);
+    for (int i = 0; i < (int)lights.size(); i++)
+    {
+        int size = requestShadowTile(lights[i], view, viewProjection, atlas.requested[i]);
+        changed = changed || size != atlas.requested[i];
+        atlas.requested[i] = size;
+    }
+
+    if (changed)
+        packShadowAtlas();
+}
+
+// Viewport and scissor of a shadow pass, the scissor keeps clears and any stray fragments inside the tile
+void setShadowViewport(GLuint index, int x, int y, int width, int height)
+{
+    glViewportIndexedf(index, (float)x, (float)y, (float)width, (float)height);
+    glScissorIndexed(index, x, y, width, height);
+}
+
+// Start a shadow map update from the depth of the static models in the same region of the static atlas
+void copyStaticShadow(const Light& light)
+{
+    const ShadowStruct& shadow = light.shadow;
+    glCopyImageSubData(shadowAtlas.staticTexture, GL_TEXTURE_2D, 0, shadow.x, shadow.y, 0,
+        shadowAtlas.texture, GL_TEXTURE_2D, 0, shadow.x, shadow.y, 0,
+        shadowRegionWidth(light, shadow.size), shadowRegionHeight(light, shadow.size), 1);
+}
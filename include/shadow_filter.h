@@ -0,0 +1,169 @@
+#pragma once
+#include <cstdio>
+#include <GL/gl3w.h>
+
+#include "frame_stats.h"
+#include "light.h"
+#include "render_state.h"
+#include "shader.h"
+#include "shadow_atlas.h"
+
+// Ways the lighting shader filters shadows, must match pbr.frag
+// PCF compares every tap of the depth atlas in the shader
+// HARDWARE_PCF is the SHADOW_FILTER_HARDWARE_PCF permutation of pbr.frag, each tap compares and bilinearly filters 2 x 2 texels
+// in the sampler so a 4 tap kernel replaces the 9 and 20 tap ones
+// EVSM are exponential variance shadow maps, each time a light's depth is rendered its region is warped into moments at
+// half resolution, blurred and mipmapped, so the shadow is one filtered fetch and the filtering cost follows shadow updates
+enum ShadowFilter
+{
+    SHADOW_FILTER_PCF,
+    SHADOW_FILTER_HARDWARE_PCF,
+    SHADOW_FILTER_EVSM,
+    SHADOW_FILTERS
+};
+
+const char* shadowFilterNames[SHADOW_FILTERS] = { "PCF", "hardware PCF", "EVSM" };
+
+// Moments use the atlas layout at half resolution, region origins are multiples of MIN_SHADOW_TILE / 2 texels
+// so no level below 2^6 mixes two tiles
+#define SHADOW_MOMENTS_SIZE (SHADOW_ATLAS_SIZE / 2)
+#define SHADOW_MOMENT_LEVELS 6
+
+// Largest region in the moments, a point light's faces, the blur's scratch texture holds one
+#define SHADOW_BLUR_WIDTH (3 * MAX_CUBE_SHADOW_TILE / 2)
+#define SHADOW_BLUR_HEIGHT (2 * MAX_CUBE_SHADOW_TILE / 2)
+
+static_assert(MAX_SHADOW_TILE / 2 <= SHADOW_BLUR_HEIGHT && 2 * MAX_CASCADE_TILE / 2 <= SHADOW_BLUR_WIDTH &&
+    2 * MAX_CASCADE_TILE / 2 <= SHADOW_BLUR_HEIGHT, "Every light's region must fit in the blur texture");
+static_assert((MIN_SHADOW_TILE / 2) >> (SHADOW_MOMENT_LEVELS - 1) >= 1, "Moment levels must not mix tiles");
+
+struct ShadowMoments
+{
+    // RGBA16F, positive and negative warped depth and their squares
+    GLuint texture = 0;
+    GLuint levelViews[SHADOW_MOMENT_LEVELS] = {}; // One level each, so a level can be read while the next is rendered
+    GLuint levelFBOs[SHADOW_MOMENT_LEVELS] = {};
+
+    GLuint blurTexture = 0;
+    GLuint blurFBO = 0;
+    GLuint vertexArray = 0; // Empty, the passes draw a single triangle from gl_VertexID
+
+    GLuint resolveProgram = 0;
+    GLuint blurProgram = 0;
+    GLuint downsampleProgram = 0;
+    GLint perspectiveDepth = -1;
+    GLint direction = -1;
+    GLint sourceOrigin = -1;
+    GLint targetOrigin = -1;
+    GLint tileSize = -1;
+};
+
+ShadowMoments shadowMoments;
+ShadowFilter shadowFilter = SHADOW_FILTER_EVSM;
+
+GLuint createMomentsTarget(GLuint texture, GLint level)
+{
+    GLuint FBO;
+    glCreateFramebuffers(1, &FBO);
+    glNamedFramebufferTexture(FBO, GL_COLOR_ATTACHMENT0, texture, level);
+    glNamedFramebufferDrawBuffer(FBO, GL_COLOR_ATTACHMENT0);
+
+    if (glCheckNamedFramebufferStatus(FBO, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        printf("Shadow: moments framebuffer is not complete!\n");
+    return FBO;
+}
+
+// Create the moments and their blur texture, the programs are shadowFilter.vert with evsmResolve, evsmBlur and evsmDownsample
+void createShadowMoments(GLuint resolveProgram, GLuint blurProgram, GLuint downsampleProgram)
+{
+    ShadowMoments& moments = shadowMoments;
+    glCreateTextures(GL_TEXTURE_2D, 1, &moments.texture);
+    glTextureStorage2D(moments.texture, SHADOW_MOMENT_LEVELS, GL_RGBA16F, SHADOW_MOMENTS_SIZE, SHADOW_MOMENTS_SIZE);
+    glTextureParameteri(moments.texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTextureParameteri(moments.texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureParameteri(moments.texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(moments.texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // Views need names that have never been bound, so they come from glGenTextures rather than glCreateTextures
+    glGenTextures(SHADOW_MOMENT_LEVELS, moments.levelViews);
+    for (int level = 0; level < SHADOW_MOMENT_LEVELS; level++)
+    {
+        glTextureView(moments.levelViews[level], GL_TEXTURE_2D, moments.texture, GL_RGBA16F, level, 1, 0, 1);
+        moments.levelFBOs[level] = createMomentsTarget(moments.texture, level);
+    }
+
+    glCreateTextures(GL_TEXTURE_2D, 1, &moments.blurTexture);
+    glTextureStorage2D(moments.blurTexture, 1, GL_RGBA16F, SHADOW_BLUR_WIDTH, SHADOW_BLUR_HEIGHT);
+    moments.blurFBO = createMomentsTarget(moments.blurTexture, 0);
+    glCreateVertexArrays(1, &moments.vertexArray);
+
+    moments.resolveProgram = resolveProgram;
+    moments.blurProgram = blurProgram;
+    moments.downsampleProgram = downsampleProgram;
+    moments.perspectiveDepth = uniformLocation(moments.resolveProgram, "perspectiveDepth");
+    glProgramUniform2f(moments.resolveProgram, uniformLocation(moments.resolveProgram, "depthRange"), SHADOW_NEAR_PLANE, SHADOW_FAR_PLANE);
+    moments.direction = uniformLocation(moments.blurProgram, "direction");
+    moments.sourceOrigin = uniformLocation(moments.blurProgram, "sourceOrigin");
+    moments.targetOrigin = uniformLocation(moments.blurProgram, "targetOrigin");
+    moments.tileSize = uniformLocation(moments.blurProgram, "tileSize");
+
+    long long bytes = 0;
+    for (int level = 0; level < SHADOW_MOMENT_LEVELS; level++)
+        bytes += 8ll * (SHADOW_MOMENTS_SIZE >> level) * (SHADOW_MOMENTS_SIZE >> level);
+    bytes += 8ll * SHADOW_BLUR_WIDTH * SHADOW_BLUR_HEIGHT;
+    printf("Shadow: %ix%i EVSM moments with %i levels, %i MB with the blur texture\n", SHADOW_MOMENTS_SIZE, SHADOW_MOMENTS_SIZE,
+        SHADOW_MOMENT_LEVELS, (int)(bytes / (1024 * 1024)));
+}
+
+/**
+ * Rebuild a light's moments from its region of the depth atlas, call after the light's shadow is rendered
+ * Warps the depth at half resolution, blurs it across and down within each face or cascade, then fills the levels below
+ */
+void filterShadowMoments(const Light& light)
+{
+    const ShadowStruct& shadow = light.shadow;
+    ShadowMoments& moments = shadowMoments;
+    int x = shadow.x / 2, y = shadow.y / 2, size = shadow.size / 2;
+    int width = shadowRegionWidth(light, size), height = shadowRegionHeight(light, size);
+
+    // Blending is left on by start up, it would mix the moments with what was there before
+    glDisable(GL_BLEND);
+    bindVertexArray(moments.vertexArray);
+
+    useProgram(moments.resolveProgram);
+    glUniform1i(moments.perspectiveDepth, light.type == SPOT ? 1 : 0);
+    bindTextureUnit(0, shadowAtlas.texture);
+    glBindFramebuffer(GL_FRAMEBUFFER, moments.levelFBOs[0]);
+    glViewport(x, y, width, height);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    // Across into the blur texture, then down back into the moments
+    useProgram(moments.blurProgram);
+    glUniform1i(moments.tileSize, size);
+    glUniform2i(moments.direction, 1, 0);
+    glUniform2i(moments.sourceOrigin, x, y);
+    glUniform2i(moments.targetOrigin, 0, 0);
+    bindTextureUnit(0, moments.levelViews[0]);
+    glBindFramebuffer(GL_FRAMEBUFFER, moments.blurFBO);
+    glViewport(0, 0, width, height);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    glUniform2i(moments.direction, 0, 1);
+    glUniform2i(moments.sourceOrigin, 0, 0);
+    glUniform2i(moments.targetOrigin, x, y);
+    bindTextureUnit(0, moments.blurTexture);
+    glBindFramebuffer(GL_FRAMEBUFFER, moments.levelFBOs[0]);
+    glViewport(x, y, width, height);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    useProgram(moments.downsampleProgram);
+    for (int level = 1; level < SHADOW_MOMENT_LEVELS; level++)
+    {
+        bindTextureUnit(0, moments.levelViews[level - 1]);
+        glBindFramebuffer(GL_FRAMEBUFFER, moments.levelFBOs[level]);
+        glViewport(x >> level, y >> level, width >> level, height >> level);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
@@ -0,0 +1,188 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "bvh.h"
+#include "light.h"
+#include "shadow_atlas.h"
+
+// Spreads shadow map updates over frames so a burst of dirty lights does not turn into one long frame
+// Every frame the dirty lights are ranked by how much of the screen they light and how long they have waited, then
+// updated in that order until the frame's GPU budget is spent, point lights a few cube faces at a time
+#define SHADOW_FRAME_BUDGET_MS 2.f
+
+// A waiting light's priority grows by its base priority every this many seconds, so dim lights are never starved
+#define SHADOW_STALENESS_SECONDS 0.25f
+
+// Cost of each kind of update until the GPU timers have measured it
+#define DEFAULT_SHADOW_MAP_MS 0.25f
+#define DEFAULT_CASCADES_MS 1.f
+#define DEFAULT_CUBE_FACE_MS 0.2f
+
+#define ALL_CUBE_FACES 0x3fu
+
+struct ShadowUpdateCosts
+{
+    float mapMs = DEFAULT_SHADOW_MAP_MS;    // A directional or spot light's map, with its moments when filtered
+    float cascadesMs = DEFAULT_CASCADES_MS; // Every cascade of the cascaded light
+    float faceMs = DEFAULT_CUBE_FACE_MS;    // One face of a point light
+};
+
+// Work for this frame, faces has a bit per cube face to render for point lights
+struct ShadowUpdate
+{
+    int light;
+    unsigned int faces;
+};
+
+/**
+ * A point light update spread over frames, its faces are rendered into the atlas' staging region and only copied
+ * over the light's tile once all six are there, so the lighting keeps sampling the previous complete cube until then
+ * The matrices are captured when the update starts, so every face of one cube sees the light from the same place
+ */
+struct CubeShadowProgress
+{
+    int light = -1;              // -1 when no cube update is in progress
+    unsigned int done = 0;       // Faces in the staging region so far
+    unsigned int staticStale = 0; // Faces whose static depth must be rendered again before it is copied
+    glm::mat4 matrices[6];
+    glm::vec3 position;
+    glm::ivec3 tile;             // x, y and size of the light's tile when the update started
+};
+
+struct ShadowScheduler
+{
+    std::vector<int> candidates;
+    std::vector<float> priorities;
+    std::vector<ShadowUpdate> updates;
+    CubeShadowProgress cube;
+};
+
+ShadowScheduler shadowScheduler;
+
+int cubeFaceCount(unsigned int faces)
+{
+    int count = 0;
+    for (; faces; faces &= faces - 1)
+        count++;
+    return count;
+}
+
+// How much a light's stale shadow costs the image, its screen share times its brightness, growing the longer it waits
+float shadowUpdatePriority(const Light& light, const glm::mat4& viewProjection)
+{
+    float brightness = light.intensity * std::max(light.colour.r, std::max(light.colour.g, light.colour.b));
+    return shadowScreenCoverage(light, viewProjection) * brightness * (1.f + light.shadow.sinceUpdate / SHADOW_STALENESS_SECONDS);
+}
+
+// Begin spreading a point light's update over frames from where the light is now
+void startCubeShadowUpdate(int lightIndex)
+{
+    CubeShadowProgress& cube = shadowScheduler.cube;
+    Light& light = lights[lightIndex];
+    cube.light = lightIndex;
+    cube.done = 0;
+    cube.staticStale = light.shadow.staticValid ? 0 : ALL_CUBE_FACES;
+    std::copy(light.shadowMatrices, light.shadowMatrices + 6, cube.matrices);
+    cube.position = light.position;
+    cube.tile = glm::ivec3(light.shadow.x, light.shadow.y, light.shadow.size);
+
+    // The static faces are re-rendered as the update reaches them, and changes from now on need another update
+    light.shadow.staticValid = true;
+    light.shadow.updateShadow = false;
+}
+
+/**
+ * Choose the shadow updates of this frame into shadowScheduler.updates, most important first
+ * Directional and spot maps and the cascades are updated whole, point lights take as many faces as fit, and one update
+ * is always made so an update dearer than the whole budget still happens. Dirty flags are cleared as updates are chosen
+ */
+void scheduleShadowUpdates(const glm::mat4& viewProjection, const ShadowUpdateCosts& costs)
+{
+    ShadowScheduler& scheduler = shadowScheduler;
+    CubeShadowProgress& cube = scheduler.cube;
+    scheduler.updates.clear();
+
+    // A cube update is dropped if its light was switched off and restarted if the atlas moved its tile
+    if (cube.light >= (int)lights.size() || (cube.light >= 0 && (!lights[cube.light].isOn || lights[cube.light].shadow.size == 0)))
+    {
+        if (cube.light < (int)lights.size())
+            lights[cube.light].shadow.updateShadow = true;
+        cube.light = -1;
+    }
+    if (cube.light >= 0)
+    {
+        const ShadowStruct& shadow = lights[cube.light].shadow;
+        if (glm::ivec3(shadow.x, shadow.y, shadow.size) != cube.tile)
+        {
+            lights[cube.light].shadow.staticValid = false;
+            startCubeShadowUpdate(cube.light);
+        }
+    }
+
+    scheduler.candidates.clear();
+    scheduler.priorities.resize(lights.size());
+    for (int i = 0; i < (int)lights.size(); i++)
+    {
+        const Light& light = lights[i];
+        const ShadowStruct& shadow = light.shadow;
+        bool dirty = shadow.updateShadow && light.isOn && shadow.size > 0 && shadow.sinceUpdate >= shadow.minInterval;
+        if (!dirty && i != cube.light)
+            continue;
+        scheduler.candidates.push_back(i);
+        scheduler.priorities[i] = shadowUpdatePriority(light, viewProjection);
+    }
+    std::sort(scheduler.candidates.begin(), scheduler.candidates.end(), [](int a, int b)
+    {
+        if (shadowScheduler.priorities[a] != shadowScheduler.priorities[b])
+            return shadowScheduler.priorities[a] > shadowScheduler.priorities[b];
+        return a < b;
+    });
+
+    float spentMs = 0.f;
+    for (int i : scheduler.candidates)
+    {
+        Light& light = lights[i];
+        if (light.type == POSITIONAL)
+        {
+            // The staging region holds one cube, other point lights wait until it is copied over
+            if (cube.light >= 0 && cube.light != i)
+                continue;
+
+            unsigned int remaining = cube.light == i ? ALL_CUBE_FACES & ~cube.done : ALL_CUBE_FACES;
+            unsigned int faces = 0;
+            for (int face = 0; face < 6; face++)
+            {
+                if (!(remaining & (1u << face)) || (spentMs > 0.f && spentMs + costs.faceMs > SHADOW_FRAME_BUDGET_MS))
+                    continue;
+                faces |= 1u << face;
+                spentMs += costs.faceMs;
+            }
+            if (!faces)
+                continue;
+
+            if (cube.light != i)
+                startCubeShadowUpdate(i);
+            ShadowUpdate update = { i, faces };
+            scheduler.updates.push_back(update);
+            continue;
+        }
+
+        float cost = light.cascaded ? costs.cascadesMs : costs.mapMs;
+        if (spentMs > 0.f && spentMs + cost > SHADOW_FRAME_BUDGET_MS)
+            continue; // A cheaper update further down may still fit
+        spentMs += cost;
+        light.shadow.updateShadow = false;
+        ShadowUpdate update = { i, 1u };
+        scheduler.updates.push_back(update);
+    }
+}
+
+// Call once the staging region has been copied over the light's tile
+void finishCubeShadowUpdate()
+{
+    CubeShadowProgress& cube = shadowScheduler.cube;
+    lights[cube.light].shadow.sinceUpdate = 0.f;
+    cube.light = -1;
+}
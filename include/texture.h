@@ -1,60 +1,246 @@
 #pragma once
 
 #include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include "stb_image.h"
 
+#include "asset_loader.h"
+#include "frame_stats.h"
+
+// Sampler and format options a texture is created with, part of the texture registry key
+struct TextureOptions
+{
+	GLint wrap = GL_REPEAT;
+	GLint minFilter = GL_LINEAR_MIPMAP_LINEAR;
+	GLint magFilter = GL_LINEAR;
+};
+
+struct DecodedImage
+{
+	unsigned char* pixels = nullptr;
+	int width = 0;
+	int height = 0;
+	int channels = 0;
+};
+
+// Decode an image file into memory, touches no GL state so it is safe to run on a loader worker
+DecodedImage decode_image(const char* filename)
+{
+	DecodedImage image;
+	stbi_set_flip_vertically_on_load_thread(true);
+	image.pixels = stbi_load(filename, &image.width, &image.height, &image.channels, 0);
+	return image;
+}
+
+// Upload a decoded image into an existing texture object and free the decoded pixels
+bool upload_texture(GLuint texObject, DecodedImage& image, const char* filename, const TextureOptions& options = TextureOptions())
+{
+	glBindTexture(GL_TEXTURE_2D, texObject);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, options.wrap);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, options.wrap);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, options.magFilter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, options.minFilter);
+
+	if (!image.pixels)
+	{
+		printf("Texture: Failed to load %s\n", filename);
+		return false;
+	}
+
+	// Choose format based on number of channels
+	GLint internalFormat;
+	GLenum format;
+
+	if (image.channels == 1) {
+		internalFormat = GL_RED;
+		format = GL_RED;
+	}
+	else if (image.channels == 3) {
+		internalFormat = GL_RGB;
+		format = GL_RGB;
+	}
+	else if (image.channels == 4) {
+		internalFormat = GL_RGBA;
+		format = GL_RGBA;
+	}
+	else {
+		printf("Unsupported number of channels: %d in %s\n", image.channels, filename);
+		stbi_image_free(image.pixels);
+		image.pixels = nullptr;
+		return false;
+	}
+
+	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, image.width, image.height, 0, format, GL_UNSIGNED_BYTE, image.pixels);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	stbi_image_free(image.pixels);
+	image.pixels = nullptr;
+
+	printf("Texture: Successfully loaded %s\n", filename);
+	return true;
+}
+
 GLuint setup_texture(const char* filename)
 {
-	glEnable(GL_TEXTURE_2D);
-	glEnable(GL_BLEND);
+	GLuint texObject;
+	glGenTextures(1, &texObject);
 
+	DecodedImage image = decode_image(filename);
+	upload_texture(texObject, image, filename);
+	return texObject;
+}
+
+/**
+ * Asynchronous version of setup_texture, the image is decoded on a loader worker
+ *
+ *@param onUploaded called on the context thread with the texture and the number of bytes uploaded, 0 if the image
+ *                  could not be decoded or uploaded
+ *@return texture object that is valid immediately and receives its pixels in finishLoadingAssets()
+ */
+GLuint request_texture(const std::string& filename, const TextureOptions& options = TextureOptions(),
+	std::function<void(GLuint, size_t)> onUploaded = nullptr)
+{
 	GLuint texObject;
 	glGenTextures(1, &texObject);
-	glBindTexture(GL_TEXTURE_2D, texObject);
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	std::shared_ptr<DecodedImage> image = std::make_shared<DecodedImage>();
+	queueAsset("texture", filename,
+		[image, filename]() { *image = decode_image(filename.c_str()); },
+		[image, texObject, filename, options, onUploaded]()
+		{
+			size_t bytes = (size_t)image->width * image->height * image->channels;
+			bool uploaded = upload_texture(texObject, *image, filename.c_str(), options);
+			if (onUploaded)
+				onUploaded(texObject, uploaded ? bytes + bytes / 3 : 0); // full mip chain adds roughly a third
+		},
+		[texObject, onUploaded]()
+		{
+			if (onUploaded)
+				onUploaded(texObject, 0);
+		});
 
-	int w, h, chan;
-	stbi_set_flip_vertically_on_load(true);
-	unsigned char* pxls = stbi_load(filename, &w, &h, &chan, 0);
-	if (pxls)
+	return texObject;
+}
+
+///////////////////////
+// Texture registry //
+///////////////////////
+
+// One GL texture per canonical path and option set, shared by every material that uses it
+struct TextureEntry
+{
+	std::string key;
+	int refCount = 0;
+	size_t bytes = 0;
+	bool pending = true; // Its upload is still queued in the asset loader
+	bool failed = false; // Its file could not be loaded, the texture stays empty and the next acquire tries again
+};
+
+struct TextureRegistry
+{
+	std::unordered_map<std::string, GLuint> byKey;
+	std::unordered_map<GLuint, TextureEntry> entries;
+	// Released before their upload ran, deleted once it has so the name cannot be reused under the queued upload
+	std::unordered_set<GLuint> releasedPending;
+	int hits = 0;
+	int misses = 0;
+	size_t bytesResident = 0;
+};
+
+TextureRegistry textureRegistry;
+
+std::string texture_key(const std::string& path, const TextureOptions& options)
+{
+	return canonical_path(path) + "|" + std::to_string(options.wrap) + "|" + std::to_string(options.minFilter) + "|" + std::to_string(options.magFilter);
+}
+
+/**
+ * Get the shared texture for a file, decoding and uploading it only the first time it is asked for
+ * Every call must be matched with release_texture()
+ */
+GLuint acquire_texture(const std::string& path, const TextureOptions& options = TextureOptions())
+{
+	std::string key = texture_key(path, options);
+
+	auto found = textureRegistry.byKey.find(key);
+	if (found != textureRegistry.byKey.end())
 	{
-		// Choose format based on number of channels
-		GLint internalFormat;
-		GLenum format;
+		textureRegistry.hits++;
+		textureRegistry.entries[found->second].refCount++;
+		return found->second;
+	}
 
-		if (chan == 1) {
-			internalFormat = GL_RED;
-			format = GL_RED;
-		}
-		else if (chan == 3) {
-			internalFormat = GL_RGB;
-			format = GL_RGB;
-		}
-		else if (chan == 4) {
-			internalFormat = GL_RGBA;
-			format = GL_RGBA;
+	textureRegistry.misses++;
+	GLuint texObject = request_texture(path, options, [](GLuint uploadedTexture, size_t bytes)
+	{
+		// The entry may already have been released before the upload was drained, its name is only free now
+		auto entry = textureRegistry.entries.find(uploadedTexture);
+		if (entry == textureRegistry.entries.end())
+		{
+			if (textureRegistry.releasedPending.erase(uploadedTexture) > 0)
+				glDeleteTextures(1, &uploadedTexture);
+			return;
 		}
-		else {
-			printf("Unsupported number of channels: %d in %s\n", chan, filename);
-			stbi_image_free(pxls);
-			return 0;
+		entry->second.pending = false;
+		if (bytes == 0)
+		{
+			// Forget the key so the file is loaded again the next time it is asked for, this name is freed on release
+			entry->second.failed = true;
+			textureRegistry.byKey.erase(entry->second.key);
+			return;
 		}
+		entry->second.bytes = bytes;
+		textureRegistry.bytesResident += bytes;
+	});
 
-		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, w, h, 0, format, GL_UNSIGNED_BYTE, pxls);
-		glGenerateMipmap(GL_TEXTURE_2D);
-		delete[] pxls;
-		glDisable(GL_TEXTURE_2D);
-		glDisable(GL_BLEND);
-	}
-
-	printf("Texture: Successfully loaded %s\n", filename);
+	TextureEntry& entry = textureRegistry.entries[texObject];
+	entry.key = key;
+	entry.refCount = 1;
+	textureRegistry.byKey[key] = texObject;
 	return texObject;
 }
 
+// Add a reference to a texture that is already in the registry, e.g. when a model is duplicated
+void retain_texture(GLuint texObject)
+{
+	auto entry = textureRegistry.entries.find(texObject);
+	if (entry != textureRegistry.entries.end())
+		entry->second.refCount++;
+}
+
+// Drop a reference, the GL texture is deleted once nothing uses it anymore and its upload has run
+void release_texture(GLuint texObject)
+{
+	auto entry = textureRegistry.entries.find(texObject);
+	if (entry == textureRegistry.entries.end())
+		return;
+
+	if (--entry->second.refCount > 0)
+		return;
+
+	// A failed entry's key may already belong to a texture loaded again since, which stays registered
+	bool pending = entry->second.pending;
+	textureRegistry.bytesResident -= entry->second.bytes;
+	if (!entry->second.failed)
+		textureRegistry.byKey.erase(entry->second.key);
+	textureRegistry.entries.erase(entry);
+	if (pending)
+		textureRegistry.releasedPending.insert(texObject);
+	else
+		glDeleteTextures(1, &texObject);
+}
+
+void print_texture_stats()
+{
+	printf("Texture registry: %d unique textures, %d hits, %d misses, %.2f MB resident\n",
+		(int)textureRegistry.entries.size(), textureRegistry.hits, textureRegistry.misses,
+		textureRegistry.bytesResident / (1024.0 * 1024.0));
+}
+
 GLuint setup_mipmaps(const char* filename[], int n)
 {
 	glEnable(GL_TEXTURE_2D);